@@ -0,0 +1,861 @@
+// bench_main.c - host benchmark of the P1 state machine
+//
+// sm_P1 from main/process.c is driven through the event loop by synthetic event streams. gpio, esp_timer
+// and iot_button are replaced by the stand-ins in stubs/: button clicks go through the button callback of
+// proc.c, as on the board. Blink changer ticks are posted as the timer wheel posts them on expiry; the
+// esp_timer of the wheel does not run on the host.
+//
+// Post-to-action latency: every button click and tick in a steady state of P1 ends in an action which
+// calls set_opmode(), so the benchmark subscribes to the operative mode and takes the time between
+// the post of an event and the change it causes. The post times are kept in one FIFO per priority level,
+// because the loop serves each level in order, but not the levels in the order of posting. The FIFO is
+// chosen by sm_P1.event, the event being dispatched.
+//
+// The producer modes show the cost of waking the loop: in BENCH_BURST the producer runs above the loop
+// task and the loop is woken once per burst; in BENCH_STREAM the producer runs below it and every post
+// wakes the loop; in BENCH_BULK every burst is posted by one evloop_post_events() call. The "wakeups"
+// field counts the context switches to the loop task.
+//
+// The LED patterns of the five blink periods are checked on the mock backend of the LED pattern engine
+// and reported with the CPU wakeups per second they cost: one per edge with the former esp_timer toggle,
+// none with the engine, which works only when the pattern changes.
+//
+// The interrupt driven button input of btnin.c is driven through the mock GPIO of stubs/ on a virtual
+// clock: 1 to 16 buttons make single and double clicks, long presses with repeats and glitches, with
+// contact bounces. The events classified are checked, and the wakeups per second and the time per wakeup
+// as buttons are added are compared with the sampling timer of espressif/button, the input path of the
+// workloads.
+//
+// The instance scaling benchmark broadcasts an event which has no transition in the current state to
+// groups of 1 to 1024 P1 instances, once by the sweep of evloop_group_dispatch() over the state array of
+// the group and once by evloop_dispatch() over as many separate machines, and prints the time per
+// instance.
+//
+// The group tick benchmark starts a group of 1024 P1 instances with P1_start_group() and lets three periods
+// of their blink changer timers pass on the virtual clock, one wheel tick at a time. Every timer posts to
+// its own instance, so each instance must take one transition per tick, while sm_P1, the operative mode
+// and the queues of the loops see nothing of it. The group is registered for the whole run, so the
+// broadcasts of the other workloads also sweep its stopped instances.
+//
+// The loop scaling benchmark runs one instance of a machine with a fixed cost action on each of the first
+// 1 to CONFIG_EVLOOP_LOOPS event loops, posts events to them round robin with evloop_post_to() and prints
+// the events per second. With CONFIG_EVLOOP_PTHREADS the loops are pthreads and run in parallel.
+//
+// Each workload prints one JSON line on stdout. When the environment variable SMDEMO_BENCH_OUT is set,
+// the lines are appended to that file too. SMDEMO_BENCH_COMMIT, when set, is copied to the "commit" field.
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "commondefs.h"
+#include "state_machine.h"
+#include "process.h"
+#include "evloop.h"
+#include "proc.h"
+#include "ledpat.h"
+#include "twheel.h"
+#include "btnin.h"
+#include "bench_stubs.h"
+
+// Priorities of the producer: above the event loop task while a burst is posted, so events are queued,
+// and below it between bursts, so the queue is drained.
+#define BENCH_PRIO_BURST    (6)
+#define BENCH_PRIO_DRAIN    (1)
+
+#define BENCH_FIFO_SIZE     (64)
+#define BENCH_FIFO_MASK     (BENCH_FIFO_SIZE - 1)
+
+_Static_assert(BENCH_FIFO_SIZE > CONFIG_EVLOOP_RING_SIZE + 1, "BENCH_FIFO_SIZE is too small");
+
+typedef enum {
+    BENCH_BURST = 0,        // bursts posted one by one above the priority of the loop task
+    BENCH_STREAM,           // events posted one by one below the priority of the loop task
+    BENCH_BULK,             // bursts posted by evloop_post_events() below the priority of the loop task
+} bench_mode_t;
+
+typedef struct {
+    const char* name;
+    bench_mode_t mode;
+    uint32_t burst;         // events posted in one burst
+    bool random_burst;      // burst is the maximum, the length of each burst is random
+    uint8_t button_pct;     // share of button clicks, the rest are blink changer ticks
+    uint8_t noise_pct;      // share of events without transition in the steady states (lost events)
+    uint32_t max_gap_us;    // maximal random pause between bursts
+} bench_workload_t;
+
+static const bench_workload_t workloads[] = {
+    { "button_storm",      BENCH_BURST,  2 * CONFIG_EVLOOP_RING_SIZE, false, 100, 0, 0 },
+    { "tick_flood",        BENCH_BURST,  2 * CONFIG_EVLOOP_RING_SIZE, false, 0,   0, 0 },
+    { "mixed",             BENCH_BURST,  CONFIG_EVLOOP_RING_SIZE / 2, true,  50,  5, CONFIG_BENCH_MIXED_MAX_GAP_US },
+    { "click_stream",      BENCH_STREAM, CONFIG_EVLOOP_RING_SIZE / 2, false, 100, 0, 0 },
+    { "click_stream_bulk", BENCH_BULK,   CONFIG_EVLOOP_RING_SIZE / 2, false, 100, 0, 0 },
+};
+
+// Post times of the events in the queue of one priority level: written by the producer, read by the
+// event loop task.
+typedef struct {
+    uint64_t posted[BENCH_FIFO_SIZE];
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+} bench_fifo_t;
+
+static bench_fifo_t fifos[EV_PRIO_LEVELS];
+
+static const uint8_t event_priority[sm_EVENTS_NUMBER] = {
+    #define X(name, prio, ...) prio,
+    EVENT_LIST
+    #undef X
+};
+
+extern sm_machine_t sm_P1;
+
+static uint64_t latencies[CONFIG_BENCH_EVENTS];
+static _Atomic uint32_t latencies_count = 0;
+static _Atomic bool recording = false;
+
+static uint32_t rnd_state = 0x12345678;
+
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+// static void on_opmode_change(device_modes_t old_mode, device_modes_t new_mode, void* arg)
+// Input: see opmode_change_cb_t
+// Output: none
+// Description: This callback runs in the event loop task, in the action of the transition. It takes
+// the post time of the oldest event in the FIFO and records the latency.
+static void on_opmode_change(device_modes_t old_mode, device_modes_t new_mode, void* arg)
+{
+    uint64_t now = bench_time_ns();
+    bench_fifo_t* f = &fifos[event_priority[sm_P1.event]];
+    uint32_t tail = atomic_load_explicit(&f->tail, memory_order_relaxed);
+
+    if (!atomic_load_explicit(&recording, memory_order_relaxed) ||
+        (tail == atomic_load_explicit(&f->head, memory_order_acquire))) {
+        return;
+    }
+    uint64_t posted = f->posted[tail & BENCH_FIFO_MASK];
+    atomic_store_explicit(&f->tail, tail + 1, memory_order_release);
+
+    uint32_t n = atomic_load_explicit(&latencies_count, memory_order_relaxed);
+    if (n < ARRAY_SIZE(latencies)) {
+        latencies[n] = now - posted;
+        atomic_store_explicit(&latencies_count, n + 1, memory_order_relaxed);
+    }
+}
+
+// static void bench_post(sm_event_type_t event)
+// Input:
+//  event: event to be produced
+// Output: none
+// Description: This function produces one event by the path it takes on the board. The post time is
+// pushed before the post, because the event loop task may run the action before evloop_post() returns.
+// If the event is dropped or coalesced with a queued tick, the time is taken back; the event loop never
+// consumes it, because there is no action for it. Button clicks block on a full queue instead of being
+// dropped, see their overflow policy in EVENT_LIST.
+static void bench_post(sm_event_type_t event)
+{
+    evloop_stats_t stats;
+    bool timed = (event == evButtonSingleClick) || (event == ev_t_blink_changer_tick);
+    bench_fifo_t* f = &fifos[event_priority[event]];
+    uint32_t head = atomic_load_explicit(&f->head, memory_order_relaxed);
+
+    evloop_get_stats(&stats);
+    uint32_t dropped = stats.dropped;
+    uint32_t coalesced = stats.coalesced;
+
+    if (timed) {
+        f->posted[head & BENCH_FIFO_MASK] = bench_time_ns();
+        atomic_store_explicit(&f->head, head + 1, memory_order_release);
+    }
+
+    switch (event) {
+        case evButtonSingleClick:
+            bench_button_emit(BUTTON_SINGLE_CLICK);
+            break;
+        default:
+            evloop_post(event);
+            break;
+    }
+
+    if (timed) {
+        evloop_get_stats(&stats);
+        if ((stats.dropped != dropped) || (stats.coalesced != coalesced)) {
+            atomic_store_explicit(&f->head, head, memory_order_release);
+        }
+    }
+}
+
+// static void bench_post_bulk(const sm_event_type_t* events, uint32_t n)
+// Input:
+//  events: events of one burst
+//  n: number of events
+// Output: none
+// Description: This function posts a burst with one evloop_post_events() call. The post times of all
+// timed events are pushed first and taken back if the burst is dropped. All events of a burst must have
+// the same priority, because evloop_post_events() queues them in one ring.
+static void bench_post_bulk(const sm_event_type_t* events, uint32_t n)
+{
+    bench_fifo_t* f = &fifos[event_priority[events[0]]];
+    uint32_t head = atomic_load_explicit(&f->head, memory_order_relaxed);
+    uint32_t pushed = head;
+    uint64_t now = bench_time_ns();
+
+    for (uint32_t i = 0; i < n; i++) {
+        if ((events[i] == evButtonSingleClick) || (events[i] == ev_t_blink_changer_tick)) {
+            f->posted[pushed++ & BENCH_FIFO_MASK] = now;
+        }
+    }
+    atomic_store_explicit(&f->head, pushed, memory_order_release);
+
+    if (evloop_post_events(events, n) != ESP_OK) {
+        atomic_store_explicit(&f->head, head, memory_order_release);
+    }
+}
+
+static void bench_wait_idle(void)
+{
+    evloop_stats_t stats;
+
+    do {
+        vTaskDelay(1);
+        evloop_get_stats(&stats);
+    } while (stats.dispatched + stats.evicted != stats.posted);
+}
+
+// Busy variant of bench_wait_idle() for the steps of the virtual clock. The loops are pthreads, so they
+// run while this task spins.
+static void bench_spin_idle(void)
+{
+    evloop_stats_t stats;
+
+    do {
+        evloop_get_stats(&stats);
+    } while (stats.dispatched + stats.evicted != stats.posted);
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t* sorted, uint32_t count, uint32_t per_mille)
+{
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = ((uint64_t)count * per_mille + 999) / 1000;
+    return sorted[(rank > 0 ? rank : 1) - 1];
+}
+
+// static void bench_run(const bench_workload_t* w, FILE* out)
+// Input:
+//  w: workload
+//  out: file where the result to be appended, NULL if none
+// Output: none
+// Description: This function posts CONFIG_BENCH_EVENTS events of the workload, waits until the event loop
+// processes them and prints the result as one JSON line.
+static void bench_run(const bench_workload_t* w, FILE* out)
+{
+    evloop_stats_t s0, s1;
+    uint32_t sent = 0;
+    const char* commit = getenv("SMDEMO_BENCH_COMMIT");
+
+    atomic_store(&latencies_count, 0);
+    for (size_t i = 0; i < ARRAY_SIZE(fifos); i++) {
+        atomic_store(&fifos[i].tail, atomic_load(&fifos[i].head));
+    }
+    atomic_store(&recording, true);
+
+    evloop_get_stats(&s0);
+    uint64_t t0 = bench_time_ns();
+
+    while (sent < CONFIG_BENCH_EVENTS) {
+        sm_event_type_t events[CONFIG_EVLOOP_RING_SIZE * 2];
+        uint32_t burst = w->random_burst ? 1 + rnd() % w->burst : w->burst;
+
+        if (burst > CONFIG_BENCH_EVENTS - sent) {
+            burst = CONFIG_BENCH_EVENTS - sent;
+        }
+        for (uint32_t i = 0; i < burst; i++) {
+            uint32_t r = rnd() % 100;
+            if (r < w->noise_pct) {
+                events[i] = evP1Trigger1;
+            }
+            else if (r < w->noise_pct + w->button_pct) {
+                events[i] = evButtonSingleClick;
+            }
+            else {
+                events[i] = ev_t_blink_changer_tick;
+            }
+        }
+
+        if (w->mode == BENCH_BULK) {
+            bench_post_bulk(events, burst);
+        }
+        else {
+            if (w->mode == BENCH_BURST) {
+                vTaskPrioritySet(NULL, BENCH_PRIO_BURST);
+            }
+            for (uint32_t i = 0; i < burst; i++) {
+                bench_post(events[i]);
+            }
+            vTaskPrioritySet(NULL, BENCH_PRIO_DRAIN);
+        }
+        sent += burst;
+
+        if (w->max_gap_us > 0) {
+            uint64_t until = bench_time_ns() + (uint64_t)(rnd() % w->max_gap_us) * 1000;
+            while (bench_time_ns() < until) {
+            }
+        }
+    }
+
+    evloop_get_stats(&s1);
+    while (s1.dispatched + s1.evicted != s1.posted) {
+        taskYIELD();
+        evloop_get_stats(&s1);
+    }
+    uint64_t t1 = bench_time_ns();
+    atomic_store(&recording, false);
+
+    uint32_t n = atomic_load(&latencies_count);
+    qsort(latencies, n, sizeof(latencies[0]), cmp_u64);
+
+    double seconds = (double)(t1 - t0) / 1e9;
+    uint32_t transitions = s1.transitions - s0.transitions;
+    char line[512];
+
+    snprintf(line, sizeof(line),
+        "{\"bench\":\"smdemo_p1\",\"commit\":\"%s\",\"workload\":\"%s\",\"events\":%u,"
+        "\"posted\":%lu,\"dropped\":%lu,\"coalesced\":%lu,\"transitions\":%lu,\"lost\":%lu,"
+        "\"delivered\":%lu,\"unrouted\":%lu,\"wakeups\":%lu,\"batches\":%lu,\"seconds\":%.6f,\"transitions_per_sec\":%.0f,"
+        "\"latency_ns\":{\"samples\":%lu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}",
+        commit != NULL ? commit : "", w->name, (unsigned)CONFIG_BENCH_EVENTS,
+        (unsigned long)(s1.posted - s0.posted), (unsigned long)(s1.dropped - s0.dropped),
+        (unsigned long)(s1.coalesced - s0.coalesced),
+        (unsigned long)transitions, (unsigned long)(s1.lost - s0.lost),
+        (unsigned long)(s1.delivered - s0.delivered), (unsigned long)(s1.unrouted - s0.unrouted),
+        (unsigned long)(s1.wakeups - s0.wakeups), (unsigned long)(s1.batches - s0.batches),
+        seconds, seconds > 0 ? transitions / seconds : 0.0,
+        (unsigned long)n,
+        (unsigned long long)percentile(latencies, n, 500),
+        (unsigned long long)percentile(latencies, n, 990),
+        (unsigned long long)percentile(latencies, n, 999),
+        (unsigned long long)(n > 0 ? latencies[n - 1] : 0));
+
+    printf("%s\n", line);
+    if (out != NULL) {
+        fprintf(out, "%s\n", line);
+    }
+}
+
+// static void bench_led(FILE* out)
+// Input:
+//  out: file where the JSON line to be appended, NULL for stdout only
+// Output: none
+// Description: This function sets every blink period and compares the level of the mock LED in the
+// middle of the on and off halves of three periods with a square wave of that period.
+static void bench_led(FILE* out)
+{
+    static const uint32_t periods_ms[] = { 100, 500, 1000, 2000, 2500 };
+    const char* commit = getenv("SMDEMO_BENCH_COMMIT");
+    ledpat_led_t led = get_status_led();
+    uint32_t mismatches = 0;
+    uint32_t updates = 0;
+    double timer_wakeups[ARRAY_SIZE(periods_ms)];
+    char line[512];
+
+    for (size_t i = 0; i < ARRAY_SIZE(periods_ms); i++) {
+        ledpat_stats_t stats;
+        int64_t t0 = esp_timer_get_time();
+        int64_t half_us = (int64_t)periods_ms[i] * 500;
+
+        set_blink_period(i);
+        ledpat_get_stats(led, &stats);
+        for (int64_t k = 0; k < 6; k++) {
+            int expected = ((k & 1) == 0) ? 1 : 0;
+            if (ledpat_mock_level(led, t0 + k * half_us + half_us / 2) != expected) {
+                mismatches++;
+            }
+        }
+        timer_wakeups[i] = stats.edges * 1000.0 / stats.period_ms;
+        updates = stats.updates;
+    }
+
+    snprintf(line, sizeof(line),
+        "{\"bench\":\"smdemo_led\",\"commit\":\"%s\",\"patterns\":%u,\"mismatches\":%lu,\"updates\":%lu,"
+        "\"timer_wakeups_per_sec\":[%.1f,%.1f,%.1f,%.1f,%.1f],\"engine_wakeups_per_sec\":0}",
+        commit != NULL ? commit : "", (unsigned)ARRAY_SIZE(periods_ms), (unsigned long)mismatches,
+        (unsigned long)updates, timer_wakeups[0], timer_wakeups[1], timer_wakeups[2], timer_wakeups[3],
+        timer_wakeups[4]);
+
+    printf("%s\n", line);
+    if (out != NULL) {
+        fprintf(out, "%s\n", line);
+    }
+}
+
+// Buttons of bench_button(): GPIO BENCH_BTN_GPIO0 + i, active low, apart from CONFIG_BUTTON_GPIO, with a row
+// for the single click, the double click, the long press and the repeat, all posting evNullEvent, which no
+// machine handles. In a session of BENCH_BTN_SESSION_S seconds every button makes, one after the other, a
+// single click, a double click, a long press with BENCH_BTN_REPEATS repeats and a glitch shorter than the
+// debounce; every edge bounces BENCH_BTN_BOUNCES times. The sessions run on the virtual clock of
+// bench_timer_advance().
+#define BENCH_BTN_GPIO0         (14)
+#define BENCH_BTN_SESSION_S     (60)
+#define BENCH_BTN_SESSIONS      (50)
+#define BENCH_BTN_BOUNCES       (5)
+#define BENCH_BTN_REPEATS       (3)
+#define BENCH_BTN_CLICK_MS      (80)    // press of a click and gap of a double click
+#define BENCH_BTN_WAIT_MS       (CONFIG_BTNIN_DOUBLE_CLICK_MS + 100)
+#if defined(CONFIG_BUTTON_PERIOD_TIME_MS)
+#define BENCH_BTN_POLL_MS       (CONFIG_BUTTON_PERIOD_TIME_MS)
+#else
+#define BENCH_BTN_POLL_MS       (5)     // default sampling period of espressif/button
+#endif  // defined(CONFIG_BUTTON_PERIOD_TIME_MS)
+
+_Static_assert(CONFIG_BTNIN_MAX_BUTTONS >= 16, "the button benchmark needs CONFIG_BTNIN_MAX_BUTTONS=16");
+
+static const btnin_event_t bench_btn_events[] = { BTNIN_SINGLE_CLICK, BTNIN_DOUBLE_CLICK, BTNIN_LONG_PRESS, BTNIN_REPEAT };
+
+// static void bench_button_contact(int gpio, int level, uint32_t hold_ms)
+// Input:
+//  gpio: GPIO of the button
+//  level: settled level of the contact
+//  hold_ms: time the contact stays at level
+// Output: none
+// Description: This function moves the contact of a mock button to level with bounces, then lets hold_ms
+// pass on the virtual clock.
+static void bench_button_contact(int gpio, int level, uint32_t hold_ms)
+{
+    for (int i = 0; i < BENCH_BTN_BOUNCES; i++) {
+        bench_gpio_input(gpio, ((i & 1) == 0) ? level : !level);
+    }
+    bench_gpio_input(gpio, level);
+    bench_timer_advance((uint64_t)hold_ms * 1000);
+}
+
+// static void bench_button_session(uint32_t buttons)
+// Input:
+//  buttons: buttons clicked
+// Output: none
+// Description: One session of BENCH_BTN_SESSION_S seconds, see BENCH_BTN_GPIO0.
+static void bench_button_session(uint32_t buttons)
+{
+    int64_t end = esp_timer_get_time() + (int64_t)BENCH_BTN_SESSION_S * 1000000;
+
+    for (uint32_t i = 0; i < buttons; i++) {
+        int gpio = BENCH_BTN_GPIO0 + (int)i;
+
+        bench_button_contact(gpio, 0, BENCH_BTN_CLICK_MS);
+        bench_button_contact(gpio, 1, BENCH_BTN_WAIT_MS);
+
+        bench_button_contact(gpio, 0, BENCH_BTN_CLICK_MS);
+        bench_button_contact(gpio, 1, BENCH_BTN_CLICK_MS);
+        bench_button_contact(gpio, 0, BENCH_BTN_CLICK_MS);
+        bench_button_contact(gpio, 1, BENCH_BTN_WAIT_MS);
+
+        bench_button_contact(gpio, 0, CONFIG_BTNIN_LONG_PRESS_MS + CONFIG_BTNIN_REPEAT_MS * BENCH_BTN_REPEATS +
+                                      CONFIG_BTNIN_REPEAT_MS / 2);
+        bench_button_contact(gpio, 1, BENCH_BTN_WAIT_MS);
+
+        bench_gpio_input(gpio, 0);
+        bench_gpio_input(gpio, 1);
+        bench_timer_advance((uint64_t)BENCH_BTN_WAIT_MS * 1000);
+    }
+    int64_t now = esp_timer_get_time();
+    if (end > now) {
+        bench_timer_advance((uint64_t)(end - now));
+    }
+}
+
+// static void bench_button(FILE* out)
+// Input:
+//  out: file where the JSON lines to be appended, NULL for stdout only
+// Output: none
+// Description: This function runs BENCH_BTN_SESSIONS sessions with 1, 2, 4, 8 and 16 buttons in the table
+// and compares the events classified by btnin.c with the ones made. It reports the wakeups per second and
+// the host time per wakeup, which includes the stand-ins of gpio and esp_timer and the posts to the event
+// loop. The interrupt path costs nothing while no button is touched; the sampling timer of espressif/button
+// wakes the CPU every BENCH_BTN_POLL_MS and reads every button, regardless.
+static void bench_button(FILE* out)
+{
+    static const uint32_t sizes[] = { 1, 2, 4, 8, 16 };
+    static btnin_map_t map[16 * ARRAY_SIZE(bench_btn_events)];
+    const char* commit = getenv("SMDEMO_BENCH_COMMIT");
+    char line[768];
+
+    for (size_t k = 0; k < ARRAY_SIZE(sizes); k++) {
+        uint32_t buttons = sizes[k];
+        uint32_t rows = 0;
+        btnin_stats_t stats;
+
+        for (uint32_t i = 0; i < buttons; i++) {
+            bench_gpio_input(BENCH_BTN_GPIO0 + (int)i, 1);
+            for (size_t e = 0; e < ARRAY_SIZE(bench_btn_events); e++) {
+                map[rows++] = (btnin_map_t) { BENCH_BTN_GPIO0 + (int)i, 0, bench_btn_events[e], evNullEvent };
+            }
+        }
+        if (btnin_init(map, rows) != ESP_OK) {
+            fprintf(stderr, "Cannot initialize %lu mock buttons\n", (unsigned long)buttons);
+            return;
+        }
+
+        uint64_t t0 = bench_time_ns();
+        for (uint32_t r = 0; r < BENCH_BTN_SESSIONS; r++) {
+            bench_button_session(buttons);
+        }
+        uint64_t t1 = bench_time_ns();
+        btnin_get_stats(&stats, false);
+        btnin_deinit();
+
+        uint32_t n = buttons * BENCH_BTN_SESSIONS;
+        uint32_t mismatches = (stats.events[BTNIN_PRESS_DOWN] != 4 * n) + (stats.events[BTNIN_PRESS_UP] != 4 * n) +
+                              (stats.events[BTNIN_SINGLE_CLICK] != n) + (stats.events[BTNIN_DOUBLE_CLICK] != n) +
+                              (stats.events[BTNIN_LONG_PRESS] != n) +
+                              (stats.events[BTNIN_REPEAT] != BENCH_BTN_REPEATS * n) + (stats.glitches != n);
+        double seconds = (double)BENCH_BTN_SESSION_S * BENCH_BTN_SESSIONS;
+
+        snprintf(line, sizeof(line),
+            "{\"bench\":\"smdemo_button\",\"commit\":\"%s\",\"buttons\":%lu,\"sessions\":%u,\"single\":%lu,"
+            "\"double\":%lu,\"long\":%lu,\"repeat\":%lu,\"glitches\":%lu,\"posted\":%lu,\"mismatches\":%lu,"
+            "\"wakeups\":%lu,\"irq_wakeups_per_sec\":%.2f,\"irq_idle_wakeups_per_sec\":0,\"ns_per_wakeup\":%.0f,"
+            "\"irq_cpu_us_per_sec\":%.3f,\"poll_wakeups_per_sec\":%.1f,\"poll_reads_per_sec\":%.1f}",
+            commit != NULL ? commit : "", (unsigned long)buttons, (unsigned)BENCH_BTN_SESSIONS,
+            (unsigned long)stats.events[BTNIN_SINGLE_CLICK], (unsigned long)stats.events[BTNIN_DOUBLE_CLICK],
+            (unsigned long)stats.events[BTNIN_LONG_PRESS], (unsigned long)stats.events[BTNIN_REPEAT],
+            (unsigned long)stats.glitches, (unsigned long)stats.posted, (unsigned long)mismatches,
+            (unsigned long)stats.wakeups, stats.wakeups / seconds,
+            (stats.wakeups > 0) ? (double)(t1 - t0) / stats.wakeups : 0.0, (double)(t1 - t0) / 1000.0 / seconds,
+            1000.0 / BENCH_BTN_POLL_MS, 1000.0 / BENCH_BTN_POLL_MS * buttons);
+
+        printf("%s\n", line);
+        if (out != NULL) {
+            fprintf(out, "%s\n", line);
+        }
+    }
+}
+
+#define BENCH_INSTANCES_MAX         (1024)
+#define BENCH_INSTANCES_DISPATCHES  (4u * 1024 * 1024)     // instance dispatches per size and method
+
+#define BENCH_GROUP_TICK_INSTANCES  (1024)
+#define BENCH_GROUP_TICK_PERIODS    (3)
+#define BENCH_GROUP_TICK_PERIOD     (CONFIG_LED_BLINK_PERIOD_CHANGER_INTERVAL / CONFIG_TWHEEL_TICK_MS)  // wheel ticks
+
+// The instances are spread one wheel tick apart; an instance must not expire twice within the spread.
+_Static_assert(BENCH_GROUP_TICK_INSTANCES + 2 < BENCH_GROUP_TICK_PERIOD, "the blink changer period is too short");
+
+static evloop_group_t* bench_tick_group;
+
+// Machine type of bench_loops(): one state with a self transition on evP1Trigger5, which the workloads
+// do not post, and an action of CONFIG_BENCH_LOOP_WORK rounds of xorshift. One instance per loop.
+#define BENCH_LOOP_ID       (0x200)     // sm_machine_t.id of the instance of loop 0
+
+typedef struct {
+    _Atomic uint32_t handled;
+    uint32_t acc;
+} bench_loop_ctx_t;
+
+static void bench_loop_work(sm_machine_t* machine)
+{
+    bench_loop_ctx_t* ctx = (bench_loop_ctx_t*)machine->ctx;
+    uint32_t x = ctx->acc | 1;
+
+    for (uint32_t i = 0; i < CONFIG_BENCH_LOOP_WORK; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+    }
+    ctx->acc = x;
+    atomic_fetch_add_explicit(&ctx->handled, 1, memory_order_release);
+}
+
+static const sm_transition_t bench_loop_transitions[] = {
+    { evP1Trigger5, 0, bench_loop_work, 0, NULL, SM_GPOL_POSITIVE },
+};
+static const sm_state_t bench_loop_states[] = {
+    { bench_loop_transitions, ARRAY_SIZE(bench_loop_transitions), NULL, NULL },
+};
+static evloop_index_row_t bench_loop_index[ARRAY_SIZE(bench_loop_states)] = {
+    [0] = { [evP1Trigger5] = &bench_loop_transitions[0] },
+};
+static evloop_group_t* bench_loop_groups[CONFIG_EVLOOP_LOOPS];
+
+// static esp_err_t bench_loops_register(void)
+// Input: none
+// Output: ESP error code of the group functions
+// Description: This function registers one group of one stopped instance per loop. It is called before
+// evloop_create(). CONFIG_EVLOOP_MAX_GROUPS must leave room for them.
+static esp_err_t bench_loops_register(void)
+{
+    for (uint32_t l = 0; l < CONFIG_EVLOOP_LOOPS; l++) {
+        evloop_group_config_t cfg = {
+            .states = bench_loop_states,
+            .sizes = ARRAY_SIZE(bench_loop_states),
+            .index = bench_loop_index,
+            .ctx_size = sizeof(bench_loop_ctx_t),
+            .first_id = BENCH_LOOP_ID + l,
+            .loop = l,
+        };
+        esp_err_t ret = evloop_group_create(&cfg, 1, &bench_loop_groups[l]);
+        if (ret == ESP_OK) {
+            ret = evloop_register_group(bench_loop_groups[l]);
+        }
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+    return ESP_OK;
+}
+
+// static void bench_loops(FILE* out)
+// Input:
+//  out: file where the JSON lines to be appended, NULL for stdout only
+// Output: none
+// Description: For k = 1 to CONFIG_EVLOOP_LOOPS this function starts the instances of the first k loops,
+// posts CONFIG_BENCH_LOOP_EVENTS events to them round robin and waits until all are handled. A post to a
+// full queue is retried and counted.
+static void bench_loops(FILE* out)
+{
+    const char* commit = getenv("SMDEMO_BENCH_COMMIT");
+    char line[512];
+
+    for (uint32_t k = 1; k <= CONFIG_EVLOOP_LOOPS; k++) {
+        uint32_t retries = 0;
+        uint32_t handled = 0;
+
+        for (uint32_t l = 0; l < k; l++) {
+            bench_loop_ctx_t* ctx = (bench_loop_ctx_t*)evloop_group_ctx(bench_loop_groups[l], 0);
+            atomic_store(&ctx->handled, 0);
+            evloop_group_start(bench_loop_groups[l], 0, 1, 0);
+        }
+
+        uint64_t t0 = bench_time_ns();
+        for (uint32_t i = 0; i < CONFIG_BENCH_LOOP_EVENTS; i++) {
+            while (evloop_post_to(BENCH_LOOP_ID + i % k, evP1Trigger5) != ESP_OK) {
+                retries++;
+            }
+        }
+        while (handled < CONFIG_BENCH_LOOP_EVENTS) {
+            handled = 0;
+            for (uint32_t l = 0; l < k; l++) {
+                bench_loop_ctx_t* ctx = (bench_loop_ctx_t*)evloop_group_ctx(bench_loop_groups[l], 0);
+                handled += atomic_load_explicit(&ctx->handled, memory_order_acquire);
+            }
+        }
+        uint64_t t1 = bench_time_ns();
+
+        for (uint32_t l = 0; l < k; l++) {
+            evloop_group_stop(bench_loop_groups[l], 0, 1);
+        }
+
+        double seconds = (double)(t1 - t0) / 1e9;
+        snprintf(line, sizeof(line),
+            "{\"bench\":\"smdemo_loops\",\"commit\":\"%s\",\"loops\":%lu,\"events\":%u,\"work\":%u,"
+            "\"retries\":%lu,\"seconds\":%.6f,\"events_per_sec\":%.0f}",
+            commit != NULL ? commit : "", (unsigned long)k, (unsigned)CONFIG_BENCH_LOOP_EVENTS,
+            (unsigned)CONFIG_BENCH_LOOP_WORK, (unsigned long)retries,
+            seconds, seconds > 0 ? CONFIG_BENCH_LOOP_EVENTS / seconds : 0.0);
+        printf("%s\n", line);
+        if (out != NULL) {
+            fprintf(out, "%s\n", line);
+        }
+    }
+}
+
+// static void bench_group_ticks(FILE* out)
+// Input:
+//  out: file where the JSON lines to be appended, NULL for stdout only
+// Output: none
+// Description: This function starts bench_tick_group with P1_start_group() while sm_P1 is not started
+// yet, advances the virtual clock by BENCH_GROUP_TICK_PERIODS periods of the blink changer, plus the
+// spread of the instances, one wheel tick at a time, and waits for the loops after every tick. Then it
+// checks that every instance changed its mode once per period and that all are in the same state, and
+// that sm_P1 and the operative mode were not touched and no event was dropped or lost.
+static void bench_group_ticks(FILE* out)
+{
+    const char* commit = getenv("SMDEMO_BENCH_COMMIT");
+    P1_context_t* p1_ctx = (P1_context_t*)sm_P1.ctx;
+    uint32_t p1_changes = p1_ctx->op_mode_changes;
+    device_modes_t mode = get_opmode();
+    uint32_t ticks = BENCH_GROUP_TICK_PERIODS * BENCH_GROUP_TICK_PERIOD + BENCH_GROUP_TICK_INSTANCES + 1;
+    uint32_t mismatches = 0;
+    evloop_stats_t s0, s1;
+    char line[512];
+
+    evloop_get_stats(&s0);
+    uint64_t t0 = bench_time_ns();
+    if (P1_start_group(bench_tick_group) != ESP_OK) {
+        fprintf(stderr, "Cannot start the group of the tick benchmark\n");
+        return;
+    }
+    for (uint32_t t = 0; t < ticks; t++) {
+        bench_timer_advance(CONFIG_TWHEEL_TICK_MS * 1000);
+        bench_spin_idle();
+    }
+    uint64_t t1 = bench_time_ns();
+    P1_stop_group(bench_tick_group);
+    evloop_get_stats(&s1);
+
+    for (size_t i = 0; i < bench_tick_group->count; i++) {
+        P1_context_t* ctx = (P1_context_t*)evloop_group_ctx(bench_tick_group, i);
+        if ((ctx->op_mode_changes != BENCH_GROUP_TICK_PERIODS) || (bench_tick_group->s1[i] != bench_tick_group->s1[0])) {
+            mismatches++;
+        }
+    }
+    bool isolated = (p1_ctx->op_mode_changes == p1_changes) && (get_opmode() == mode);
+    uint32_t transitions = s1.transitions - s0.transitions;
+
+    snprintf(line, sizeof(line),
+        "{\"bench\":\"smdemo_group_ticks\",\"commit\":\"%s\",\"instances\":%u,\"periods\":%u,"
+        "\"transitions\":%lu,\"expected\":%u,\"mismatches\":%lu,\"dropped\":%lu,\"lost\":%lu,"
+        "\"p1_isolated\":%s,\"ms_per_period\":%.1f}",
+        commit != NULL ? commit : "", (unsigned)BENCH_GROUP_TICK_INSTANCES, (unsigned)BENCH_GROUP_TICK_PERIODS,
+        (unsigned long)transitions, (unsigned)(BENCH_GROUP_TICK_INSTANCES * BENCH_GROUP_TICK_PERIODS),
+        (unsigned long)mismatches, (unsigned long)(s1.dropped - s0.dropped), (unsigned long)(s1.lost - s0.lost),
+        isolated ? "true" : "false", (double)(t1 - t0) / 1e6 / BENCH_GROUP_TICK_PERIODS);
+    printf("%s\n", line);
+    if (out != NULL) {
+        fprintf(out, "%s\n", line);
+    }
+}
+
+// static void bench_instances(FILE* out)
+// Input:
+//  out: file where the JSON lines to be appended, NULL for stdout only
+// Output: none
+// Description: This function measures the broadcast of evP1Trigger1, which sP1_STANDBY ignores, to
+// 1, 2, 4, ... BENCH_INSTANCES_MAX instances of P1 in a group and in separate machines.
+static void bench_instances(FILE* out)
+{
+    const char* commit = getenv("SMDEMO_BENCH_COMMIT");
+    evloop_group_config_t cfg;
+    evloop_machine_t* ms = calloc(BENCH_INSTANCES_MAX, sizeof(evloop_machine_t));
+    sm_machine_t* machines = calloc(BENCH_INSTANCES_MAX, sizeof(sm_machine_t));
+    char line[512];
+
+    if ((ms == NULL) || (machines == NULL)) {
+        fprintf(stderr, "Cannot allocate the instances\n");
+        goto out;
+    }
+    P1_group_config(&cfg);
+    for (size_t i = 0; i < BENCH_INSTANCES_MAX; i++) {
+        machines[i].s1 = sP1_STANDBY;
+        machines[i].id = cfg.first_id + i;
+        machines[i].states = cfg.states;
+        machines[i].sizes = cfg.sizes;
+        ms[i] = (evloop_machine_t) { .machine = &machines[i], .index = cfg.index, .active = true };
+    }
+
+    for (size_t n = 1; n <= BENCH_INSTANCES_MAX; n *= 2) {
+        evloop_group_t* group;
+        uint32_t rounds = BENCH_INSTANCES_DISPATCHES / n;
+
+        if (P1_create_group(n, &group) != ESP_OK) {
+            fprintf(stderr, "Cannot create a group of %u instances\n", (unsigned)n);
+            break;
+        }
+        evloop_group_start(group, 0, n, sP1_STANDBY);
+
+        uint64_t t0 = bench_time_ns();
+        for (uint32_t r = 0; r < rounds; r++) {
+            evloop_group_dispatch(group, evP1Trigger1);
+        }
+        uint64_t t1 = bench_time_ns();
+        for (uint32_t r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < n; i++) {
+                evloop_dispatch(&ms[i], evP1Trigger1);
+            }
+        }
+        uint64_t t2 = bench_time_ns();
+        evloop_group_delete(group);
+
+        double dispatches = (double)rounds * n;
+        snprintf(line, sizeof(line),
+            "{\"bench\":\"smdemo_instances\",\"commit\":\"%s\",\"instances\":%u,\"rounds\":%lu,"
+            "\"group_ns_per_instance\":%.2f,\"machines_ns_per_instance\":%.2f}",
+            commit != NULL ? commit : "", (unsigned)n, (unsigned long)rounds,
+            (t1 - t0) / dispatches, (t2 - t1) / dispatches);
+        printf("%s\n", line);
+        if (out != NULL) {
+            fprintf(out, "%s\n", line);
+        }
+    }
+out:
+    free(ms);
+    free(machines);
+}
+
+void app_main(void)
+{
+    const char* path = getenv("SMDEMO_BENCH_OUT");
+    FILE* out = NULL;
+
+    if (path != NULL) {
+        out = fopen(path, "a");
+        if (out == NULL) {
+            fprintf(stderr, "Cannot open %s\n", path);
+        }
+    }
+
+    init_button();
+    init_led_blinking();
+    twheel_init();
+
+    if (register_state_machines() != ESP_OK) {
+        fprintf(stderr, "Not all state machines are registered\n");
+        exit(1);
+    }
+    if (bench_loops_register() != ESP_OK) {
+        fprintf(stderr, "Cannot register the loop benchmark groups\n");
+        exit(1);
+    }
+    if ((P1_create_group(BENCH_GROUP_TICK_INSTANCES, &bench_tick_group) != ESP_OK) ||
+        (evloop_register_group(bench_tick_group) != ESP_OK)) {
+        fprintf(stderr, "Cannot register the group of the tick benchmark\n");
+        exit(1);
+    }
+    if (evloop_create() != ESP_OK) {
+        fprintf(stderr, "Cannot create the event loop\n");
+        exit(1);
+    }
+    bench_led(out);
+    bench_button(out);
+    bench_instances(out);
+    bench_group_ticks(out);
+    opmode_subscribe(on_opmode_change, NULL);
+
+    vTaskPrioritySet(NULL, BENCH_PRIO_DRAIN);
+    P1_start();
+    bench_wait_idle();
+
+    for (size_t i = 0; i < ARRAY_SIZE(workloads); i++) {
+        bench_run(&workloads[i], out);
+    }
+    bench_loops(out);
+
+    if (out != NULL) {
+        fclose(out);
+    }
+    fflush(stdout);
+    exit(0);
+}
+
+// end of bench_main.c
@@ -0,0 +1,24 @@
+// bench_stubs.h - control of the stand-ins by the host benchmark
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include <stdint.h>
+#include <esp_err.h>
+
+#include "iot_button.h"
+
+uint64_t bench_time_ns(void);
+esp_err_t bench_timer_fire(const char* name);
+void bench_timer_advance(uint64_t us);
+void bench_button_emit(button_event_t event);
+void bench_gpio_input(int gpio, int level);
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of bench_stubs.h
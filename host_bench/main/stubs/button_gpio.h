@@ -0,0 +1,28 @@
+// button_gpio.h - stand-in of the GPIO button driver for the host benchmark
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+#include "iot_button.h"
+
+typedef struct {
+    int32_t gpio_num;
+    uint8_t active_level;
+    bool enable_power_save;
+    bool disable_pull;
+} button_gpio_config_t;
+
+esp_err_t iot_button_new_gpio_device(const button_config_t* button_config, const button_gpio_config_t* gpio_cfg, button_handle_t* ret_button);
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of button_gpio.h
@@ -0,0 +1,48 @@
+// esp_timer.h - stand-in of esp_timer for the host benchmark
+//
+// The timers do not run by themselves. The benchmark fires them with bench_timer_fire(), or expires them
+// in order with bench_timer_advance() on a virtual clock, so the timer callbacks of the application are
+// driven by the synthetic workloads.
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+typedef struct esp_timer* esp_timer_handle_t;
+
+typedef void (*esp_timer_cb_t)(void* arg);
+
+typedef enum {
+    ESP_TIMER_TASK,
+    ESP_TIMER_ISR,
+    ESP_TIMER_MAX,
+} esp_timer_dispatch_t;
+
+typedef struct {
+    esp_timer_cb_t callback;
+    void* arg;
+    esp_timer_dispatch_t dispatch_method;
+    const char* name;
+    bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle);
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period);
+esp_err_t esp_timer_restart(esp_timer_handle_t timer, uint64_t timeout_us);
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+esp_err_t esp_timer_delete(esp_timer_handle_t timer);
+int64_t esp_timer_get_time(void);
+void esp_timer_isr_dispatch_need_yield(void);
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of esp_timer.h
@@ -0,0 +1,51 @@
+// iot_button.h - stand-in of espressif/button for the host benchmark
+//
+// Button events are produced by bench_button_emit(), which calls the registered callbacks.
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include <stdint.h>
+#include <esp_err.h>
+
+typedef struct button_dev_t* button_handle_t;
+
+typedef void (*button_cb_t)(void* button_handle, void* usr_data);
+
+typedef enum {
+    BUTTON_PRESS_DOWN = 0,
+    BUTTON_PRESS_UP,
+    BUTTON_PRESS_REPEAT,
+    BUTTON_PRESS_REPEAT_DONE,
+    BUTTON_SINGLE_CLICK,
+    BUTTON_DOUBLE_CLICK,
+    BUTTON_MULTIPLE_CLICK,
+    BUTTON_LONG_PRESS_START,
+    BUTTON_LONG_PRESS_HOLD,
+    BUTTON_LONG_PRESS_UP,
+    BUTTON_PRESS_END,
+    BUTTON_EVENT_MAX,
+    BUTTON_NONE_PRESS,
+} button_event_t;
+
+typedef struct {
+    uint16_t long_press_time;
+    uint16_t short_press_time;
+} button_config_t;
+
+typedef struct {
+    uint16_t press_time;
+} button_event_args_t;
+
+esp_err_t iot_button_register_cb(button_handle_t btn_handle, button_event_t event, button_event_args_t* event_args, button_cb_t cb, void* usr_data);
+button_event_t iot_button_get_event(button_handle_t btn_handle);
+const char* iot_button_get_event_str(button_event_t event);
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of iot_button.h
@@ -0,0 +1,15 @@
+// nvs_flash.h - stand-in for the host benchmark
+//
+// anvs.c is not built; the anvs functions used by the application are kept in RAM by stubs.c.
+// anvs.h needs only the NVS error codes.
+
+#pragma once
+
+#include <esp_err.h>
+
+#if !defined(ESP_ERR_NVS_NOT_FOUND)
+#define ESP_ERR_NVS_BASE        0x1100
+#define ESP_ERR_NVS_NOT_FOUND   (ESP_ERR_NVS_BASE + 0x02)
+#endif
+
+// end of nvs_flash.h
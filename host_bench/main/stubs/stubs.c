@@ -0,0 +1,365 @@
+// stubs.c - stand-ins of gpio with its interrupts, esp_timer, iot_button and anvs for the host benchmark
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "driver/gpio.h"
+#include "esp_timer.h"
+#include "iot_button.h"
+#include "button_gpio.h"
+
+#include "commondefs.h"
+#include "anvs.h"
+#include "bench_stubs.h"
+
+// time
+
+uint64_t bench_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Virtual time added to the clock by bench_timer_advance()
+static int64_t time_offset_us = 0;
+
+int64_t esp_timer_get_time(void)
+{
+    return (int64_t)(bench_time_ns() / 1000) + time_offset_us;
+}
+
+// gpio
+
+esp_err_t gpio_reset_pin(gpio_num_t gpio_num)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    return ESP_OK;
+}
+
+static uint32_t gpio_levels;
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    if (level) {
+        gpio_levels |= (1u << (gpio_num & 31));
+    }
+    else {
+        gpio_levels &= ~(1u << (gpio_num & 31));
+    }
+    return ESP_OK;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    return (gpio_levels >> (gpio_num & 31)) & 1u;
+}
+
+esp_err_t gpio_set_pull_mode(gpio_num_t gpio_num, gpio_pull_mode_t pull)
+{
+    return ESP_OK;
+}
+
+// Level interrupts only, the type used by btnin.c
+typedef struct {
+    gpio_isr_t handler;
+    void* arg;
+    gpio_int_type_t type;
+    bool enabled;
+} bench_gpio_intr_t;
+
+static bench_gpio_intr_t gpio_intr[32];
+static bool isr_service = false;
+
+// static void bench_gpio_raise(gpio_num_t gpio_num)
+// Description: This function calls the handler of the GPIO while its interrupt is enabled and its level
+// matches the interrupt type, as the level interrupt of the GPIO matrix does.
+static void bench_gpio_raise(gpio_num_t gpio_num)
+{
+    bench_gpio_intr_t* intr = &gpio_intr[gpio_num & 31];
+    int level = gpio_get_level(gpio_num);
+
+    if (intr->enabled && (intr->handler != NULL) &&
+        (((intr->type == GPIO_INTR_LOW_LEVEL) && (level == 0)) || ((intr->type == GPIO_INTR_HIGH_LEVEL) && (level == 1)))) {
+        intr->handler(intr->arg);
+    }
+}
+
+esp_err_t gpio_set_intr_type(gpio_num_t gpio_num, gpio_int_type_t intr_type)
+{
+    gpio_intr[gpio_num & 31].type = intr_type;
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_enable(gpio_num_t gpio_num)
+{
+    gpio_intr[gpio_num & 31].enabled = true;
+    bench_gpio_raise(gpio_num);
+    return ESP_OK;
+}
+
+esp_err_t gpio_intr_disable(gpio_num_t gpio_num)
+{
+    gpio_intr[gpio_num & 31].enabled = false;
+    return ESP_OK;
+}
+
+esp_err_t gpio_install_isr_service(int intr_alloc_flags)
+{
+    if (isr_service) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    isr_service = true;
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_add(gpio_num_t gpio_num, gpio_isr_t isr_handler, void* args)
+{
+    if (!isr_service) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    gpio_intr[gpio_num & 31].handler = isr_handler;
+    gpio_intr[gpio_num & 31].arg = args;
+    return ESP_OK;
+}
+
+esp_err_t gpio_isr_handler_remove(gpio_num_t gpio_num)
+{
+    gpio_intr[gpio_num & 31].handler = NULL;
+    gpio_intr[gpio_num & 31].enabled = false;
+    return ESP_OK;
+}
+
+// void bench_gpio_input(int gpio, int level)
+// Input:
+//  gpio: GPIO number
+//  level: new level of the input
+// Output: none
+// Description: This function drives an input, e.g. a button contact, and raises its interrupt.
+void bench_gpio_input(int gpio, int level)
+{
+    gpio_set_level(gpio, level);
+    bench_gpio_raise(gpio);
+}
+
+// esp_timer
+
+#define BENCH_TIMERS    (8)
+
+struct esp_timer {
+    esp_timer_create_args_t args;
+    uint64_t period;
+    int64_t expiry;         // esp_timer_get_time() of the next expiry while running
+    bool running;
+};
+
+static struct esp_timer timers[BENCH_TIMERS];
+static size_t timers_count = 0;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle)
+{
+    for (size_t i = 0; i < timers_count; i++) {
+        if (timers[i].args.callback == NULL) {
+            timers[i] = (struct esp_timer) { .args = *create_args };
+            *out_handle = &timers[i];
+            return ESP_OK;
+        }
+    }
+    if (timers_count >= ARRAY_SIZE(timers)) {
+        return ESP_ERR_NO_MEM;
+    }
+    timers[timers_count].args = *create_args;
+    *out_handle = &timers[timers_count++];
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    timer->period = 0;
+    timer->expiry = esp_timer_get_time() + (int64_t)timeout_us;
+    timer->running = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    timer->period = period;
+    timer->expiry = esp_timer_get_time() + (int64_t)period;
+    timer->running = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_restart(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    if (!timer->running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->period = (timer->period != 0) ? timeout_us : 0;
+    timer->expiry = esp_timer_get_time() + (int64_t)timeout_us;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    timer->running = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    timer->running = false;
+    timer->args.callback = NULL;
+    return ESP_OK;
+}
+
+void esp_timer_isr_dispatch_need_yield(void)
+{
+}
+
+// esp_err_t bench_timer_fire(const char* name)
+// Input:
+//  name: name given to esp_timer_create()
+// Output: ESP_OK or ESP_ERR_NOT_FOUND if there is no such timer
+// Description: This function calls the callback of the timer as if it expired. The timer need not be running,
+// so the workloads do not depend on the state of the application.
+esp_err_t bench_timer_fire(const char* name)
+{
+    for (size_t i = 0; i < timers_count; i++) {
+        if ((timers[i].args.callback != NULL) && (strcmp(timers[i].args.name, name) == 0)) {
+            timers[i].args.callback(timers[i].args.arg);
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+// void bench_timer_advance(uint64_t us)
+// Input:
+//  us: virtual time to pass
+// Output: none
+// Description: This function moves the clock of esp_timer_get_time() forward by us and expires the running
+// timers on the way, in the order of their expiry, each one with the clock at its expiry. The callbacks
+// may start and stop timers. Time passes without waiting, so long sessions of the application timers are
+// simulated in a moment.
+void bench_timer_advance(uint64_t us)
+{
+    int64_t target = esp_timer_get_time() + (int64_t)us;
+
+    while (true) {
+        struct esp_timer* next = NULL;
+        for (size_t i = 0; i < timers_count; i++) {
+            if (timers[i].running && (timers[i].args.callback != NULL) && (timers[i].expiry <= target) &&
+                ((next == NULL) || (timers[i].expiry < next->expiry))) {
+                next = &timers[i];
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        int64_t now = esp_timer_get_time();
+        if (next->expiry > now) {
+            time_offset_us += next->expiry - now;
+        }
+        if (next->period != 0) {
+            next->expiry += (int64_t)next->period;
+        }
+        else {
+            next->running = false;
+        }
+        next->args.callback(next->args.arg);
+    }
+    int64_t now = esp_timer_get_time();
+    if (target > now) {
+        time_offset_us += target - now;
+    }
+}
+
+// iot_button
+
+struct button_dev_t {
+    button_cb_t cb[BUTTON_EVENT_MAX];
+    void* usr_data[BUTTON_EVENT_MAX];
+    button_event_t event;
+};
+
+static struct button_dev_t button;
+
+esp_err_t iot_button_new_gpio_device(const button_config_t* button_config, const button_gpio_config_t* gpio_cfg, button_handle_t* ret_button)
+{
+    memset(&button, 0, sizeof(button));
+    button.event = BUTTON_NONE_PRESS;
+    *ret_button = &button;
+    return ESP_OK;
+}
+
+esp_err_t iot_button_register_cb(button_handle_t btn_handle, button_event_t event, button_event_args_t* event_args, button_cb_t cb, void* usr_data)
+{
+    if (event >= BUTTON_EVENT_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    btn_handle->cb[event] = cb;
+    btn_handle->usr_data[event] = usr_data;
+    return ESP_OK;
+}
+
+button_event_t iot_button_get_event(button_handle_t btn_handle)
+{
+    return btn_handle->event;
+}
+
+const char* iot_button_get_event_str(button_event_t event)
+{
+    return (event == BUTTON_SINGLE_CLICK) ? "BUTTON_SINGLE_CLICK" : "BUTTON_EVENT";
+}
+
+// void bench_button_emit(button_event_t event)
+// Input:
+//  event: button event
+// Output: none
+// Description: This function calls the callback registered for event, as the button task of
+// espressif/button does.
+void bench_button_emit(button_event_t event)
+{
+    if ((event < BUTTON_EVENT_MAX) && (button.cb[event] != NULL)) {
+        button.event = event;
+        button.cb[event](&button, button.usr_data[event]);
+    }
+}
+
+// anvs, kept in RAM
+
+static uint16_t op_mode = OP_MODE_STANDBY;
+
+esp_err_t anvs_app_op_mode_get(uint16_t* value)
+{
+    *value = op_mode;
+    return ESP_OK;
+}
+
+esp_err_t anvs_app_op_mode_set(uint16_t value)
+{
+    op_mode = value;
+    return ESP_OK;
+}
+
+// No snapshot is kept, so the bench starts P1 by evP1Start as it always did.
+esp_err_t anvs_blob_get(const char* key, void* data, size_t* size)
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t anvs_blob_set(const char* key, const void* data, size_t size)
+{
+    return ESP_OK;
+}
+
+// end of stubs.c
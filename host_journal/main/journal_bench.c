@@ -0,0 +1,324 @@
+// journal_bench.c - wear and throughput of the journal backend of anvs against NVS
+//
+// Both backends persist the same stream of CONFIG_JBENCH_WRITES operative mode changes, each one different
+// from the previous, on the emulated flash of the linux target:
+//  nvs:     nvs_set_u16() + nvs_commit() per change, what anvs does with the NVS backend
+//  journal: ajournal_set() per change; the old sectors are reclaimed after every change when
+//           ajournal_needs_compaction() says so, as the commit task of anvs does
+// One JSON line per backend reports the time per change, the flash operations counted by the emulator and
+// the wear: the erases of the most erased sector of the partition and the changes per erase. The time is
+// the CPU time of the host; on the chip the erases dominate, 4 KB take tens of milliseconds.
+//
+// The recovery check simulates resets during a write. The journal partition is read before and after a
+// change, the record written is located by the difference, and the partition is restored with only the
+// first 1 to AJOURNAL_RECORD_SIZE - 1 bytes of the record programmed. The journal is mounted again: the
+// value before the change must be found, and the next change must be kept after another mount.
+//
+// Each line is printed on stdout. When the environment variable SMDEMO_BENCH_OUT is set, the lines are
+// appended to that file too. SMDEMO_BENCH_COMMIT, when set, is copied to the "commit" field.
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_partition.h"
+#if defined(CONFIG_ESP_PARTITION_ENABLE_STATS)
+#include "esp_private/partition_linux.h"
+#endif  // defined(CONFIG_ESP_PARTITION_ENABLE_STATS)
+#include "nvs_flash.h"
+#include "nvs.h"
+
+#include "commondefs.h"
+#include "anvs.h"
+#include "ajournal.h"
+
+#define JBENCH_OPMODE_KEY   "opmode"
+
+typedef struct {
+    uint64_t ns;
+    uint32_t erases;
+    uint32_t write_ops;
+    uint32_t write_bytes;
+    uint32_t max_wear;          // erases of the most erased sector of the partition
+} jbench_result_t;
+
+static uint32_t rnd_state = 0x12345678;
+
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+static uint64_t jbench_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void jbench_print(FILE* out, const char* line)
+{
+    printf("%s\n", line);
+    if (out != NULL) {
+        fprintf(out, "%s\n", line);
+    }
+}
+
+// static void jbench_wear(const esp_partition_t* part, uint32_t* wear)
+// Input:
+//  part: partition
+//  wear: array of one counter per sector of the partition, where the erase counts to be written
+// Output: none
+// Description: This function reads the erase counters of the emulated flash for the sectors of part.
+static void jbench_wear(const esp_partition_t* part, uint32_t* wear)
+{
+    for (size_t s = 0; s < part->size / AJOURNAL_SECTOR_SIZE; s++) {
+#if defined(CONFIG_ESP_PARTITION_ENABLE_STATS)
+        wear[s] = esp_partition_get_sector_wear(part->address / AJOURNAL_SECTOR_SIZE + s);
+#else
+        wear[s] = 0;
+#endif  // defined(CONFIG_ESP_PARTITION_ENABLE_STATS)
+    }
+}
+
+static void jbench_start(const esp_partition_t* part, uint32_t* wear, jbench_result_t* r)
+{
+    jbench_wear(part, wear);
+#if defined(CONFIG_ESP_PARTITION_ENABLE_STATS)
+    esp_partition_clear_stats();
+#endif  // defined(CONFIG_ESP_PARTITION_ENABLE_STATS)
+    memset(r, 0, sizeof(*r));
+    r->ns = jbench_time_ns();
+}
+
+static void jbench_stop(const esp_partition_t* part, const uint32_t* wear, jbench_result_t* r)
+{
+    uint32_t after[AJOURNAL_MAX_SECTORS * 4];
+    size_t sectors = part->size / AJOURNAL_SECTOR_SIZE;
+
+    r->ns = jbench_time_ns() - r->ns;
+#if defined(CONFIG_ESP_PARTITION_ENABLE_STATS)
+    r->erases = esp_partition_get_erase_ops();
+    r->write_ops = esp_partition_get_write_ops();
+    r->write_bytes = esp_partition_get_write_bytes();
+#endif  // defined(CONFIG_ESP_PARTITION_ENABLE_STATS)
+    if (sectors > ARRAY_SIZE(after)) {
+        sectors = ARRAY_SIZE(after);
+    }
+    jbench_wear(part, after);
+    for (size_t s = 0; s < sectors; s++) {
+        if (after[s] - wear[s] > r->max_wear) {
+            r->max_wear = after[s] - wear[s];
+        }
+    }
+}
+
+static void jbench_report(FILE* out, const char* backend, const jbench_result_t* r, const char* extra)
+{
+    const char* commit = getenv("SMDEMO_BENCH_COMMIT");
+    char line[768];
+
+    snprintf(line, sizeof(line),
+        "{\"bench\":\"smdemo_journal\",\"commit\":\"%s\",\"backend\":\"%s\",\"changes\":%u,"
+        "\"us_per_change\":%.3f,\"erases\":%lu,\"write_ops\":%lu,\"write_bytes\":%lu,"
+        "\"bytes_per_change\":%.1f,\"max_sector_wear\":%lu,\"changes_per_erase\":%.1f%s}",
+        commit != NULL ? commit : "", backend, (unsigned)CONFIG_JBENCH_WRITES,
+        r->ns / 1000.0 / CONFIG_JBENCH_WRITES, (unsigned long)r->erases, (unsigned long)r->write_ops,
+        (unsigned long)r->write_bytes, (double)r->write_bytes / CONFIG_JBENCH_WRITES,
+        (unsigned long)r->max_wear, r->erases > 0 ? (double)CONFIG_JBENCH_WRITES / r->erases : 0.0,
+        extra);
+    jbench_print(out, line);
+}
+
+// static void jbench_nvs(FILE* out)
+// Input:
+//  out: file where the JSON line to be appended, NULL for stdout only
+// Output: none
+// Description: This function persists the changes with nvs_set_u16() and nvs_commit() in a freshly
+// erased NVS partition.
+static void jbench_nvs(FILE* out)
+{
+    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, NULL);
+    uint32_t wear[AJOURNAL_MAX_SECTORS * 4];
+    nvs_handle_t handle;
+    jbench_result_t r;
+
+    if ((part == NULL) || (part->size / AJOURNAL_SECTOR_SIZE > ARRAY_SIZE(wear)) ||
+        (nvs_flash_erase() != ESP_OK) || (nvs_flash_init() != ESP_OK) ||
+        (nvs_open(APP_STORAGE, NVS_READWRITE, &handle) != ESP_OK)) {
+        fprintf(stderr, "Cannot prepare NVS\n");
+        return;
+    }
+    nvs_set_u16(handle, APP_STORAGE_MARK, 1);
+    nvs_commit(handle);
+
+    jbench_start(part, wear, &r);
+    for (uint32_t i = 0; i < CONFIG_JBENCH_WRITES; i++) {
+        if ((nvs_set_u16(handle, JBENCH_OPMODE_KEY, (uint16_t)(i % OP_MODE_COUNT)) != ESP_OK) ||
+            (nvs_commit(handle) != ESP_OK)) {
+            fprintf(stderr, "NVS write %lu failed\n", (unsigned long)i);
+            break;
+        }
+    }
+    jbench_stop(part, wear, &r);
+
+    nvs_close(handle);
+    nvs_flash_deinit();
+    jbench_report(out, "nvs", &r, "");
+}
+
+// static void jbench_journal(FILE* out)
+// Input:
+//  out: file where the JSON line to be appended, NULL for stdout only
+// Output: none
+// Description: This function persists the changes in a freshly formatted journal and checks the value
+// found by a new mount.
+static void jbench_journal(FILE* out)
+{
+    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, AJOURNAL_PARTITION_LABEL);
+    uint32_t wear[AJOURNAL_MAX_SECTORS];
+    ajournal_stats_t stats;
+    jbench_result_t r;
+    char extra[256];
+    uint16_t value = 0xFFFF;
+
+    if ((part == NULL) || (ajournal_mount(AJOURNAL_PARTITION_LABEL) != ESP_OK) || (ajournal_format() != ESP_OK)) {
+        fprintf(stderr, "Cannot prepare the journal\n");
+        return;
+    }
+    ajournal_set(APP_STORAGE_MARK, 1);
+    ajournal_mount(AJOURNAL_PARTITION_LABEL);   // clears the counters
+
+    jbench_start(part, wear, &r);
+    for (uint32_t i = 0; i < CONFIG_JBENCH_WRITES; i++) {
+        if (ajournal_set(JBENCH_OPMODE_KEY, (uint16_t)(i % OP_MODE_COUNT)) != ESP_OK) {
+            fprintf(stderr, "Journal write %lu failed\n", (unsigned long)i);
+            break;
+        }
+        if (ajournal_needs_compaction()) {
+            ajournal_compact();
+        }
+    }
+    jbench_stop(part, wear, &r);
+    ajournal_get_stats(&stats);
+
+    bool kept = (ajournal_mount(AJOURNAL_PARTITION_LABEL) == ESP_OK) &&
+                (ajournal_get(JBENCH_OPMODE_KEY, &value) == ESP_OK) &&
+                (value == (CONFIG_JBENCH_WRITES - 1) % OP_MODE_COUNT);
+    snprintf(extra, sizeof(extra),
+        ",\"sectors\":%lu,\"compactions\":%lu,\"foreground_compactions\":%lu,\"relocations\":%lu,\"remount_ok\":%s",
+        (unsigned long)stats.sectors, (unsigned long)stats.compactions, (unsigned long)stats.foreground,
+        (unsigned long)stats.relocations, kept ? "true" : "false");
+    jbench_report(out, "journal", &r, extra);
+}
+
+// static void jbench_recovery(FILE* out)
+// Input:
+//  out: file where the JSON line to be appended, NULL for stdout only
+// Output: none
+// Description: This function runs CONFIG_JBENCH_TORN_CHECKS simulated resets during a write, see above.
+static void jbench_recovery(FILE* out)
+{
+    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, AJOURNAL_PARTITION_LABEL);
+    const char* commit = getenv("SMDEMO_BENCH_COMMIT");
+    uint8_t* before = (part != NULL) ? malloc(part->size) : NULL;
+    uint8_t* after = (part != NULL) ? malloc(part->size) : NULL;
+    uint32_t failures = 0;
+    uint32_t checks = 0;
+    char line[256];
+
+    if ((before == NULL) || (after == NULL) || (ajournal_mount(AJOURNAL_PARTITION_LABEL) != ESP_OK)) {
+        fprintf(stderr, "Cannot prepare the recovery check\n");
+        goto out;
+    }
+    for (uint32_t n = 0; n < CONFIG_JBENCH_TORN_CHECKS; n++) {
+        uint16_t old_value;
+        uint16_t value;
+
+        // a few plain changes between the checks, so the torn records fall in every sector and slot
+        for (uint32_t i = rnd() % 64; i > 0; i--) {
+            ajournal_get(JBENCH_OPMODE_KEY, &old_value);
+            ajournal_set(JBENCH_OPMODE_KEY, (uint16_t)((old_value + 1) % OP_MODE_COUNT));
+            if (ajournal_needs_compaction()) {
+                ajournal_compact();
+            }
+        }
+        if (ajournal_needs_compaction()) {
+            ajournal_compact();
+        }
+        ajournal_get(JBENCH_OPMODE_KEY, &old_value);
+        esp_partition_read(part, 0, before, part->size);
+        ajournal_set(JBENCH_OPMODE_KEY, (uint16_t)((old_value + 1) % OP_MODE_COUNT));
+        esp_partition_read(part, 0, after, part->size);
+
+        size_t offset = 0;
+        while ((offset < part->size) && (before[offset] == after[offset])) {
+            offset++;
+        }
+        offset -= offset % AJOURNAL_RECORD_SIZE;
+        if (offset >= part->size) {
+            failures++;
+            continue;
+        }
+        // the reset: only the first bytes of the record are programmed
+        size_t cut = 1 + rnd() % (AJOURNAL_RECORD_SIZE - 1);
+        memcpy(&before[offset], &after[offset], cut);
+        esp_partition_erase_range(part, 0, part->size);
+        esp_partition_write(part, 0, before, part->size);
+        checks++;
+
+        if ((ajournal_mount(AJOURNAL_PARTITION_LABEL) != ESP_OK) ||
+            (ajournal_get(JBENCH_OPMODE_KEY, &value) != ESP_OK) || (value != old_value)) {
+            failures++;
+            continue;
+        }
+        // the journal goes on after the torn record
+        uint16_t next = (uint16_t)((old_value + 2) % OP_MODE_COUNT);
+        if ((ajournal_set(JBENCH_OPMODE_KEY, next) != ESP_OK) || (ajournal_mount(AJOURNAL_PARTITION_LABEL) != ESP_OK) ||
+            (ajournal_get(JBENCH_OPMODE_KEY, &value) != ESP_OK) || (value != next)) {
+            failures++;
+        }
+    }
+
+    snprintf(line, sizeof(line),
+        "{\"bench\":\"smdemo_journal_recovery\",\"commit\":\"%s\",\"checks\":%lu,\"failures\":%lu}",
+        commit != NULL ? commit : "", (unsigned long)checks, (unsigned long)failures);
+    jbench_print(out, line);
+out:
+    free(before);
+    free(after);
+}
+
+void app_main(void)
+{
+    const char* path = getenv("SMDEMO_BENCH_OUT");
+    FILE* out = NULL;
+
+    if (path != NULL) {
+        out = fopen(path, "a");
+        if (out == NULL) {
+            fprintf(stderr, "Cannot open %s\n", path);
+        }
+    }
+
+    jbench_nvs(out);
+    jbench_journal(out);
+    jbench_recovery(out);
+
+    if (out != NULL) {
+        fclose(out);
+    }
+    fflush(stdout);
+    exit(0);
+}
+
+// end of journal_bench.c
@@ -0,0 +1,590 @@
+// replay_main.c - player of event recordings of the P1 state machine
+//
+// A recording (.smrec, see main/smrec.h) made on the board with CONFIG_SM_RECORD is fed back into sm_P1 of
+// main/process.c, through the event loop, on the linux target. gpio, esp_timer, iot_button and anvs are the
+// stand-ins of host_bench/main/stubs. The recorder runs during the replay too, so the transitions of the
+// replay are compared with the recorded ones.
+//
+// Start: P1 is started in the operative mode of its first recorded transition, which the stand-in of anvs
+// returns to P1a0. If the recording begins with the start of P1, the recorded post of evP1Start is replayed
+// by P1_start(); otherwise P1 is started before the replay and its first transitions are not compared.
+//
+// Posts: only the posts made outside the event loop are replayed. The posts of the actions are made again
+// by the actions, and the posts which were dropped or coalesced on the board are skipped. Every post is
+// replayed after the loops have processed the previous one, so the replay itself never queues; where the
+// board queued events of different priorities together and the loop reordered them, the replay reports a
+// mismatch. The replay runs twice: at the speed of the recording, waiting for the recorded time of every
+// post, and as fast as possible.
+//
+// Result: the transitions of each machine, in order, must be identical: s1, s2, event, action index and
+// guard result. The latency of a transition is the time since the last post of its event; the recorded and
+// the replayed latencies of matching transitions are compared. Each run prints one JSON line on stdout.
+// When the environment variable SMDEMO_BENCH_OUT is set, the lines are appended to that file too.
+// SMDEMO_BENCH_COMMIT, when set, is copied to the "commit" field.
+//
+// The recording is read from SMDEMO_REPLAY_FILE. Without it the player records a synthetic session of
+// CONFIG_REPLAY_SYNTH_EVENTS button clicks and blink changer ticks on the host first, writes it to
+// SMDEMO_REPLAY_SAVE if set, and replays it.
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "commondefs.h"
+#include "state_machine.h"
+#include "process.h"
+#include "evloop.h"
+#include "proc.h"
+#include "anvs.h"
+#include "twheel.h"
+#include "smrec.h"
+#include "bench_stubs.h"
+
+// Priority of the player: below the event loop tasks, so a post is processed before the player goes on.
+#define REPLAY_PRIO         (1)
+
+#define REPLAY_READ_CHUNK   (256)
+#define REPLAY_SPIN_NS      (2000000ull)    // waits shorter than this spin instead of sleeping
+
+#define REPLAY_NO_LATENCY   (UINT32_MAX)
+
+typedef struct {
+    smrec_header_t header;
+    smrec_record_t* records;
+    size_t count;
+    size_t size;
+} replay_log_t;
+
+// Transition of a log, with the position of its record and its latency
+typedef struct {
+    const smrec_record_t* r;
+    size_t seq;
+    uint32_t time;          // us since the start of the recording
+    uint32_t latency;       // us, REPLAY_NO_LATENCY if no post of the event was found
+} replay_transition_t;
+
+// Operative mode of the steady states of P1, the ones set by P1a1..P1a5
+static const struct {
+    bool steady;
+    device_modes_t mode;
+} replay_state_modes[sP1_STATE_COUNT] = {
+    [sP1_STANDBY]    = { true, OP_MODE_STANDBY },
+    [sP1_AUTO]       = { true, OP_MODE_AUTO },
+    [sP1_AUTO_NIGHT] = { true, OP_MODE_AUTO_NIGHT },
+    [sP1_MANUAL]     = { true, OP_MODE_MANUAL },
+    [sP1_TEST]       = { true, OP_MODE_TEST },
+};
+
+static uint32_t rnd_state = 0x12345678;
+
+static uint32_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+// static bool replay_append(replay_log_t* log, const smrec_record_t* records, size_t n)
+// Input:
+//  log: log to be extended
+//  records: records to be appended
+//  n: number of records
+// Output: false if there is no memory
+// Description: This function appends records to a log, growing its array by doubling.
+static bool replay_append(replay_log_t* log, const smrec_record_t* records, size_t n)
+{
+    if (log->count + n > log->size) {
+        size_t size = (log->size > 0) ? log->size : 1024;
+        while (size < log->count + n) {
+            size *= 2;
+        }
+        smrec_record_t* grown = realloc(log->records, size * sizeof(smrec_record_t));
+        if (grown == NULL) {
+            return false;
+        }
+        log->records = grown;
+        log->size = size;
+    }
+    memcpy(&log->records[log->count], records, n * sizeof(smrec_record_t));
+    log->count += n;
+    return true;
+}
+
+static void replay_free(replay_log_t* log)
+{
+    free(log->records);
+    *log = (replay_log_t) { 0 };
+}
+
+// static void replay_drain(replay_log_t* log)
+// Input:
+//  log: log where the records of the recorder to be appended
+// Output: none
+// Description: This function takes the records collected by the recorder out of its ring.
+static void replay_drain(replay_log_t* log)
+{
+    smrec_record_t chunk[REPLAY_READ_CHUNK];
+    size_t n;
+
+    while ((n = smrec_read(chunk, ARRAY_SIZE(chunk))) > 0) {
+        if (!replay_append(log, chunk, n)) {
+            fprintf(stderr, "Out of memory, %u records lost\n", (unsigned)n);
+        }
+    }
+}
+
+// static void replay_wait_idle(replay_log_t* log)
+// Input:
+//  log: log where the records of the recorder to be appended, NULL if none
+// Output: none
+// Description: This function waits until the event loops have processed all queued events.
+static void replay_wait_idle(replay_log_t* log)
+{
+    evloop_stats_t stats;
+
+    evloop_get_stats(&stats);
+    while (stats.dispatched + stats.evicted != stats.posted) {
+        taskYIELD();
+        evloop_get_stats(&stats);
+    }
+    if (log != NULL) {
+        replay_drain(log);
+    }
+}
+
+static void replay_wait_until(uint64_t deadline_ns)
+{
+    uint64_t now;
+
+    while ((now = bench_time_ns()) < deadline_ns) {
+        if (deadline_ns - now > REPLAY_SPIN_NS) {
+            vTaskDelay(1);
+        }
+    }
+}
+
+// static bool replay_load(const char* path, replay_log_t* log)
+// Input:
+//  path: .smrec file
+//  log: pointer to a variable where the recording to be written
+// Output: false if the file cannot be read or is not a recording of this application
+// Description: This function reads a recording and checks its header.
+static bool replay_load(const char* path, replay_log_t* log)
+{
+    FILE* f = fopen(path, "rb");
+    smrec_record_t chunk[REPLAY_READ_CHUNK];
+    size_t n;
+
+    *log = (replay_log_t) { 0 };
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    if ((fread(&log->header, sizeof(log->header), 1, f) != 1) || (log->header.magic != SMREC_MAGIC) ||
+        (log->header.version != SMREC_VERSION) || (log->header.record_size != sizeof(smrec_record_t))) {
+        fprintf(stderr, "%s is not a recording of version %u\n", path, (unsigned)SMREC_VERSION);
+        fclose(f);
+        return false;
+    }
+    if (log->header.events != sm_EVENTS_NUMBER) {
+        fprintf(stderr, "%s has %u events, the application %u\n", path, (unsigned)log->header.events,
+                (unsigned)sm_EVENTS_NUMBER);
+        fclose(f);
+        return false;
+    }
+    while ((n = fread(chunk, sizeof(smrec_record_t), ARRAY_SIZE(chunk), f)) > 0) {
+        if (!replay_append(log, chunk, n)) {
+            fprintf(stderr, "Out of memory reading %s\n", path);
+            fclose(f);
+            replay_free(log);
+            return false;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static bool replay_save(const char* path, const replay_log_t* log)
+{
+    FILE* f = fopen(path, "wb");
+
+    if (f == NULL) {
+        fprintf(stderr, "Cannot create %s\n", path);
+        return false;
+    }
+    bool ok = (fwrite(&log->header, sizeof(log->header), 1, f) == 1) &&
+              (fwrite(log->records, sizeof(smrec_record_t), log->count, f) == log->count);
+    return (fclose(f) == 0) && ok;
+}
+
+// static void replay_synthesize(replay_log_t* log)
+// Input:
+//  log: pointer to a variable where the recording to be written
+// Output: none
+// Description: This function records the start of P1 and CONFIG_REPLAY_SYNTH_EVENTS button clicks and
+// blink changer ticks with random pauses, posted as on the board.
+static void replay_synthesize(replay_log_t* log)
+{
+    *log = (replay_log_t) { 0 };
+    anvs_app_op_mode_set(OP_MODE_STANDBY);
+
+    smrec_start();
+    smrec_get_header(&log->header);
+    P1_start();
+    replay_wait_idle(log);
+
+    for (uint32_t i = 0; i < CONFIG_REPLAY_SYNTH_EVENTS; i++) {
+        if (CONFIG_REPLAY_SYNTH_MAX_GAP_US > 0) {
+            replay_wait_until(bench_time_ns() + (uint64_t)(rnd() % CONFIG_REPLAY_SYNTH_MAX_GAP_US) * 1000);
+        }
+        if (rnd() % 2) {
+            bench_button_emit(BUTTON_SINGLE_CLICK);
+        }
+        else {
+            evloop_post(ev_t_blink_changer_tick);
+        }
+        replay_wait_idle(log);
+    }
+    smrec_stop();
+    replay_drain(log);
+}
+
+// static sP1_states_t replay_start_state(const replay_log_t* log, bool* boot)
+// Input:
+//  log: recording
+//  boot: set to true if the recording begins with the start of P1
+// Output: state P1 has to be started in
+// Description: This function takes the first steady state of P1 in the recording.
+static sP1_states_t replay_start_state(const replay_log_t* log, bool* boot)
+{
+    *boot = false;
+    for (size_t i = 0; i < log->count; i++) {
+        const smrec_record_t* r = &log->records[i];
+        if ((r->kind != SMREC_TRANSITION) || (r->id != P1_ID) || ((r->flags & SMREC_F_PERMITTED) == 0)) {
+            continue;
+        }
+        if (r->s1 == sP1_START) {
+            *boot = true;
+            continue;
+        }
+        sm_state_idx_t state = (r->s1 == sP1_RESOLVE) ? r->s2 : r->s1;
+        if ((state < sP1_STATE_COUNT) && replay_state_modes[state].steady) {
+            return (sP1_states_t)state;
+        }
+    }
+    return sP1_STANDBY;
+}
+
+static int cmp_by_time(const void* a, const void* b)
+{
+    const replay_transition_t* x = a;
+    const replay_transition_t* y = b;
+    if (x->time != y->time) {
+        return (x->time > y->time) - (x->time < y->time);
+    }
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static int cmp_by_machine(const void* a, const void* b)
+{
+    const replay_transition_t* x = a;
+    const replay_transition_t* y = b;
+    if (x->r->id != y->r->id) {
+        return (x->r->id > y->r->id) - (x->r->id < y->r->id);
+    }
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// static replay_transition_t* replay_transitions(const replay_log_t* log, size_t* count)
+// Input:
+//  log: recording or capture of a replay
+//  count: pointer to a variable where the number of transitions to be written
+// Output: array of the transitions, ordered by machine and by record, to be freed; NULL if none
+// Description: This function collects the transitions of a log with their latencies. The posts and the
+// transitions are merged by time; the latency of a transition is its time minus the time of the last
+// queued post of its event.
+static replay_transition_t* replay_transitions(const replay_log_t* log, size_t* count)
+{
+    size_t n = 0;
+    size_t posts = 0;
+
+    for (size_t i = 0; i < log->count; i++) {
+        n += (log->records[i].kind == SMREC_TRANSITION);
+        posts += (log->records[i].kind == SMREC_POST) && ((log->records[i].flags & SMREC_F_DISCARDED) == 0);
+    }
+    *count = n;
+    if (n == 0) {
+        return NULL;
+    }
+    replay_transition_t* tr = malloc(n * sizeof(replay_transition_t));
+    replay_transition_t* po = malloc((posts + 1) * sizeof(replay_transition_t));
+    if ((tr == NULL) || (po == NULL)) {
+        free(tr);
+        free(po);
+        *count = 0;
+        return NULL;
+    }
+
+    size_t t = 0;
+    size_t p = 0;
+    for (size_t i = 0; i < log->count; i++) {
+        const smrec_record_t* r = &log->records[i];
+        replay_transition_t e = { .r = r, .seq = i, .time = r->timestamp - log->header.start, .latency = REPLAY_NO_LATENCY };
+        if (r->kind == SMREC_TRANSITION) {
+            tr[t++] = e;
+        }
+        else if ((r->kind == SMREC_POST) && ((r->flags & SMREC_F_DISCARDED) == 0)) {
+            po[p++] = e;
+        }
+    }
+    qsort(tr, n, sizeof(tr[0]), cmp_by_time);
+    qsort(po, posts, sizeof(po[0]), cmp_by_time);
+
+    uint32_t last_post[UINT8_MAX + 1];
+    bool seen[UINT8_MAX + 1] = { false };
+    p = 0;
+    for (t = 0; t < n; t++) {
+        while ((p < posts) && (po[p].time <= tr[t].time)) {
+            last_post[po[p].r->event] = po[p].time;
+            seen[po[p].r->event] = true;
+            p++;
+        }
+        if (seen[tr[t].r->event]) {
+            tr[t].latency = tr[t].time - last_post[tr[t].r->event];
+        }
+    }
+    free(po);
+
+    qsort(tr, n, sizeof(tr[0]), cmp_by_machine);
+    return tr;
+}
+
+static bool replay_same(const smrec_record_t* a, const smrec_record_t* b)
+{
+    return (a->id == b->id) && (a->s1 == b->s1) && (a->s2 == b->s2) && (a->event == b->event) &&
+           (a->actidx == b->actidx) && ((a->flags & SMREC_F_PERMITTED) == (b->flags & SMREC_F_PERMITTED));
+}
+
+static uint32_t percentile(const uint32_t* sorted, size_t count, uint32_t per_mille)
+{
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = ((uint64_t)count * per_mille + 999) / 1000;
+    return sorted[(rank > 0 ? rank : 1) - 1];
+}
+
+// static void replay_run(const replay_log_t* rec, bool fast, const char* source, FILE* out)
+// Input:
+//  rec: recording
+//  fast: true to post as fast as possible, false to keep the recorded times
+//  source: name of the recording for the result
+//  out: file where the result to be appended, NULL if none
+// Output: none
+// Description: This function restarts P1 in the state of the recording, replays the posts, compares the
+// transitions and prints the result as one JSON line.
+static void replay_run(const replay_log_t* rec, bool fast, const char* source, FILE* out)
+{
+    const char* commit = getenv("SMDEMO_BENCH_COMMIT");
+    replay_log_t cap = { 0 };
+    uint32_t posts = 0;
+    uint32_t skipped = 0;
+    bool boot;
+
+    // a recording which begins with the start of P1 resolves the mode from appstore, as it did; otherwise
+    // P1 is put directly into the recorded state, which the mode alone may not give back
+    sP1_states_t state = replay_start_state(rec, &boot);
+    P1_stop();
+    replay_wait_idle(NULL);
+    anvs_app_op_mode_set(replay_state_modes[state].mode);
+    if (!boot) {
+        P1_start_in(state);
+        replay_wait_idle(NULL);
+    }
+    bool started = !boot;
+
+    smrec_start();
+    smrec_get_header(&cap.header);
+    uint64_t t0 = bench_time_ns();
+
+    for (size_t i = 0; i < rec->count; i++) {
+        const smrec_record_t* r = &rec->records[i];
+        if (r->kind != SMREC_POST) {
+            continue;
+        }
+        if ((r->flags & (SMREC_F_INTERNAL | SMREC_F_DISCARDED)) != 0) {
+            skipped++;
+            continue;
+        }
+        if (!fast) {
+            replay_wait_until(t0 + (uint64_t)(uint32_t)(r->timestamp - rec->header.start) * 1000);
+        }
+        if ((r->event == evP1Start) && !started) {
+            P1_start();
+            started = true;
+        }
+        else {
+            evloop_post_to(r->id, (sm_event_type_t)r->event);
+        }
+        posts++;
+        replay_wait_idle(&cap);
+    }
+    uint64_t t1 = bench_time_ns();
+    smrec_stop();
+    replay_drain(&cap);
+
+    smrec_stats_t stats;
+    smrec_get_stats(&stats);
+
+    size_t n_rec;
+    size_t n_rep;
+    replay_transition_t* expected = replay_transitions(rec, &n_rec);
+    replay_transition_t* actual = replay_transitions(&cap, &n_rep);
+    size_t common = (n_rec < n_rep) ? n_rec : n_rep;
+    uint32_t* lat_rec = malloc((common + 1) * sizeof(uint32_t));
+    uint32_t* lat_rep = malloc((common + 1) * sizeof(uint32_t));
+    size_t mismatches = (n_rec > n_rep) ? n_rec - n_rep : n_rep - n_rec;
+    long first_mismatch = -1;
+    size_t timed = 0;
+    int64_t delta_sum = 0;
+    int64_t delta_max = 0;
+
+    for (size_t i = 0; i < common; i++) {
+        if (!replay_same(expected[i].r, actual[i].r)) {
+            if (first_mismatch < 0) {
+                first_mismatch = (long)i;
+                fprintf(stderr, "%s: transition %u differs: recorded %u->%u on event %u, replayed %u->%u on event %u\n",
+                        source, (unsigned)i, (unsigned)expected[i].r->s1, (unsigned)expected[i].r->s2,
+                        (unsigned)expected[i].r->event, (unsigned)actual[i].r->s1, (unsigned)actual[i].r->s2,
+                        (unsigned)actual[i].r->event);
+            }
+            mismatches++;
+            continue;
+        }
+        if ((lat_rec != NULL) && (lat_rep != NULL) &&
+            (expected[i].latency != REPLAY_NO_LATENCY) && (actual[i].latency != REPLAY_NO_LATENCY)) {
+            int64_t delta = (int64_t)actual[i].latency - (int64_t)expected[i].latency;
+            lat_rec[timed] = expected[i].latency;
+            lat_rep[timed] = actual[i].latency;
+            timed++;
+            delta_sum += delta;
+            if (llabs(delta) > llabs(delta_max)) {
+                delta_max = delta;
+            }
+        }
+    }
+    if ((first_mismatch < 0) && (mismatches > 0)) {
+        first_mismatch = (long)common;
+    }
+    if (timed > 0) {
+        qsort(lat_rec, timed, sizeof(uint32_t), cmp_u32);
+        qsort(lat_rep, timed, sizeof(uint32_t), cmp_u32);
+    }
+
+    uint32_t recorded_us = 0;
+    for (size_t i = 0; i < rec->count; i++) {
+        uint32_t t = rec->records[i].timestamp - rec->header.start;
+        if (t > recorded_us) {
+            recorded_us = t;
+        }
+    }
+
+    char line[768];
+    snprintf(line, sizeof(line),
+        "{\"bench\":\"smdemo_replay\",\"commit\":\"%s\",\"source\":\"%s\",\"speed\":\"%s\",\"start_mode\":%u,"
+        "\"start_state\":%u,\"boot\":%s,\"posts\":%lu,\"skipped\":%lu,\"transitions\":%u,\"replayed\":%u,\"mismatches\":%u,"
+        "\"first_mismatch\":%ld,\"identical\":%s,\"dropped\":%lu,\"recorded_us\":%lu,\"replayed_us\":%llu,"
+        "\"latency_us\":{\"samples\":%u,\"recorded\":{\"p50\":%lu,\"p99\":%lu,\"max\":%lu},"
+        "\"replayed\":{\"p50\":%lu,\"p99\":%lu,\"max\":%lu},\"delta_mean\":%.2f,\"delta_max\":%lld}}",
+        commit != NULL ? commit : "", source, fast ? "fast" : "original", (unsigned)replay_state_modes[state].mode,
+        (unsigned)state, boot ? "true" : "false", (unsigned long)posts, (unsigned long)skipped, (unsigned)n_rec, (unsigned)n_rep,
+        (unsigned)mismatches, first_mismatch, (mismatches == 0) ? "true" : "false", (unsigned long)stats.dropped,
+        (unsigned long)recorded_us, (unsigned long long)((t1 - t0) / 1000), (unsigned)timed,
+        (unsigned long)percentile(lat_rec, timed, 500), (unsigned long)percentile(lat_rec, timed, 990),
+        (unsigned long)percentile(lat_rec, timed, 1000),
+        (unsigned long)percentile(lat_rep, timed, 500), (unsigned long)percentile(lat_rep, timed, 990),
+        (unsigned long)percentile(lat_rep, timed, 1000),
+        (timed > 0) ? (double)delta_sum / timed : 0.0, (long long)delta_max);
+    printf("%s\n", line);
+    if (out != NULL) {
+        fprintf(out, "%s\n", line);
+    }
+
+    free(lat_rec);
+    free(lat_rep);
+    free(expected);
+    free(actual);
+    replay_free(&cap);
+}
+
+void app_main(void)
+{
+    const char* out_path = getenv("SMDEMO_BENCH_OUT");
+    const char* path = getenv("SMDEMO_REPLAY_FILE");
+    const char* save = getenv("SMDEMO_REPLAY_SAVE");
+    replay_log_t rec;
+    FILE* out = NULL;
+
+    if (out_path != NULL) {
+        out = fopen(out_path, "a");
+        if (out == NULL) {
+            fprintf(stderr, "Cannot open %s\n", out_path);
+        }
+    }
+
+    init_button();
+    init_led_blinking();
+    twheel_init();
+    smrec_init();
+
+    if (register_state_machines() != ESP_OK) {
+        fprintf(stderr, "Not all state machines are registered\n");
+        exit(1);
+    }
+    if (evloop_create() != ESP_OK) {
+        fprintf(stderr, "Cannot create the event loop\n");
+        exit(1);
+    }
+    vTaskPrioritySet(NULL, REPLAY_PRIO);
+
+    if (path != NULL) {
+        if (!replay_load(path, &rec)) {
+            exit(1);
+        }
+    }
+    else {
+        replay_synthesize(&rec);
+        path = "synthetic";
+        if ((save != NULL) && !replay_save(save, &rec)) {
+            fprintf(stderr, "Cannot write %s\n", save);
+        }
+    }
+
+    replay_run(&rec, false, path, out);
+    replay_run(&rec, true, path, out);
+    replay_free(&rec);
+
+    if (out != NULL) {
+        fclose(out);
+    }
+    fflush(stdout);
+    exit(0);
+}
+
+// end of replay_main.c
@@ -0,0 +1,471 @@
+// ajournal.c
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+#include "ajournal.h"
+
+static const char TAG[] = "AJRN";
+
+#define AJOURNAL_NO_SEQ         (0xFFFFFFFFu)   // seq of an erased record
+#define AJOURNAL_NO_SECTOR      (0xFFu)         // sector of a key without a record yet
+#define AJOURNAL_READ_RECORDS   (16)            // records read at once by ajournal_mount()
+
+typedef struct {
+    uint32_t seq;
+    char key[AJOURNAL_KEY_SIZE];
+    uint16_t value;
+    uint8_t spare[6];           // left erased
+    uint32_t crc;               // of the fields above
+} ajournal_record_t;
+
+_Static_assert(sizeof(ajournal_record_t) == AJOURNAL_RECORD_SIZE, "ajournal_record_t must be AJOURNAL_RECORD_SIZE bytes");
+_Static_assert(AJOURNAL_SECTOR_SIZE % AJOURNAL_RECORD_SIZE == 0, "records must not cross sectors");
+
+// Newest record of a key.
+typedef struct {
+    char key[AJOURNAL_KEY_SIZE];
+    uint32_t seq;
+    uint16_t value;
+    uint8_t sector;             // AJOURNAL_NO_SECTOR until the first record is appended
+} ajournal_key_t;
+
+_Static_assert(AJOURNAL_MAX_SECTORS < AJOURNAL_NO_SECTOR, "sector indexes must fit ajournal_key_t");
+
+typedef struct {
+    uint32_t first_seq;         // oldest valid record, AJOURNAL_NO_SEQ if there is none
+    uint16_t used;              // records written, valid or not; 0: the sector is erased
+} ajournal_sector_t;
+
+static const esp_partition_t* journal = NULL;
+static ajournal_sector_t sectors[AJOURNAL_MAX_SECTORS];
+static uint32_t sectors_count = 0;
+static ajournal_key_t keys[CONFIG_ANVS_JOURNAL_MAX_KEYS];
+static uint32_t keys_count = 0;
+static uint32_t head = 0;       // sector appended to
+static uint32_t next_seq = 1;
+static ajournal_stats_t stats;
+
+static uint32_t ajournal_crc(const ajournal_record_t* record)
+{
+    return esp_rom_crc32_le(0, (const uint8_t*)record, offsetof(ajournal_record_t, crc));
+}
+
+static bool ajournal_is_erased(const ajournal_record_t* record)
+{
+    const uint8_t* p = (const uint8_t*)record;
+    for (size_t i = 0; i < sizeof(*record); i++) {
+        if (p[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static ajournal_key_t* ajournal_key_find(const char* key)
+{
+    for (uint32_t i = 0; i < keys_count; i++) {
+        if (strncmp(keys[i].key, key, AJOURNAL_KEY_SIZE) == 0) {
+            return &keys[i];
+        }
+    }
+    return NULL;
+}
+
+static ajournal_key_t* ajournal_key_add(const char* key)
+{
+    if (keys_count >= CONFIG_ANVS_JOURNAL_MAX_KEYS) {
+        return NULL;
+    }
+    ajournal_key_t* k = &keys[keys_count++];
+    strncpy(k->key, key, AJOURNAL_KEY_SIZE - 1);
+    k->key[AJOURNAL_KEY_SIZE - 1] = 0;
+    k->seq = 0;
+    k->value = 0;
+    k->sector = AJOURNAL_NO_SECTOR;     // not relocated by a reclaim before its first record
+    return k;
+}
+
+static uint32_t ajournal_free_count(void)
+{
+    uint32_t n = 0;
+    for (uint32_t s = 0; s < sectors_count; s++) {
+        n += (sectors[s].used == 0);
+    }
+    return n;
+}
+
+// static int ajournal_victim(void)
+// Input: none
+// Output: sector to reclaim, -1 if there is none
+// Description: This function returns the sector with the oldest records, the head excluded. A sector which
+// is written but has no valid record, e.g. after a reset during an erase, is taken first.
+static int ajournal_victim(void)
+{
+    int victim = -1;
+    uint32_t oldest = AJOURNAL_NO_SEQ;
+
+    for (uint32_t s = 0; s < sectors_count; s++) {
+        if ((s == head) || (sectors[s].used == 0)) {
+            continue;
+        }
+        uint32_t seq = (sectors[s].first_seq == AJOURNAL_NO_SEQ) ? 0 : sectors[s].first_seq;
+        if ((victim < 0) || (seq < oldest)) {
+            victim = (int)s;
+            oldest = seq;
+        }
+    }
+    return victim;
+}
+
+static esp_err_t ajournal_erase(uint32_t s)
+{
+    esp_err_t ret = esp_partition_erase_range(journal, (size_t)s * AJOURNAL_SECTOR_SIZE, AJOURNAL_SECTOR_SIZE);
+    if (ret == ESP_OK) {
+        sectors[s].first_seq = AJOURNAL_NO_SEQ;
+        sectors[s].used = 0;
+        stats.erases++;
+    }
+    return ret;
+}
+
+// static esp_err_t ajournal_advance(void)
+// Input: none
+// Output: ESP_OK, ESP_ERR_NO_MEM if the head is full and there is no free sector
+// Description: This function moves the head to the next free sector when it is full.
+static esp_err_t ajournal_advance(void)
+{
+    if (sectors[head].used < AJOURNAL_RECORDS_PER_SECTOR) {
+        return ESP_OK;
+    }
+    for (uint32_t i = 1; i < sectors_count; i++) {
+        uint32_t s = (head + i) % sectors_count;
+        if (sectors[s].used == 0) {
+            head = s;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+// static esp_err_t ajournal_append(ajournal_key_t* k, uint16_t value)
+// Input:
+//  k: key, added to the key table
+//  value: value
+// Output: ESP error code of esp_partition_write()
+// Description: This function writes a record at the head, which must have room. The slot is used even if
+// the write fails, as it may be partly written.
+static esp_err_t ajournal_append(ajournal_key_t* k, uint16_t value)
+{
+    ajournal_record_t record;
+
+    memset(&record, 0xFF, sizeof(record));
+    record.seq = next_seq;
+    memset(record.key, 0, sizeof(record.key));
+    strncpy(record.key, k->key, AJOURNAL_KEY_SIZE - 1);
+    record.value = value;
+    record.crc = ajournal_crc(&record);
+
+    ajournal_sector_t* sector = &sectors[head];
+    size_t offset = (size_t)head * AJOURNAL_SECTOR_SIZE + (size_t)sector->used * AJOURNAL_RECORD_SIZE;
+    sector->used++;
+    esp_err_t ret = esp_partition_write(journal, offset, &record, sizeof(record));
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (sector->first_seq == AJOURNAL_NO_SEQ) {
+        sector->first_seq = next_seq;
+    }
+    k->seq = next_seq++;
+    k->value = value;
+    k->sector = (uint8_t)head;
+    stats.bytes_written += sizeof(record);
+    return ESP_OK;
+}
+
+// static esp_err_t ajournal_reclaim(uint32_t victim)
+// Input:
+//  victim: sector to reclaim
+// Output: ESP error code
+// Description: This function copies the records of victim which are the newest of their key to the head
+// and erases victim. A reset in between leaves two copies; the newer one is taken by ajournal_mount().
+static esp_err_t ajournal_reclaim(uint32_t victim)
+{
+    esp_err_t ret = ESP_OK;
+
+    for (uint32_t i = 0; (i < keys_count) && (ret == ESP_OK); i++) {
+        if (keys[i].sector != victim) {
+            continue;
+        }
+        ret = ajournal_advance();
+        if (ret == ESP_OK) {
+            ret = ajournal_append(&keys[i], keys[i].value);
+        }
+        if (ret == ESP_OK) {
+            stats.relocations++;
+        }
+    }
+    if (ret == ESP_OK) {
+        ret = ajournal_erase(victim);
+    }
+    if (ret == ESP_OK) {
+        stats.compactions++;
+    }
+    else {
+        ESP_LOGE(TAG, "Cannot reclaim sector %" PRIu32 ": %s", victim, esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+// static esp_err_t ajournal_reclaim_until(uint32_t free_sectors)
+// Input:
+//  free_sectors: number of free sectors to reach
+// Output: ESP error code
+// Description: This function reclaims the oldest sectors until free_sectors are free, or no sector can be
+// reclaimed, at most once per sector.
+static esp_err_t ajournal_reclaim_until(uint32_t free_sectors)
+{
+    esp_err_t ret = ESP_OK;
+    int victim;
+
+    for (uint32_t n = 0; (n < sectors_count) && (ret == ESP_OK) && (ajournal_free_count() < free_sectors); n++) {
+        if ((victim = ajournal_victim()) < 0) {
+            break;
+        }
+        ret = ajournal_reclaim((uint32_t)victim);
+    }
+    return ret;
+}
+
+// esp_err_t ajournal_mount(const char* label)
+// Input:
+//  label: label of the data partition
+// Output: ESP_OK, ESP_ERR_NOT_FOUND if there is no such partition, ESP_ERR_INVALID_SIZE if it has less
+// than AJOURNAL_MIN_SECTORS sectors, ESP_ERR_NO_MEM if the partition holds more keys than the key table,
+// or the error code of esp_partition_read()
+// Description: This function scans the partition once and rebuilds the key table from the newest valid
+// record of every key. Writing continues after the newest record. A key left out of the table would not
+// be relocated by a reclaim, which would erase its only copy, so the mount fails instead.
+esp_err_t ajournal_mount(const char* label)
+{
+    ajournal_record_t buf[AJOURNAL_READ_RECORDS];
+    uint32_t max_seq = 0;
+    bool found = false;
+
+    journal = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (journal == NULL) {
+        ESP_LOGE(TAG, "No partition '%s'", label);
+        return ESP_ERR_NOT_FOUND;
+    }
+    sectors_count = journal->size / AJOURNAL_SECTOR_SIZE;
+    if (sectors_count < AJOURNAL_MIN_SECTORS) {
+        journal = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (sectors_count > AJOURNAL_MAX_SECTORS) {
+        sectors_count = AJOURNAL_MAX_SECTORS;
+    }
+    keys_count = 0;
+    head = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    for (uint32_t s = 0; s < sectors_count; s++) {
+        sectors[s].first_seq = AJOURNAL_NO_SEQ;
+        sectors[s].used = 0;
+        for (uint32_t r = 0; r < AJOURNAL_RECORDS_PER_SECTOR; r += AJOURNAL_READ_RECORDS) {
+            esp_err_t ret = esp_partition_read(journal, (size_t)s * AJOURNAL_SECTOR_SIZE + (size_t)r * AJOURNAL_RECORD_SIZE,
+                                               buf, sizeof(buf));
+            if (ret != ESP_OK) {
+                journal = NULL;
+                return ret;
+            }
+            for (uint32_t i = 0; i < AJOURNAL_READ_RECORDS; i++) {
+                ajournal_record_t* record = &buf[i];
+                if (ajournal_is_erased(record)) {
+                    continue;
+                }
+                sectors[s].used = r + i + 1;
+                if ((record->seq == AJOURNAL_NO_SEQ) || (ajournal_crc(record) != record->crc)) {
+                    stats.torn_records++;
+                    continue;
+                }
+                record->key[AJOURNAL_KEY_SIZE - 1] = 0;
+                if (record->seq < sectors[s].first_seq) {
+                    sectors[s].first_seq = record->seq;
+                }
+                ajournal_key_t* k = ajournal_key_find(record->key);
+                if ((k == NULL) && ((k = ajournal_key_add(record->key)) == NULL)) {
+                    ESP_LOGE(TAG, "Key table is full, cannot track '%s'", record->key);
+                    journal = NULL;
+                    return ESP_ERR_NO_MEM;
+                }
+                if (record->seq > k->seq) {
+                    k->seq = record->seq;
+                    k->value = record->value;
+                    k->sector = (uint8_t)s;
+                }
+                if (!found || (record->seq > max_seq)) {
+                    max_seq = record->seq;
+                    head = s;
+                    found = true;
+                }
+            }
+        }
+    }
+    next_seq = found ? max_seq + 1 : 1;
+    if (!found) {
+        for (uint32_t s = 0; s < sectors_count; s++) {
+            if (sectors[s].used == 0) {
+                head = s;
+                break;
+            }
+        }
+    }
+    ESP_LOGI(TAG, "Mounted '%s': %" PRIu32 " sectors, %" PRIu32 " free, %" PRIu32 " keys, next seq %" PRIu32
+             ", %" PRIu32 " torn records",
+             label, sectors_count, ajournal_free_count(), keys_count, next_seq, stats.torn_records);
+    return ESP_OK;
+}
+
+// esp_err_t ajournal_format(void)
+// Input: none
+// Output: ESP error code
+// Description: This function erases the journal. All values are lost.
+esp_err_t ajournal_format(void)
+{
+    if (journal == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (uint32_t s = 0; s < sectors_count; s++) {
+        esp_err_t ret = ajournal_erase(s);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+    keys_count = 0;
+    head = 0;
+    next_seq = 1;
+    return ESP_OK;
+}
+
+// esp_err_t ajournal_get(const char* key, uint16_t* value)
+// Input:
+//  key: key of the value
+//  value: pointer to a variable where the value to be written
+// Output: ESP_OK, ESP_ERR_NOT_FOUND, ESP_ERR_INVALID_STATE if the journal is not mounted
+// Description: This function returns the newest value of key from the key table; it reads no flash.
+esp_err_t ajournal_get(const char* key, uint16_t* value)
+{
+    if (journal == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    ajournal_key_t* k = ajournal_key_find(key);
+    if (k == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *value = k->value;
+    return ESP_OK;
+}
+
+// esp_err_t ajournal_set(const char* key, uint16_t value)
+// Input:
+//  key: key of the value, shorter than AJOURNAL_KEY_SIZE
+//  value: value
+// Output: ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_INVALID_STATE, ESP_ERR_NO_MEM if the key table is full, or
+// the error code of the flash access
+// Description: This function appends a record with the new value of key. The record is durable when the
+// function returns; there is no commit. A value equal to the current one is not written. When the head is
+// full and only one sector is free, the oldest sectors are reclaimed first, so a free sector is always left
+// for the copies of the reclaim.
+esp_err_t ajournal_set(const char* key, uint16_t value)
+{
+    if (journal == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if ((key == NULL) || (strlen(key) >= AJOURNAL_KEY_SIZE)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ajournal_key_t* k = ajournal_key_find(key);
+    if ((k != NULL) && (k->value == value)) {
+        stats.unchanged++;
+        return ESP_OK;
+    }
+    if ((k == NULL) && ((k = ajournal_key_add(key)) == NULL)) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t ret = ESP_OK;
+    if ((sectors[head].used >= AJOURNAL_RECORDS_PER_SECTOR) && (ajournal_free_count() <= 1)) {
+        uint32_t compactions = stats.compactions;
+        ret = ajournal_reclaim_until(2);
+        stats.foreground += stats.compactions - compactions;
+    }
+    if (ret == ESP_OK) {
+        ret = ajournal_advance();
+    }
+    if (ret == ESP_OK) {
+        ret = ajournal_append(k, value);
+    }
+    if (ret == ESP_OK) {
+        stats.appends++;
+    }
+    else if (k->seq == 0) {
+        keys_count--;       // the key was added by this call
+    }
+    return ret;
+}
+
+// bool ajournal_needs_compaction(void)
+// Input: none
+// Output: true if fewer than CONFIG_ANVS_JOURNAL_FREE_SECTORS sectors are free and one can be reclaimed
+// Description: This function tells the background task whether to call ajournal_compact().
+bool ajournal_needs_compaction(void)
+{
+    return (journal != NULL) && (ajournal_free_count() < CONFIG_ANVS_JOURNAL_FREE_SECTORS) && (ajournal_victim() >= 0);
+}
+
+// esp_err_t ajournal_compact(void)
+// Input: none
+// Output: ESP error code
+// Description: This function reclaims the oldest sectors until CONFIG_ANVS_JOURNAL_FREE_SECTORS are free.
+// It is called in the background, so ajournal_set() does not wait for an erase.
+esp_err_t ajournal_compact(void)
+{
+    if (journal == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ajournal_reclaim_until(CONFIG_ANVS_JOURNAL_FREE_SECTORS);
+}
+
+// void ajournal_foreach(ajournal_entry_cb_t cb, void* arg)
+// Input:
+//  cb: function called with every key and its newest value
+//  arg: argument passed to cb
+// Output: none
+// Description: This function iterates the key table; it reads no flash.
+void ajournal_foreach(ajournal_entry_cb_t cb, void* arg)
+{
+    for (uint32_t i = 0; i < keys_count; i++) {
+        cb(keys[i].key, keys[i].value, arg);
+    }
+}
+
+void ajournal_get_stats(ajournal_stats_t* s)
+{
+    *s = stats;
+    s->sectors = sectors_count;
+    s->free_sectors = ajournal_free_count();
+    s->keys = keys_count;
+    s->seq = next_seq;
+}
+
+// end of ajournal.c
@@ -0,0 +1,63 @@
+// ajournal.h
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+// Append-only journal of u16 values in a dedicated data partition. Every write appends one record of
+// AJOURNAL_RECORD_SIZE bytes, with a sequence number, the key, the value and a CRC; nothing is rewritten in
+// place. The newest valid record of a key is its value, so a record torn by a reset is ignored and the
+// value before it is recovered. A sector is erased only when it is reclaimed: its records which are still
+// the newest of their key are copied to the head and the sector is erased, once per
+// AJOURNAL_RECORDS_PER_SECTOR writes. The reclaim is done by ajournal_compact(), in the background, and by
+// ajournal_set() only when the free sectors run out.
+//
+// The functions are not thread safe; anvs serializes them with its handle lock.
+
+#define AJOURNAL_PARTITION_LABEL    "journal"
+#define AJOURNAL_SECTOR_SIZE        (4096)
+#define AJOURNAL_RECORD_SIZE        (32)
+#define AJOURNAL_RECORDS_PER_SECTOR (AJOURNAL_SECTOR_SIZE / AJOURNAL_RECORD_SIZE)
+#define AJOURNAL_KEY_SIZE           (16)    // NVS_KEY_NAME_MAX_SIZE, with the terminating 0
+#define AJOURNAL_MIN_SECTORS        (3)     // head, a sector to reclaim and a free one
+#define AJOURNAL_MAX_SECTORS        (64)    // sectors beyond are not used
+
+typedef struct {
+    uint32_t appends;           // records written by ajournal_set()
+    uint32_t unchanged;         // ajournal_set() calls with the current value, not written
+    uint32_t relocations;       // live records copied by the reclaim
+    uint32_t compactions;       // sectors reclaimed
+    uint32_t foreground;        // sectors reclaimed by ajournal_set()
+    uint32_t erases;            // sector erases, including ajournal_format()
+    uint32_t bytes_written;
+    uint32_t torn_records;      // invalid records found by ajournal_mount()
+    uint32_t sectors;
+    uint32_t free_sectors;
+    uint32_t keys;
+    uint32_t seq;               // sequence number of the next record
+} ajournal_stats_t;
+
+typedef void (*ajournal_entry_cb_t)(const char* key, uint16_t value, void* arg);
+
+esp_err_t ajournal_mount(const char* label);
+esp_err_t ajournal_format(void);
+esp_err_t ajournal_get(const char* key, uint16_t* value);
+esp_err_t ajournal_set(const char* key, uint16_t value);
+bool ajournal_needs_compaction(void);
+esp_err_t ajournal_compact(void);
+void ajournal_foreach(ajournal_entry_cb_t cb, void* arg);
+void ajournal_get_stats(ajournal_stats_t* stats);
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of ajournal.h
@@ -4,11 +4,17 @@
 #include <stdio.h>
 #include <ctype.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "commondefs.h"
 
 #include "anvs.h"
+#if defined(CONFIG_ANVS_BACKEND_JOURNAL)
+#include "ajournal.h"
+#endif  // defined(CONFIG_ANVS_BACKEND_JOURNAL)
 
 static const char TAG[] = "ANVS";
 
@@ -16,20 +22,133 @@ static const char TAG[] = "ANVS";
 #define NVS_COMMITTED BIT1  // Set when commit is done
 #define NVS_EXIT      BIT2  // Set to exit the commit task
 #define NVS_CFAILED   BIT3  // Failed to commit
+#define NVS_DIRTY     BIT4  // Set when the cache has pending writes
+#define NVS_FLUSH     BIT5  // Set to request immediate write back of the cache
+#define NVS_FLUSHED   BIT6  // Set when the requested write back is done
 
 static EventGroupHandle_t nvs_event_group;
+
+#define ANVS_COMMIT_TASK_STACK_SIZE (4096)
+
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+static StaticEventGroup_t nvs_event_group_buffer;
+static StaticSemaphore_t anvs_handle_lock_buffer;
+static StackType_t nvs_commit_task_stack[ANVS_COMMIT_TASK_STACK_SIZE];
+static StaticTask_t nvs_commit_task_tcb;
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+
+// appstore is opened once and stays open. The calls of the backend are serialized by anvs_handle_lock,
+// so appstore can be used by the tasks on both cores. anvs_handle_lock is never held while waiting for
+// the commit task.
+#if defined(CONFIG_ANVS_BACKEND_NVS)
 static nvs_handle_t app_nvs_handle = 0;
+#endif  // defined(CONFIG_ANVS_BACKEND_NVS)
+static bool app_nvs_opened = false;
+static SemaphoreHandle_t anvs_handle_lock;
+
+static anvs_stats_t anvs_stats;
+static portMUX_TYPE anvs_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// RAM cache of the u16 values of appstore. It is filled on first access, so repeated reads do not touch flash.
+// A key that does not exist in appstore is cached too (found == false). With CONFIG_ANVS_WRITE_BEHIND the
+// dirty entries are the values waiting for the commit task; they are never evicted.
+typedef struct {
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint16_t value;
+    bool used;
+    bool found;
+    bool dirty;
+} anvs_cache_entry_t;
+
+static anvs_cache_entry_t anvs_cache[CONFIG_ANVS_CACHE_SLOTS];
+static size_t anvs_cache_victim = 0;
+
+#if defined(CONFIG_ANVS_WRITE_BEHIND)
+static esp_err_t anvs_flush_result = ESP_OK;
+
+// Blobs waiting for the commit task, and the last blob written of each key. A blob is written with one
+// backend operation and read from flash only at boot, so the blobs have no read cache.
+#define ANVS_BLOB_SLOTS     (2)
+
+typedef struct {
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t data[ANVS_BLOB_MAX_SIZE];
+    uint8_t size;
+    bool used;
+    bool dirty;
+} anvs_blob_entry_t;
+
+static anvs_blob_entry_t anvs_blobs[ANVS_BLOB_SLOTS];
+
+// Token bucket write governor. It is used by the commit task only.
+#define ANVS_COMMIT_PERIOD_US   (3600LL * 1000000LL / CONFIG_ANVS_COMMITS_PER_HOUR)
+
+static uint32_t governor_tokens = CONFIG_ANVS_COMMIT_BURST;
+static int64_t governor_refill_us = 0;
+
+static EventBits_t anvs_wait_urgent(TickType_t ticks);
+static int64_t anvs_governor_take(void);
+static bool anvs_cache_dirty(void);
+static void anvs_write_back(bool flush);
+static anvs_blob_entry_t* anvs_blob_find(const char* key);
+#endif  // defined(CONFIG_ANVS_WRITE_BEHIND)
 
 static const char app_storage_marker_key[] = APP_STORAGE_MARK;
 static const char app_operative_mode_key[] = "opmode";
 
 static void nvs_commit_task(void *pvParameter);
+static void anvs_commit_requested(void);
 static esp_err_t anvs_wait_commit(void);
+static esp_err_t anvs_open_appstore(void);
+static esp_err_t anvs_backend_open(void);
+static esp_err_t anvs_backend_get(const char* key, uint16_t* value);
+static esp_err_t anvs_backend_set(const char* key, uint16_t value);
+static esp_err_t anvs_backend_commit(void);
+static esp_err_t anvs_backend_get_blob(const char* key, void* data, size_t* size);
+static esp_err_t anvs_backend_set_blob(const char* key, const void* data, size_t size);
+static void anvs_backend_maintain(void);
+static anvs_cache_entry_t* anvs_cache_find(const char* key);
+static anvs_cache_entry_t* anvs_cache_slot(const char* key);
+static void anvs_cache_fill(const char* key, uint16_t value, bool found);
+static void anvs_cache_store(const char* key, uint16_t value);
+
+// esp_err_t anvs_prepare(void)
+// Input: none
+// Output: ESP_OK or ESP_ERR_NO_MEM
+// Description: This function creates the lock and the event group of the module, in static buffers with
+// CONFIG_APP_STATIC_ALLOCATION. It is called by anvs_initialize(); a boot which starts the machines before
+// NVS is initialized calls it first, so the values written meanwhile wait in the cache for the commit task.
+// It is not thread safe.
+esp_err_t anvs_prepare(void)
+{
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+    if (anvs_handle_lock == NULL) {
+        anvs_handle_lock = xSemaphoreCreateMutexStatic(&anvs_handle_lock_buffer);
+    }
+    if (nvs_event_group == NULL) {
+        nvs_event_group = xEventGroupCreateStatic(&nvs_event_group_buffer);
+    }
+#else
+    if (anvs_handle_lock == NULL) {
+        anvs_handle_lock = xSemaphoreCreateMutex();
+    }
+    if (nvs_event_group == NULL) {
+        nvs_event_group = xEventGroupCreate();
+    }
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+    return ((anvs_handle_lock != NULL) && (nvs_event_group != NULL)) ? ESP_OK : ESP_ERR_NO_MEM;
+}
 
 esp_err_t anvs_initialize(void)
 {
     esp_err_t ret;
 
+    // The lock and the event group are used by the accessors even when NVS cannot be initialized
+    ret = anvs_prepare();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
     /* Initialize NVS. */
     ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -39,8 +158,14 @@ esp_err_t anvs_initialize(void)
     ESP_ERROR_CHECK_WITHOUT_ABORT(ret);
 
     if (ret == ESP_OK) {
-        nvs_event_group = xEventGroupCreate();
-        xTaskCreatePinnedToCore(nvs_commit_task, "NVS_Commit", 4096, NULL, 5, NULL, 1);
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+        // Created once per boot: the buffers are not reused after anvs_stop_nvs_commit_task()
+        xTaskCreateStaticPinnedToCore(nvs_commit_task, "NVS_Commit", ANVS_COMMIT_TASK_STACK_SIZE, NULL, 5,
+                                      nvs_commit_task_stack, &nvs_commit_task_tcb, 1);
+#else
+        xTaskCreatePinnedToCore(nvs_commit_task, "NVS_Commit", ANVS_COMMIT_TASK_STACK_SIZE, NULL, 5, NULL, 1);
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+        ret = anvs_open_appstore();
     }
 
     return ret;
@@ -49,27 +174,139 @@ esp_err_t anvs_initialize(void)
 // static esp_err_t anvs_open_appstore(void)
 // Input: none
 // Output: none
-// Description: This function opens appstore and stores its handle in app_nvs_handle.
+// Description: This function opens appstore in the backend. appstore is kept open, so the function opens
+// it only the first time it is called successfully.
 static esp_err_t anvs_open_appstore(void)
 {
-    esp_err_t ret;
+    esp_err_t ret = ESP_OK;
 
-    ret = nvs_open(APP_STORAGE,NVS_READWRITE,&app_nvs_handle);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG,"Cannot open nvs handle: %s",esp_err_to_name(ret));
+    xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
+    if (!app_nvs_opened) {
+        ret = anvs_backend_open();
+        if (ret == ESP_OK) {
+            app_nvs_opened = true;
+        }
+        else {
+            ESP_LOGE(TAG,"Cannot open appstore: %s",esp_err_to_name(ret));
+        }
     }
+    xSemaphoreGive(anvs_handle_lock);
     return ret;
 }
 
+#if defined(CONFIG_ANVS_BACKEND_NVS)
+
+// appstore backend: the namespace APP_STORAGE of NVS. The functions are called with anvs_handle_lock taken,
+// but anvs_backend_maintain().
+
+#define ANVS_BACKEND_BLOBS  (true)
+
+static esp_err_t anvs_backend_open(void)
+{
+    return nvs_open(APP_STORAGE,NVS_READWRITE,&app_nvs_handle);
+}
+
+static esp_err_t anvs_backend_get(const char* key, uint16_t* value)
+{
+    return nvs_get_u16(app_nvs_handle,key,value);
+}
+
+static esp_err_t anvs_backend_set(const char* key, uint16_t value)
+{
+    return nvs_set_u16(app_nvs_handle,key,value);
+}
+
+static esp_err_t anvs_backend_commit(void)
+{
+    return nvs_commit(app_nvs_handle);
+}
+
+static esp_err_t anvs_backend_get_blob(const char* key, void* data, size_t* size)
+{
+    return nvs_get_blob(app_nvs_handle,key,data,size);
+}
+
+static esp_err_t anvs_backend_set_blob(const char* key, const void* data, size_t size)
+{
+    return nvs_set_blob(app_nvs_handle,key,data,size);
+}
+
+static void anvs_backend_maintain(void)
+{
+}
+
+#endif  // defined(CONFIG_ANVS_BACKEND_NVS)
+
+#if defined(CONFIG_ANVS_BACKEND_JOURNAL)
+
+// appstore backend: the journal partition, see ajournal.h. A record is durable when it is written, so there
+// is nothing to commit. The commit task reclaims the old sectors in anvs_backend_maintain(), so the writes
+// seldom wait for an erase.
+
+static esp_err_t anvs_backend_open(void)
+{
+    return ajournal_mount(AJOURNAL_PARTITION_LABEL);
+}
+
+static esp_err_t anvs_backend_get(const char* key, uint16_t* value)
+{
+    esp_err_t ret = ajournal_get(key,value);
+    return (ret == ESP_ERR_NOT_FOUND) ? ESP_ERR_NVS_NOT_FOUND : ret;
+}
+
+static esp_err_t anvs_backend_set(const char* key, uint16_t value)
+{
+    return ajournal_set(key,value);
+}
+
+static esp_err_t anvs_backend_commit(void)
+{
+    return ESP_OK;
+}
+
+// The records of the journal hold u16 values only: anvs_blob_get() and anvs_blob_set() fail before
+// reaching the backend, so no blob is ever cached for the commit task.
+#define ANVS_BACKEND_BLOBS  (false)
+
+static esp_err_t anvs_backend_get_blob(const char* key, void* data, size_t* size)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static esp_err_t anvs_backend_set_blob(const char* key, const void* data, size_t size)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static void anvs_backend_maintain(void)
+{
+    xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
+    if (app_nvs_opened && ajournal_needs_compaction()) {
+        esp_err_t ret = ajournal_compact();
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG,"Journal compaction failed: %s",esp_err_to_name(ret));
+        }
+    }
+    xSemaphoreGive(anvs_handle_lock);
+}
+
+#endif  // defined(CONFIG_ANVS_BACKEND_JOURNAL)
+
 // static void nvs_commit_task(void *pvParameter)
 // Input: none
 // Output: none
 // Description: This function is executed as a task by CORE1. It waits for commands (event bits)
 // NVS_CHANGED: to execute nvs_commit()
+// NVS_DIRTY: to write back the dirty entries of the cache
+// NVS_FLUSH: to write back the dirty entries of the cache immediately
 // NVS_EXIT: to exit.
+// After every command the backend is given time for its maintenance.
 // When nvs_commit is requested, it is executed and then NVS_COMMITTED is isgnaled. This allows the functions
 // that requested commit to know that it was executed successfully. If the commit is not successful, then
 // NVS_CFAILED is set.
+// When the cache becomes dirty, the task waits CONFIG_ANVS_COALESCE_WINDOW_MS so as the writes that follow
+// are merged in the same commit, and then takes a token from the write governor, unless the writes were
+// already written back by the previous write back. NVS_FLUSH and NVS_EXIT cut both waits short. Pending writes are written back before the task exits.
 
 static void nvs_commit_task(void *pvParameter)
 {
@@ -77,21 +314,31 @@ static void nvs_commit_task(void *pvParameter)
     ESP_LOGI(TAG, "nvs_commit_task entered");
     while (true) {
         // Wait for NVS_CHANGED flag
-        EventBits_t bits = xEventGroupWaitBits(nvs_event_group, NVS_CHANGED, pdTRUE, pdFALSE, portMAX_DELAY);
+        EventBits_t bits = xEventGroupWaitBits(nvs_event_group, NVS_CHANGED | NVS_DIRTY | NVS_FLUSH | NVS_EXIT, pdTRUE, pdFALSE, portMAX_DELAY);
         // If NVS_CHANGED is received, commit changes
         if (bits & NVS_CHANGED) {
-            // Commit changes to flash
-            if (nvs_commit(app_nvs_handle) == ESP_OK) {
-                ESP_LOGI(TAG,"NVS data committed successfully.");
-                // Signal that commit is done
-                xEventGroupSetBits(nvs_event_group, NVS_COMMITTED);
+            anvs_commit_requested();
+        }
+
+#if defined(CONFIG_ANVS_WRITE_BEHIND)
+        if (bits & (NVS_DIRTY | NVS_FLUSH | NVS_EXIT)) {
+            // coalescing window: writes arriving meanwhile only update the cache
+            if (!(bits & (NVS_FLUSH | NVS_EXIT))) {
+                bits |= anvs_wait_urgent(pdMS_TO_TICKS(CONFIG_ANVS_COALESCE_WINDOW_MS));
             }
-            else {
-                // Signal that commit failed
-                xEventGroupSetBits(nvs_event_group, NVS_CFAILED);
+            // write governor: wait for a token unless flush or exit is requested
+            int64_t wait_us;
+            while (!(bits & (NVS_FLUSH | NVS_EXIT)) && anvs_cache_dirty() && ((wait_us = anvs_governor_take()) > 0)) {
+                portENTER_CRITICAL(&anvs_mux);
+                anvs_stats.commits_throttled++;
+                portEXIT_CRITICAL(&anvs_mux);
+                bits |= anvs_wait_urgent(pdMS_TO_TICKS(wait_us / 1000) + 1);
             }
+            anvs_write_back((bits & (NVS_FLUSH | NVS_EXIT)) != 0);
         }
+#endif  // defined(CONFIG_ANVS_WRITE_BEHIND)
 
+        anvs_backend_maintain();
         if (bits & NVS_EXIT) {
             break;
         }
@@ -100,6 +347,287 @@ static void nvs_commit_task(void *pvParameter)
     vTaskDelete(NULL);
 }
 
+// static void anvs_commit_requested(void)
+// Input: none
+// Output: none
+// Description: This function commits app_nvs_handle on request of anvs_wait_commit() and signals
+// NVS_COMMITTED or NVS_CFAILED.
+static void anvs_commit_requested(void)
+{
+    // Commit changes to flash
+    xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
+    esp_err_t ret = anvs_backend_commit();
+    xSemaphoreGive(anvs_handle_lock);
+
+    if (ret == ESP_OK) {
+        ESP_LOGI(TAG,"NVS data committed successfully.");
+        portENTER_CRITICAL(&anvs_mux);
+        anvs_stats.commits++;
+        portEXIT_CRITICAL(&anvs_mux);
+        // Signal that commit is done
+        xEventGroupSetBits(nvs_event_group, NVS_COMMITTED);
+    }
+    else {
+        portENTER_CRITICAL(&anvs_mux);
+        anvs_stats.commit_failures++;
+        portEXIT_CRITICAL(&anvs_mux);
+        // Signal that commit failed
+        xEventGroupSetBits(nvs_event_group, NVS_CFAILED);
+    }
+}
+
+#if defined(CONFIG_ANVS_WRITE_BEHIND)
+
+// static EventBits_t anvs_wait_urgent(TickType_t ticks)
+// Input:
+//  ticks: maximal time to wait
+// Output: NVS_FLUSH and NVS_EXIT bits received, 0 on timeout
+// Description: This function is used by the commit task while it delays a write back. It returns early
+// when flush or exit is requested. Blocking commits requested meanwhile are executed at once, so
+// anvs_wait_commit() callers are never held by the coalescing window or the write governor.
+static EventBits_t anvs_wait_urgent(TickType_t ticks)
+{
+    TickType_t start = xTaskGetTickCount();
+    TickType_t elapsed;
+
+    while ((elapsed = xTaskGetTickCount() - start) < ticks) {
+        EventBits_t bits = xEventGroupWaitBits(nvs_event_group, NVS_CHANGED | NVS_FLUSH | NVS_EXIT, pdTRUE, pdFALSE, ticks - elapsed);
+        if (bits & NVS_CHANGED) {
+            anvs_commit_requested();
+        }
+        if (bits & (NVS_FLUSH | NVS_EXIT)) {
+            return bits & (NVS_FLUSH | NVS_EXIT);
+        }
+    }
+    return 0;
+}
+
+// static int64_t anvs_governor_take(void)
+// Input: none
+// Output: 0 if a token was taken, otherwise the time in microseconds until the next token is available
+// Description: This function implements a token bucket. The bucket holds up to CONFIG_ANVS_COMMIT_BURST tokens
+// and is refilled with CONFIG_ANVS_COMMITS_PER_HOUR tokens per hour. Each write back takes one token.
+static int64_t anvs_governor_take(void)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t earned = (now - governor_refill_us) / ANVS_COMMIT_PERIOD_US;
+
+    if (earned > 0) {
+        governor_refill_us += earned * ANVS_COMMIT_PERIOD_US;
+        governor_tokens = (governor_tokens + earned >= CONFIG_ANVS_COMMIT_BURST) ?
+            CONFIG_ANVS_COMMIT_BURST : governor_tokens + (uint32_t)earned;
+    }
+    if (governor_tokens == CONFIG_ANVS_COMMIT_BURST) {
+        // a full bucket does not accumulate time
+        governor_refill_us = now;
+    }
+    if (governor_tokens > 0) {
+        governor_tokens--;
+        return 0;
+    }
+    return ANVS_COMMIT_PERIOD_US - (now - governor_refill_us);
+}
+
+// static bool anvs_cache_dirty(void)
+// Input: none
+// Output: true if the cache or a blob has pending writes
+// Description: The commit task checks this before it takes a token of the write governor. NVS_DIRTY may be
+// set by a write already taken by the previous write back, and such a wakeup must not spend a token.
+static bool anvs_cache_dirty(void)
+{
+    bool dirty = false;
+
+    portENTER_CRITICAL(&anvs_mux);
+    for (size_t i = 0; (i < CONFIG_ANVS_CACHE_SLOTS) && !dirty; i++) {
+        dirty = anvs_cache[i].dirty;
+    }
+    for (size_t i = 0; (i < ANVS_BLOB_SLOTS) && !dirty; i++) {
+        dirty = anvs_blobs[i].dirty;
+    }
+    portEXIT_CRITICAL(&anvs_mux);
+    return dirty;
+}
+
+// static void anvs_write_back(bool flush)
+// Input:
+//  flush: true if a task waits in anvs_flush() for the result
+// Output: none
+// Description: This function writes the dirty entries of the cache and the dirty blobs in appstore and
+// commits them with one nvs_commit(). The entries are copied and marked clean before writing, so
+// anvs_u16_set() and anvs_blob_set() may continue to update them meanwhile. If writing fails, the entries
+// not updated meanwhile are marked dirty again. When flush is true, NVS_FLUSHED is signaled at the end.
+static void anvs_write_back(bool flush)
+{
+    anvs_cache_entry_t pending[CONFIG_ANVS_CACHE_SLOTS];
+    anvs_blob_entry_t blobs[ANVS_BLOB_SLOTS];
+    size_t count = 0;
+    size_t blobs_count = 0;
+    size_t bytes = 0;
+    esp_err_t ret = ESP_OK;
+
+    // writes made from now on set NVS_DIRTY again, the ones made during the waits are taken here
+    xEventGroupClearBits(nvs_event_group, NVS_DIRTY);
+    portENTER_CRITICAL(&anvs_mux);
+    for (size_t i = 0; i < CONFIG_ANVS_CACHE_SLOTS; i++) {
+        if (anvs_cache[i].dirty) {
+            pending[count++] = anvs_cache[i];
+            anvs_cache[i].dirty = false;
+        }
+    }
+    for (size_t i = 0; i < ANVS_BLOB_SLOTS; i++) {
+        if (anvs_blobs[i].dirty) {
+            blobs[blobs_count++] = anvs_blobs[i];
+            anvs_blobs[i].dirty = false;
+        }
+    }
+    portEXIT_CRITICAL(&anvs_mux);
+
+    if (count + blobs_count > 0) {
+        ret = anvs_open_appstore();
+        if (ret == ESP_OK) {
+            xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
+            for (size_t i = 0; (i < count) && (ret == ESP_OK); i++) {
+                ret = anvs_backend_set(pending[i].key,pending[i].value);
+                bytes += sizeof(uint16_t);
+            }
+            for (size_t i = 0; (i < blobs_count) && (ret == ESP_OK); i++) {
+                ret = anvs_backend_set_blob(blobs[i].key,blobs[i].data,blobs[i].size);
+                bytes += blobs[i].size;
+            }
+            if (ret == ESP_OK) {
+                ret = anvs_backend_commit();
+            }
+            xSemaphoreGive(anvs_handle_lock);
+        }
+
+        portENTER_CRITICAL(&anvs_mux);
+        if (ret == ESP_OK) {
+            anvs_stats.commits++;
+            anvs_stats.bytes_written += bytes;
+        }
+        else {
+            anvs_stats.commit_failures++;
+            for (size_t i = 0; i < count; i++) {
+                anvs_cache_entry_t* entry = anvs_cache_find(pending[i].key);
+                if ((entry != NULL) && !entry->dirty) {
+                    entry->dirty = true;
+                }
+            }
+            // a blob refused by the backend would fail again on every retry
+            for (size_t i = 0; (i < blobs_count) && (ret != ESP_ERR_NOT_SUPPORTED); i++) {
+                anvs_blob_entry_t* entry = anvs_blob_find(blobs[i].key);
+                if ((entry != NULL) && !entry->dirty) {
+                    entry->dirty = true;
+                }
+            }
+        }
+        portEXIT_CRITICAL(&anvs_mux);
+
+        if (ret == ESP_OK) {
+            ESP_LOGI(TAG,"NVS data committed successfully (%u keys).",(unsigned)(count + blobs_count));
+        }
+        else {
+            ESP_LOGE(TAG,"Write back failed: %s",esp_err_to_name(ret));
+            // try again later
+            xEventGroupSetBits(nvs_event_group, NVS_DIRTY);
+        }
+    }
+
+    if (flush) {
+        anvs_flush_result = ret;
+        xEventGroupSetBits(nvs_event_group, NVS_FLUSHED);
+    }
+}
+
+#endif  // defined(CONFIG_ANVS_WRITE_BEHIND)
+
+// static anvs_cache_entry_t* anvs_cache_find(const char* key)
+// Input:
+//  key: key of the value
+// Output: pointer to the cache entry of key or NULL
+// Description: This function looks up key in the cache. It must be called with anvs_mux taken.
+static anvs_cache_entry_t* anvs_cache_find(const char* key)
+{
+    for (size_t i = 0; i < CONFIG_ANVS_CACHE_SLOTS; i++) {
+        if (anvs_cache[i].used && (strncmp(anvs_cache[i].key,key,NVS_KEY_NAME_MAX_SIZE) == 0)) {
+            return &anvs_cache[i];
+        }
+    }
+    return NULL;
+}
+
+// static anvs_cache_entry_t* anvs_cache_slot(const char* key)
+// Input:
+//  key: key of the value
+// Output: pointer to the cache entry of key or NULL if the cache is full of dirty entries
+// Description: This function returns the entry of key. If key is not in the cache, a free entry is taken
+// or a clean one is evicted in round robin order. It must be called with anvs_mux taken.
+static anvs_cache_entry_t* anvs_cache_slot(const char* key)
+{
+    anvs_cache_entry_t* entry = anvs_cache_find(key);
+    if ((entry != NULL) || (strlen(key) >= NVS_KEY_NAME_MAX_SIZE)) {
+        return entry;
+    }
+
+    for (size_t i = 0; (i < CONFIG_ANVS_CACHE_SLOTS) && (entry == NULL); i++) {
+        if (!anvs_cache[i].used) {
+            entry = &anvs_cache[i];
+        }
+    }
+    for (size_t i = 0; (i < CONFIG_ANVS_CACHE_SLOTS) && (entry == NULL); i++) {
+        size_t victim = anvs_cache_victim;
+        anvs_cache_victim = (anvs_cache_victim + 1) % CONFIG_ANVS_CACHE_SLOTS;
+        if (!anvs_cache[victim].dirty) {
+            entry = &anvs_cache[victim];
+        }
+    }
+    if (entry != NULL) {
+        strcpy(entry->key,key);
+        entry->used = true;
+        entry->found = false;
+        entry->dirty = false;
+    }
+    return entry;
+}
+
+// static void anvs_cache_fill(const char* key, uint16_t value, bool found)
+// Input:
+//  key: key of the value
+//  value: value read from appstore
+//  found: false if key does not exist in appstore
+// Output: none
+// Description: This function caches the result of a flash read. If key was cached meanwhile, the cached
+// value is newer and it is kept.
+static void anvs_cache_fill(const char* key, uint16_t value, bool found)
+{
+    portENTER_CRITICAL(&anvs_mux);
+    if (anvs_cache_find(key) == NULL) {
+        anvs_cache_entry_t* entry = anvs_cache_slot(key);
+        if (entry != NULL) {
+            entry->value = value;
+            entry->found = found;
+        }
+    }
+    portEXIT_CRITICAL(&anvs_mux);
+}
+
+// static void anvs_cache_store(const char* key, uint16_t value)
+// Input:
+//  key: key of the value
+//  value: value written in appstore
+// Output: none
+// Description: This function caches a value written through to appstore.
+static void anvs_cache_store(const char* key, uint16_t value)
+{
+    portENTER_CRITICAL(&anvs_mux);
+    anvs_cache_entry_t* entry = anvs_cache_slot(key);
+    if (entry != NULL) {
+        entry->value = value;
+        entry->found = true;
+    }
+    portEXIT_CRITICAL(&anvs_mux);
+}
+
 static esp_err_t anvs_wait_commit(void)
 {
     xEventGroupSetBits(nvs_event_group, NVS_CHANGED);
@@ -127,15 +655,10 @@ esp_err_t anvs_check_appstore(void)
 {
     esp_err_t ret;
 
-    ret = anvs_open_appstore();
-    if (ret != ESP_OK) {
-        return ret;
-    }
-
     // read marker to see if there is app record.
     // The marker is simply an integer; it exists if a record has been written.
     uint16_t marker;
-    ret = nvs_get_u16(app_nvs_handle, APP_STORAGE_MARK, &marker);
+    ret = anvs_u16_get(app_storage_marker_key, &marker);
     switch (ret) {
     case ESP_OK:
         ESP_LOGI(TAG, "appstore exists");
@@ -146,7 +669,6 @@ esp_err_t anvs_check_appstore(void)
     default :
         ESP_LOGI(TAG, "error reading appstore");
     }
-    nvs_close(app_nvs_handle);
     return ret;
 }
 
@@ -165,26 +687,33 @@ esp_err_t anvs_init_appstore(void)
 
     ESP_LOGI(TAG, "Restoring appstore to factory values");
 
-    // marker
     uint16_t marker = 1;
-    nvs_set_u16(app_nvs_handle,app_storage_marker_key,marker);
+    uint16_t op_mode = OP_MODE_STANDBY;
 
+    xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
+    // marker
+    anvs_backend_set(app_storage_marker_key,marker);
     // operative mode
-    uint16_t op_mode = OP_MODE_STANDBY;
-    ret = nvs_set_u16(app_nvs_handle,app_operative_mode_key,op_mode);
+    ret = anvs_backend_set(app_operative_mode_key,op_mode);
+    xSemaphoreGive(anvs_handle_lock);
 
     ret = anvs_wait_commit();
 
-    nvs_close(app_nvs_handle);
+    if (ret == ESP_OK) {
+        anvs_cache_store(app_storage_marker_key,marker);
+        anvs_cache_store(app_operative_mode_key,op_mode);
+    }
 
     return ret;
 }
 
-// esp_err_t anvs_dump_appstore(void)
-// Input: none
+// static esp_err_t anvs_scan_appstore(bool dump)
+// Input:
+//  dump: true to log every entry
 // Output: ESP error code
-// Description: This function dump appstore
-esp_err_t anvs_dump_appstore(void)
+// Description: This function iterates appstore once. The u16 values found are put in the cache.
+#if defined(CONFIG_ANVS_BACKEND_NVS)
+static esp_err_t anvs_scan_appstore(bool dump)
 {
     size_t length;
     uint16_t value;
@@ -194,30 +723,97 @@ esp_err_t anvs_dump_appstore(void)
     if (ret != ESP_OK) {
         return ret;
     }
+    xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
     nvs_iterator_t it = NULL;
-    esp_err_t res = nvs_entry_find("nvs", APP_STORAGE, NVS_TYPE_ANY, &it);
+    esp_err_t res = nvs_entry_find_in_handle(app_nvs_handle, NVS_TYPE_ANY, &it);
     while(res == ESP_OK) {
         nvs_entry_info_t info;
         nvs_entry_info(it, &info); // Can omit error check if parameters are guaranteed to be non-NULL
 
         switch (info.type) {
         case NVS_TYPE_STR:
-            nvs_get_str(app_nvs_handle,info.key,NULL,&length);
-            nvs_get_str(app_nvs_handle,info.key,sdata,&length);
-            ESP_LOGI(TAG,"key '%s', type '%d', value '%s'", info.key, info.type,sdata);
+            if (dump) {
+                length = sizeof(sdata);
+                nvs_get_str(app_nvs_handle,info.key,sdata,&length);
+                ESP_LOGI(TAG,"key '%s', type '%d', value '%s'", info.key, info.type,sdata);
+            }
             break;
         case NVS_TYPE_U16:
-            nvs_get_u16(app_nvs_handle,info.key,&value);
-            ESP_LOGI(TAG,"key '%s', type '%d', value '%u'", info.key, info.type,value);
+            if (nvs_get_u16(app_nvs_handle,info.key,&value) == ESP_OK) {
+                anvs_cache_fill(info.key,value,true);
+            }
+            if (dump) {
+                ESP_LOGI(TAG,"key '%s', type '%d', value '%u'", info.key, info.type,value);
+            }
             break;
         default:
-            ESP_LOGI(TAG,"key '%s', type '%d'", info.key, info.type);
+            if (dump) {
+                ESP_LOGI(TAG,"key '%s', type '%d'", info.key, info.type);
+            }
             break;
         }
         res = nvs_entry_next(&it);
     }
     nvs_release_iterator(it);
-    nvs_close(app_nvs_handle);
+    xSemaphoreGive(anvs_handle_lock);
+    return ret;
+}
+#endif  // defined(CONFIG_ANVS_BACKEND_NVS)
+
+#if defined(CONFIG_ANVS_BACKEND_JOURNAL)
+static void anvs_scan_entry(const char* key, uint16_t value, void* arg)
+{
+    anvs_cache_fill(key,value,true);
+    if (*(const bool*)arg) {
+        ESP_LOGI(TAG,"key '%s', value '%u'", key, value);
+    }
+}
+
+static esp_err_t anvs_scan_appstore(bool dump)
+{
+    int ret = anvs_open_appstore();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
+    ajournal_foreach(anvs_scan_entry, &dump);
+    xSemaphoreGive(anvs_handle_lock);
+    return ret;
+}
+#endif  // defined(CONFIG_ANVS_BACKEND_JOURNAL)
+
+// esp_err_t anvs_dump_appstore(void)
+// Input: none
+// Output: ESP error code
+// Description: This function dump appstore. The u16 values found are put in the cache.
+esp_err_t anvs_dump_appstore(void)
+{
+    return anvs_scan_appstore(true);
+}
+
+// esp_err_t anvs_load_appstore(bool dump)
+// Input:
+//  dump: true to log the entries while they are read
+// Output: ESP error code
+// Description: This function replaces anvs_check_appstore(), anvs_init_appstore() and anvs_dump_appstore()
+// at boot. appstore is iterated once and the u16 values are put in the cache; the marker and the operative
+// mode are cached as missing if they were not found, so the reads that follow do not touch flash. If the
+// marker is missing, appstore is initialized with the factory values.
+esp_err_t anvs_load_appstore(bool dump)
+{
+    esp_err_t ret = anvs_scan_appstore(dump);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    anvs_cache_fill(app_storage_marker_key,0,false);
+    anvs_cache_fill(app_operative_mode_key,0,false);
+
+    uint16_t marker;
+    ret = anvs_u16_get(app_storage_marker_key,&marker);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "appstore does not exist");
+        ret = anvs_init_appstore();
+    }
     return ret;
 }
 
@@ -242,35 +838,269 @@ esp_err_t anvs_app_op_mode_set(uint16_t value)
 // Input:
 //  key: pointer to key in anvs
 //  value: pointer to a variable where the value read to be written
-// Description: Ths function opens appstore, reads the value with key 'key' and then closes anvs.
+// Output: ESP error code, ESP_ERR_NVS_NOT_FOUND if key does not exist
+// Description: This function returns the value with key 'key' from the cache. On a cache miss it reads
+//  appstore and caches the result, so the next calls for the same key do not touch flash.
 //  The function is a wrapper of nvs_get_u16() and is used for data with uint6_t type.
 esp_err_t anvs_u16_get(const char* key, uint16_t* value)
 {
+    portENTER_CRITICAL(&anvs_mux);
+    anvs_cache_entry_t* entry = anvs_cache_find(key);
+    if (entry != NULL) {
+        bool found = entry->found;
+        if (found) {
+            *value = entry->value;
+        }
+        anvs_stats.cache_hits++;
+        portEXIT_CRITICAL(&anvs_mux);
+        return found ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+    }
+    anvs_stats.cache_misses++;
+    portEXIT_CRITICAL(&anvs_mux);
+
     int ret = anvs_open_appstore();
     if (ret != ESP_OK) {
         return ret;
     }
-    ret = nvs_get_u16(app_nvs_handle,key,value);
-    nvs_close(app_nvs_handle);
+    xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
+    ret = anvs_backend_get(key,value);
+    xSemaphoreGive(anvs_handle_lock);
+
+    if ((ret == ESP_OK) || (ret == ESP_ERR_NVS_NOT_FOUND)) {
+        anvs_cache_fill(key,(ret == ESP_OK) ? *value : 0,ret == ESP_OK);
+    }
     return ret;
 }
 
+// static esp_err_t anvs_u16_write_through(const char* key, uint16_t value)
+// Input:
+//  key: key of the value to be written
+//  value: the value to be vriten
+// Output: ESP error code
+// Description: This function saves key:value in anvs and waits until the value is committed.
+static esp_err_t anvs_u16_write_through(const char* key, uint16_t value)
+{
+    int ret = anvs_open_appstore();
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
+    ret = anvs_backend_set(key,value);
+    xSemaphoreGive(anvs_handle_lock);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    anvs_cache_store(key,value);
+    portENTER_CRITICAL(&anvs_mux);
+    anvs_stats.bytes_written += sizeof(uint16_t);
+    portEXIT_CRITICAL(&anvs_mux);
+
+    return anvs_wait_commit();
+}
+
 // esp_err_t anvs_u16_set(const char* key, uint16_t value)
 // Input:
 //  key: key of the value to be written
 //  value: the value to be vriten
 // Output: ESP error code
-// Description: This function saves key:value in anvs.
+// Description: This function saves key:value in anvs. With CONFIG_ANVS_WRITE_BEHIND the value is stored in
+// the cache and the function returns at once; the commit task writes it to flash later.
+// Use anvs_flush() when the value must be in flash before continuing.
 esp_err_t anvs_u16_set(const char* key, uint16_t value)
 {
+#if defined(CONFIG_ANVS_WRITE_BEHIND)
+    bool merged = false;
+
+    portENTER_CRITICAL(&anvs_mux);
+    anvs_cache_entry_t* entry = anvs_cache_slot(key);
+    if (entry != NULL) {
+        merged = entry->dirty;
+        entry->value = value;
+        entry->found = true;
+        entry->dirty = true;
+        anvs_stats.writes++;
+        if (merged) {
+            anvs_stats.commits_avoided++;
+        }
+    }
+    portEXIT_CRITICAL(&anvs_mux);
+
+    if (entry != NULL) {
+        if (!merged) {
+            xEventGroupSetBits(nvs_event_group, NVS_DIRTY);
+        }
+        return ESP_OK;
+    }
+    ESP_LOGW(TAG,"Cache is full of pending writes, writing '%s' through",key);
+#else
+    portENTER_CRITICAL(&anvs_mux);
+    anvs_stats.writes++;
+    portEXIT_CRITICAL(&anvs_mux);
+#endif  // defined(CONFIG_ANVS_WRITE_BEHIND)
+
+    return anvs_u16_write_through(key,value);
+}
+
+#if defined(CONFIG_ANVS_WRITE_BEHIND)
+
+// static anvs_blob_entry_t* anvs_blob_find(const char* key)
+// Input:
+//  key: key of the blob
+// Output: pointer to the blob entry of key or NULL
+// Description: This function looks up key in the blob entries. It must be called with anvs_mux taken.
+static anvs_blob_entry_t* anvs_blob_find(const char* key)
+{
+    for (size_t i = 0; i < ANVS_BLOB_SLOTS; i++) {
+        if (anvs_blobs[i].used && (strncmp(anvs_blobs[i].key,key,NVS_KEY_NAME_MAX_SIZE) == 0)) {
+            return &anvs_blobs[i];
+        }
+    }
+    return NULL;
+}
+
+#endif  // defined(CONFIG_ANVS_WRITE_BEHIND)
+
+// esp_err_t anvs_blob_get(const char* key, void* data, size_t* size)
+// Input:
+//  key: key of the blob
+//  data: buffer where the blob to be written
+//  size: size of the buffer; the size of the blob is written back
+// Output: ESP error code, ESP_ERR_NVS_NOT_FOUND if key does not exist, ESP_ERR_NVS_INVALID_LENGTH if the
+// buffer is too small, ESP_ERR_NOT_SUPPORTED if the backend has no blobs
+// Description: This function reads a blob with one backend operation. A blob written since boot is
+// returned from RAM.
+esp_err_t anvs_blob_get(const char* key, void* data, size_t* size)
+{
+    if (!ANVS_BACKEND_BLOBS) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#if defined(CONFIG_ANVS_WRITE_BEHIND)
+    esp_err_t ret = ESP_ERR_NVS_NOT_FOUND;
+
+    portENTER_CRITICAL(&anvs_mux);
+    anvs_blob_entry_t* entry = anvs_blob_find(key);
+    if (entry != NULL) {
+        ret = (*size >= entry->size) ? ESP_OK : ESP_ERR_NVS_INVALID_LENGTH;
+        if (ret == ESP_OK) {
+            memcpy(data,entry->data,entry->size);
+        }
+        *size = entry->size;
+    }
+    portEXIT_CRITICAL(&anvs_mux);
+    if (entry != NULL) {
+        return ret;
+    }
+#endif  // defined(CONFIG_ANVS_WRITE_BEHIND)
+
+    int rc = anvs_open_appstore();
+    if (rc != ESP_OK) {
+        return rc;
+    }
+    xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
+    rc = anvs_backend_get_blob(key,data,size);
+    xSemaphoreGive(anvs_handle_lock);
+    return rc;
+}
+
+// esp_err_t anvs_blob_set(const char* key, const void* data, size_t size)
+// Input:
+//  key: key of the blob
+//  data: blob
+//  size: size of the blob
+// Output: ESP error code, ESP_ERR_NOT_SUPPORTED if the backend has no blobs
+// Description: This function saves a blob with one backend operation. With CONFIG_ANVS_WRITE_BEHIND a blob
+// of up to ANVS_BLOB_MAX_SIZE bytes is kept in RAM and written by the commit task together with the
+// pending values; a newer blob of the same key replaces the pending one. Otherwise the blob is written
+// and committed before the function returns. A backend without blobs fails at once, nothing is cached.
+esp_err_t anvs_blob_set(const char* key, const void* data, size_t size)
+{
+    if (!ANVS_BACKEND_BLOBS) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#if defined(CONFIG_ANVS_WRITE_BEHIND)
+    anvs_blob_entry_t* entry = NULL;
+    bool merged = false;
+
+    if ((size <= ANVS_BLOB_MAX_SIZE) && (strlen(key) < NVS_KEY_NAME_MAX_SIZE)) {
+        portENTER_CRITICAL(&anvs_mux);
+        entry = anvs_blob_find(key);
+        for (size_t i = 0; (i < ANVS_BLOB_SLOTS) && (entry == NULL); i++) {
+            if (!anvs_blobs[i].used || !anvs_blobs[i].dirty) {
+                entry = &anvs_blobs[i];
+                strcpy(entry->key,key);
+                entry->used = true;
+                entry->dirty = false;
+            }
+        }
+        if (entry != NULL) {
+            merged = entry->dirty;
+            memcpy(entry->data,data,size);
+            entry->size = (uint8_t)size;
+            entry->dirty = true;
+            anvs_stats.writes++;
+            if (merged) {
+                anvs_stats.commits_avoided++;
+            }
+        }
+        portEXIT_CRITICAL(&anvs_mux);
+    }
+    if (entry != NULL) {
+        if (!merged) {
+            xEventGroupSetBits(nvs_event_group, NVS_DIRTY);
+        }
+        return ESP_OK;
+    }
+#endif  // defined(CONFIG_ANVS_WRITE_BEHIND)
+
+    portENTER_CRITICAL(&anvs_mux);
+    anvs_stats.writes++;
+    portEXIT_CRITICAL(&anvs_mux);
+
     int ret = anvs_open_appstore();
     if (ret != ESP_OK) {
         return ret;
     }
-    ret = nvs_set_u16(app_nvs_handle,key,value);
+    xSemaphoreTake(anvs_handle_lock, portMAX_DELAY);
+    ret = anvs_backend_set_blob(key,data,size);
+    xSemaphoreGive(anvs_handle_lock);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    portENTER_CRITICAL(&anvs_mux);
+    anvs_stats.bytes_written += size;
+    portEXIT_CRITICAL(&anvs_mux);
 
-    ret = anvs_wait_commit();
+    return anvs_wait_commit();
+}
 
-    nvs_close(app_nvs_handle);
-    return ret;
+// esp_err_t anvs_flush(void)
+// Input: none
+// Output: ESP error code of the write back
+// Description: This function is a barrier: it returns after all values written before the call are
+// committed in flash. The coalescing window and the write governor are skipped. It must not be
+// called from the commit task. Without CONFIG_ANVS_WRITE_BEHIND every write is committed
+// synchronously, so the function returns ESP_OK at once.
+esp_err_t anvs_flush(void)
+{
+#if defined(CONFIG_ANVS_WRITE_BEHIND)
+    xEventGroupClearBits(nvs_event_group, NVS_FLUSHED);
+    xEventGroupSetBits(nvs_event_group, NVS_FLUSH);
+    xEventGroupWaitBits(nvs_event_group, NVS_FLUSHED, pdTRUE, pdFALSE, portMAX_DELAY);
+    return anvs_flush_result;
+#else
+    return ESP_OK;
+#endif  // defined(CONFIG_ANVS_WRITE_BEHIND)
+}
+
+// void anvs_get_stats(anvs_stats_t* stats)
+// Input:
+//  stats: pointer to a variable where the counters to be written
+// Output: none
+// Description: This function takes a consistent copy of the counters of the module.
+void anvs_get_stats(anvs_stats_t* stats)
+{
+    portENTER_CRITICAL(&anvs_mux);
+    *stats = anvs_stats;
+    portEXIT_CRITICAL(&anvs_mux);
 }
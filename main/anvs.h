@@ -8,6 +8,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <esp_err.h>
 
@@ -16,17 +17,38 @@ extern "C" {
 #define APP_STORAGE         "appstore"
 #define APP_STORAGE_MARK    "appmark"
 
+#define ANVS_BLOB_MAX_SIZE  (32)    // largest blob held in RAM by the write-behind cache
+
+// Counters of the application NVS layer. See anvs_get_stats().
+typedef struct {
+    uint32_t writes;            // anvs_u16_set() and anvs_blob_set() calls
+    uint32_t commits;           // nvs_commit() calls executed
+    uint32_t commits_avoided;   // writes merged into an already pending commit
+    uint32_t commits_throttled; // commits delayed by the write governor
+    uint32_t commit_failures;   // failed nvs_set_*() or nvs_commit() calls
+    uint32_t bytes_written;     // payload bytes passed to nvs_set_*()
+    uint32_t cache_hits;        // reads served from the RAM cache
+    uint32_t cache_misses;      // reads that went to flash
+} anvs_stats_t;
+
+esp_err_t anvs_prepare(void);
 esp_err_t anvs_initialize(void);
 void anvs_stop_nvs_commit_task(void);
 esp_err_t anvs_check_appstore(void);
 esp_err_t anvs_init_appstore(void);
 esp_err_t anvs_dump_appstore(void);
+esp_err_t anvs_load_appstore(bool dump);
 
 esp_err_t anvs_app_op_mode_get(uint16_t* value);
 esp_err_t anvs_app_op_mode_set(uint16_t value);
 
 esp_err_t anvs_u16_get(const char* key, uint16_t* value);
 esp_err_t anvs_u16_set(const char* key, uint16_t value);
+esp_err_t anvs_blob_get(const char* key, void* data, size_t* size);
+esp_err_t anvs_blob_set(const char* key, const void* data, size_t size);
+
+esp_err_t anvs_flush(void);
+void anvs_get_stats(anvs_stats_t* stats);
 
 esp_err_t read_opmode(void);
 
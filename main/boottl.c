@@ -0,0 +1,103 @@
+// boottl.c
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "boottl.h"
+
+static const char TAG[] = "BOOT";
+
+static const char* const boottl_names[BOOTTL_MILESTONES] = {
+#define BOOTTL_NAME(name, desc) [name] = desc,
+    BOOTTL_LIST(BOOTTL_NAME)
+#undef BOOTTL_NAME
+};
+
+// time_us == 0: not marked yet. The timer runs before app_main, so a mark is never 0.
+static boottl_entry_t boottl_entries[BOOTTL_MILESTONES];
+static portMUX_TYPE boottl_mux = portMUX_INITIALIZER_UNLOCKED;
+
+#if defined(CONFIG_BOOT_TIMELINE_LOG)
+_Static_assert(BOOTTL_FIRST_TRANSITION == BOOTTL_MILESTONES - 1, "the timeline is logged on the last milestone");
+#endif  // defined(CONFIG_BOOT_TIMELINE_LOG)
+
+// bool boottl_mark(boottl_milestone_t milestone)
+// Input:
+//  milestone: milestone reached
+// Output: true if this is the first mark of the milestone
+// Description: This function records the time a milestone is reached. Only the first mark is kept, so the
+// function may be called on a path which runs again later, e.g. by every instance of a machine. With
+// CONFIG_BOOT_TIMELINE_LOG the timeline is logged when the last milestone is reached.
+bool boottl_mark(boottl_milestone_t milestone)
+{
+    if ((unsigned)milestone >= BOOTTL_MILESTONES) {
+        return false;
+    }
+    int64_t now = esp_timer_get_time();
+    bool first = false;
+
+    portENTER_CRITICAL_SAFE(&boottl_mux);
+    if (boottl_entries[milestone].time_us == 0) {
+        boottl_entries[milestone].time_us = (now != 0) ? now : 1;
+        boottl_entries[milestone].core = (uint8_t)xPortGetCoreID();
+        first = true;
+    }
+    portEXIT_CRITICAL_SAFE(&boottl_mux);
+#if defined(CONFIG_BOOT_TIMELINE_LOG)
+    if (first && (milestone == BOOTTL_MILESTONES - 1)) {
+        boottl_log();
+    }
+#endif  // defined(CONFIG_BOOT_TIMELINE_LOG)
+    return first;
+}
+
+// esp_err_t boottl_get(boottl_milestone_t milestone, boottl_entry_t* entry)
+// Input:
+//  milestone: milestone
+//  entry: pointer to a variable where the time and the core of the milestone to be written
+// Output: ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_NOT_FOUND if the milestone is not reached yet
+// Description: This function returns one milestone of the timeline.
+esp_err_t boottl_get(boottl_milestone_t milestone, boottl_entry_t* entry)
+{
+    if (((unsigned)milestone >= BOOTTL_MILESTONES) || (entry == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL_SAFE(&boottl_mux);
+    *entry = boottl_entries[milestone];
+    portEXIT_CRITICAL_SAFE(&boottl_mux);
+    return (entry->time_us != 0) ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+const char* boottl_name(boottl_milestone_t milestone)
+{
+    return ((unsigned)milestone < BOOTTL_MILESTONES) ? boottl_names[milestone] : "?";
+}
+
+// void boottl_log(void)
+// Input: none
+// Output: none
+// Description: This function logs the milestones reached, with the time since reset and the time since
+// the previous milestone reached.
+void boottl_log(void)
+{
+    int64_t previous = 0;
+
+    for (int m = 0; m < BOOTTL_MILESTONES; m++) {
+        boottl_entry_t entry;
+        if (boottl_get((boottl_milestone_t)m, &entry) != ESP_OK) {
+            ESP_LOGI(TAG, "%-28s        -", boottl_names[m]);
+            continue;
+        }
+        ESP_LOGI(TAG, "%-28s %8lld us  +%lld us  core %u", boottl_names[m], (long long)entry.time_us,
+                 (long long)(entry.time_us - previous), entry.core);
+        previous = entry.time_us;
+    }
+}
+
+// end of boottl.c
@@ -0,0 +1,51 @@
+// boottl.h
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+// Boot timeline. The boot steps record milestones with boottl_mark(); a milestone keeps the time of its
+// first mark, in esp_timer_get_time() units (microseconds since the start of the timer, shortly after reset),
+// and the core that marked it. The timeline is kept in RAM and can be queried at any time after the boot.
+//
+// X(name, description)
+#define BOOTTL_LIST(X) \
+    X(BOOTTL_APP_MAIN,          "app_main entered") \
+    X(BOOTTL_NVS_READY,         "NVS initialized") \
+    X(BOOTTL_APPSTORE_LOADED,   "appstore loaded") \
+    X(BOOTTL_PERIPHERALS_READY, "button, LED and timers ready") \
+    X(BOOTTL_MACHINES_READY,    "state machines registered") \
+    X(BOOTTL_LOOP_STARTED,      "event loop started") \
+    X(BOOTTL_P1_STARTED,        "P1 started") \
+    X(BOOTTL_FIRST_TRANSITION,  "first transition or restore")
+
+typedef enum {
+#define BOOTTL_ENUM(name, desc) name,
+    BOOTTL_LIST(BOOTTL_ENUM)
+#undef BOOTTL_ENUM
+    BOOTTL_MILESTONES
+} boottl_milestone_t;
+
+typedef struct {
+    int64_t time_us;    // time of the first mark
+    uint8_t core;       // core which marked it
+} boottl_entry_t;
+
+bool boottl_mark(boottl_milestone_t milestone);
+esp_err_t boottl_get(boottl_milestone_t milestone, boottl_entry_t* entry);
+const char* boottl_name(boottl_milestone_t milestone);
+void boottl_log(void);
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of boottl.h
@@ -0,0 +1,511 @@
+// btnin.c
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/gpio.h"
+#if defined(CONFIG_PM_ENABLE)
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#endif  // defined(CONFIG_PM_ENABLE)
+
+#include "commondefs.h"
+#include "evloop.h"
+#include "btnin.h"
+
+static const char TAG[] = "BTNIN";
+
+#define BTNIN_DEBOUNCE_US       ((int64_t)CONFIG_BTNIN_DEBOUNCE_MS * 1000)
+#define BTNIN_DOUBLE_CLICK_US   ((int64_t)CONFIG_BTNIN_DOUBLE_CLICK_MS * 1000)
+#define BTNIN_LONG_PRESS_US     ((int64_t)CONFIG_BTNIN_LONG_PRESS_MS * 1000)
+#define BTNIN_REPEAT_US         ((int64_t)CONFIG_BTNIN_REPEAT_MS * 1000)
+
+#define BTNIN_BIT(ev)           (1u << (ev))
+#define BTNIN_HOLD_EVENTS       (BTNIN_BIT(BTNIN_LONG_PRESS) | BTNIN_BIT(BTNIN_REPEAT))
+
+_Static_assert(BTNIN_EVENT_MAX <= 8, "btnin_button_t.mapped has 8 bits");
+
+typedef struct {
+    int64_t edge_at;                // time of the last interrupt, written by the ISR while it is disabled
+    int64_t press_at;               // time of the last debounced press
+    int64_t due;                    // deadline of the classification, valid while the button is in timed
+    sm_event_type_t events[BTNIN_EVENT_MAX];
+    uint8_t mapped;                 // BTNIN_BIT() of the events with a row in the table
+    uint8_t clicks;                 // 1 while a first click waits for the end of the double click window
+    int8_t gpio;
+    uint8_t active_level;
+    bool pressed;                   // debounced state
+    bool long_sent;                 // BTNIN_LONG_PRESS classified for the current press
+} btnin_button_t;
+
+// Written by btnin_init() and the scan callback only, except edge_at
+static btnin_button_t buttons[CONFIG_BTNIN_MAX_BUTTONS];
+static uint32_t buttons_count = 0;
+static uint32_t timed = 0;          // buttons with a deadline of the classification
+
+// The ISRs and the scan callback share the pending mask and the arming of the timer
+static portMUX_TYPE btnin_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t pending = 0;        // buttons interrupted and not yet debounced
+static esp_timer_handle_t scan_timer = NULL;
+static bool armed = false;
+static int64_t armed_at = 0;
+
+static _Atomic uint32_t wakeups = 0;
+static _Atomic uint32_t glitches = 0;
+static _Atomic uint32_t counts[BTNIN_EVENT_MAX];
+static _Atomic uint32_t posted = 0;
+static int64_t stats_since = 0;
+
+#if defined(CONFIG_PM_ENABLE)
+static esp_pm_lock_handle_t pm_lock = NULL;
+#endif  // defined(CONFIG_PM_ENABLE)
+
+// static void btnin_arm(int64_t due)
+// Input:
+//  due: esp_timer_get_time() of the deadline
+// Output: none
+// Description: This function arms the scan timer for due, unless it is armed for that time or an earlier
+// one already, as twheel_arm() does. Called with btnin_mux held.
+static void btnin_arm(int64_t due)
+{
+    if (armed && (armed_at <= due)) {
+        return;
+    }
+    int64_t timeout = due - esp_timer_get_time();
+    if (timeout < 0) {
+        timeout = 0;
+    }
+    if (esp_timer_restart(scan_timer, timeout) != ESP_OK) {
+        esp_timer_start_once(scan_timer, timeout);
+    }
+    armed = true;
+    armed_at = due;
+}
+
+// static esp_err_t btnin_arm_gpio(btnin_button_t* b)
+// Input:
+//  b: button
+// Output: ESP error code of the GPIO driver
+// Description: This function arms the level interrupt of the button for the level it is not in. With
+// CONFIG_PM_ENABLE the same level wakes the chip from light sleep.
+static esp_err_t btnin_arm_gpio(btnin_button_t* b)
+{
+    int level = b->pressed ? !b->active_level : b->active_level;
+    gpio_int_type_t type = level ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL;
+    esp_err_t ret;
+
+#if defined(CONFIG_PM_ENABLE)
+    ret = gpio_wakeup_enable(b->gpio, type);    // sets the interrupt type too
+#else
+    ret = gpio_set_intr_type(b->gpio, type);
+#endif  // defined(CONFIG_PM_ENABLE)
+    if (ret == ESP_OK) {
+        ret = gpio_intr_enable(b->gpio);
+    }
+    return ret;
+}
+
+// static void btnin_isr(void* arg)
+// Input:
+//  arg: button
+// Output: none
+// Description: GPIO interrupt handler. It disables the interrupt, so the bounces which follow cost
+// nothing, keeps the chip awake, marks the button and arms the scan timer for the end of the debounce.
+static void btnin_isr(void* arg)
+{
+    btnin_button_t* b = (btnin_button_t*)arg;
+    int64_t now = esp_timer_get_time();
+
+    gpio_intr_disable(b->gpio);
+#if defined(CONFIG_PM_ENABLE)
+    esp_pm_lock_acquire(pm_lock);
+#endif  // defined(CONFIG_PM_ENABLE)
+    atomic_fetch_add_explicit(&wakeups, 1, memory_order_relaxed);
+    b->edge_at = now;
+    portENTER_CRITICAL_SAFE(&btnin_mux);
+    pending |= 1u << (b - buttons);
+    btnin_arm(now + BTNIN_DEBOUNCE_US);
+    portEXIT_CRITICAL_SAFE(&btnin_mux);
+}
+
+// static void btnin_emit(btnin_button_t* b, btnin_event_t event)
+// Input:
+//  b: button
+//  event: classified event
+// Output: none
+// Description: This function counts the event and posts its FSM event if the table has a row for it.
+static void btnin_emit(btnin_button_t* b, btnin_event_t event)
+{
+    atomic_fetch_add_explicit(&counts[event], 1, memory_order_relaxed);
+    if ((b->mapped & BTNIN_BIT(event)) == 0) {
+        return;
+    }
+    esp_err_t ret = evloop_post(b->events[event]);
+    if (ret == ESP_OK) {
+        atomic_fetch_add_explicit(&posted, 1, memory_order_relaxed);
+    }
+    else {
+        ESP_LOGW(TAG, "Event of GPIO %d not posted: %s", b->gpio, esp_err_to_name(ret));
+    }
+}
+
+// static void btnin_set_due(btnin_button_t* b, int64_t due)
+// Description: Deadline of the classification of the button, see btnin_expire().
+static void btnin_set_due(btnin_button_t* b, int64_t due)
+{
+    b->due = due;
+    timed |= 1u << (b - buttons);
+}
+
+static void btnin_clear_due(btnin_button_t* b)
+{
+    timed &= ~(1u << (b - buttons));
+}
+
+// static void btnin_long(btnin_button_t* b)
+// Description: Long press. A first click waiting for a second one is a single click.
+static void btnin_long(btnin_button_t* b)
+{
+    if (b->clicks > 0) {
+        b->clicks = 0;
+        btnin_emit(b, BTNIN_SINGLE_CLICK);
+    }
+    b->long_sent = true;
+    btnin_emit(b, BTNIN_LONG_PRESS);
+}
+
+// static void btnin_press(btnin_button_t* b)
+// Description: Debounced press. The long press deadline is set only if the table has a row for the long
+// press or the repeat; it replaces the double click window, which the release closes.
+static void btnin_press(btnin_button_t* b)
+{
+    b->pressed = true;
+    b->press_at = b->edge_at;
+    b->long_sent = false;
+    btnin_emit(b, BTNIN_PRESS_DOWN);
+    if ((b->mapped & BTNIN_HOLD_EVENTS) != 0) {
+        btnin_set_due(b, b->press_at + BTNIN_LONG_PRESS_US);
+    }
+    else {
+        btnin_clear_due(b);
+    }
+}
+
+// static void btnin_release(btnin_button_t* b)
+// Description: Debounced release. A short press is a click: the second one of a double click, a single
+// click at once without a BTNIN_DOUBLE_CLICK row, otherwise a first click waiting for the window to end.
+static void btnin_release(btnin_button_t* b)
+{
+    b->pressed = false;
+    btnin_clear_due(b);
+    btnin_emit(b, BTNIN_PRESS_UP);
+    if (b->long_sent) {
+        return;
+    }
+    if (b->edge_at - b->press_at >= BTNIN_LONG_PRESS_US) {
+        btnin_long(b);
+    }
+    else if (b->clicks > 0) {
+        b->clicks = 0;
+        btnin_emit(b, BTNIN_DOUBLE_CLICK);
+    }
+    else if ((b->mapped & BTNIN_BIT(BTNIN_DOUBLE_CLICK)) != 0) {
+        b->clicks = 1;
+        btnin_set_due(b, b->edge_at + BTNIN_DOUBLE_CLICK_US);
+    }
+    else {
+        btnin_emit(b, BTNIN_SINGLE_CLICK);
+    }
+}
+
+// static void btnin_expire(btnin_button_t* b)
+// Description: Deadline of the classification: long press or repeat while held, end of the double click
+// window when released.
+static void btnin_expire(btnin_button_t* b)
+{
+    btnin_clear_due(b);
+    if (b->pressed) {
+        if (!b->long_sent) {
+            btnin_long(b);
+        }
+        else {
+            btnin_emit(b, BTNIN_REPEAT);
+        }
+        if ((b->mapped & BTNIN_BIT(BTNIN_REPEAT)) != 0) {
+            btnin_set_due(b, b->due + BTNIN_REPEAT_US);
+        }
+    }
+    else if (b->clicks > 0) {
+        b->clicks = 0;
+        btnin_emit(b, BTNIN_SINGLE_CLICK);
+    }
+}
+
+// static void btnin_settle(btnin_button_t* b)
+// Description: End of the debounce: the level read is the new state of the button, unless it equals the
+// previous one, a glitch. The interrupt is armed again and the lock taken by the ISR is released.
+static void btnin_settle(btnin_button_t* b)
+{
+    bool pressed = (gpio_get_level(b->gpio) == b->active_level);
+
+    if (pressed == b->pressed) {
+        atomic_fetch_add_explicit(&glitches, 1, memory_order_relaxed);
+    }
+    else if (pressed) {
+        btnin_press(b);
+    }
+    else {
+        btnin_release(b);
+    }
+
+    esp_err_t ret = btnin_arm_gpio(b);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Cannot arm the interrupt of GPIO %d: %s", b->gpio, esp_err_to_name(ret));
+    }
+#if defined(CONFIG_PM_ENABLE)
+    esp_pm_lock_release(pm_lock);
+#endif  // defined(CONFIG_PM_ENABLE)
+}
+
+// static void btnin_scan_cb(void* arg)
+// Input: none
+// Output: none
+// Description: Callback of the scan timer, with ESP_TIMER_TASK dispatch because it reconfigures the GPIOs.
+// It settles the buttons whose debounce is over and expires the deadlines reached, then arms the timer
+// for the next deadline. Only the buttons of the pending and timed masks are visited, so the cost of a
+// wakeup does not grow with the number of idle buttons.
+static void btnin_scan_cb(void* arg)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t next = INT64_MAX;
+    uint32_t settle = 0;
+
+    atomic_fetch_add_explicit(&wakeups, 1, memory_order_relaxed);
+    portENTER_CRITICAL_SAFE(&btnin_mux);
+    armed = false;
+    for (uint32_t m = pending; m != 0; m &= m - 1) {
+        btnin_button_t* b = &buttons[__builtin_ctz(m)];
+        if (now - b->edge_at >= BTNIN_DEBOUNCE_US) {
+            settle |= m & -m;
+        }
+    }
+    pending &= ~settle;
+    portEXIT_CRITICAL_SAFE(&btnin_mux);
+
+    for (uint32_t m = settle; m != 0; m &= m - 1) {
+        btnin_settle(&buttons[__builtin_ctz(m)]);
+    }
+    for (uint32_t m = timed; m != 0; m &= m - 1) {
+        btnin_button_t* b = &buttons[__builtin_ctz(m)];
+        if (b->due <= now) {
+            btnin_expire(b);
+        }
+    }
+    for (uint32_t m = timed; m != 0; m &= m - 1) {
+        int64_t due = buttons[__builtin_ctz(m)].due;
+        if (due < next) {
+            next = due;
+        }
+    }
+
+    portENTER_CRITICAL_SAFE(&btnin_mux);
+    for (uint32_t m = pending; m != 0; m &= m - 1) {
+        int64_t due = buttons[__builtin_ctz(m)].edge_at + BTNIN_DEBOUNCE_US;
+        if (due < next) {
+            next = due;
+        }
+    }
+    if (next != INT64_MAX) {
+        btnin_arm(next);
+    }
+    portEXIT_CRITICAL_SAFE(&btnin_mux);
+}
+
+// static esp_err_t btnin_add_row(const btnin_map_t* row)
+// Input:
+//  row: row of the table
+// Output: ESP_OK, ESP_ERR_INVALID_ARG or ESP_ERR_NO_MEM if the table has more than CONFIG_BTNIN_MAX_BUTTONS
+// GPIOs
+// Description: This function adds the event of the row to its button, and the button if it is new.
+static esp_err_t btnin_add_row(const btnin_map_t* row)
+{
+    btnin_button_t* b = NULL;
+
+    if ((row->gpio < 0) || (row->active_level > 1) || (row->event >= BTNIN_EVENT_MAX)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (uint32_t i = 0; i < buttons_count; i++) {
+        if (buttons[i].gpio == row->gpio) {
+            b = &buttons[i];
+            break;
+        }
+    }
+    if (b == NULL) {
+        if (buttons_count >= CONFIG_BTNIN_MAX_BUTTONS) {
+            return ESP_ERR_NO_MEM;
+        }
+        b = &buttons[buttons_count++];
+        b->gpio = row->gpio;
+        b->active_level = row->active_level;
+    }
+    else if (b->active_level != row->active_level) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    b->events[row->event] = row->fsm_event;
+    b->mapped |= BTNIN_BIT(row->event);
+    return ESP_OK;
+}
+
+// esp_err_t btnin_init(const btnin_map_t* map, size_t count)
+// Input:
+//  map: table of (GPIO, button event) -> FSM event; it is copied
+//  count: rows of map
+// Output: ESP_OK, ESP_ERR_INVALID_STATE if the buttons are initialized already, an error of btnin_add_row()
+// or an ESP error code of the drivers
+// Description: This function configures the GPIOs of the table, with the pull resistor opposite to the
+// active level, creates the scan timer and arms the interrupts. The GPIO ISR service is installed unless
+// it is already. The counters of btnin_get_stats() are reset.
+esp_err_t btnin_init(const btnin_map_t* map, size_t count)
+{
+    esp_err_t ret;
+
+    if (scan_timer != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    memset(buttons, 0, sizeof(buttons));
+    buttons_count = 0;
+    timed = 0;
+    pending = 0;
+    armed = false;
+    for (size_t i = 0; i < count; i++) {
+        if ((ret = btnin_add_row(&map[i])) != ESP_OK) {
+            ESP_LOGE(TAG, "Invalid row %u of the button table: %s", (unsigned)i, esp_err_to_name(ret));
+            buttons_count = 0;
+            return ret;
+        }
+    }
+
+    ret = gpio_install_isr_service(0);
+    if ((ret != ESP_OK) && (ret != ESP_ERR_INVALID_STATE)) {
+        return ret;
+    }
+#if defined(CONFIG_PM_ENABLE)
+    if ((pm_lock == NULL) && ((ret = esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "btnin", &pm_lock)) != ESP_OK)) {
+        return ret;
+    }
+    if ((ret = esp_sleep_enable_gpio_wakeup()) != ESP_OK) {
+        return ret;
+    }
+#endif  // defined(CONFIG_PM_ENABLE)
+
+    esp_timer_create_args_t tca = {
+        .callback = btnin_scan_cb,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "btnin",
+        .skip_unhandled_events = true,
+    };
+    if ((ret = esp_timer_create(&tca, &scan_timer)) != ESP_OK) {
+        return ret;
+    }
+
+    atomic_store_explicit(&wakeups, 0, memory_order_relaxed);
+    atomic_store_explicit(&glitches, 0, memory_order_relaxed);
+    atomic_store_explicit(&posted, 0, memory_order_relaxed);
+    for (int i = 0; i < BTNIN_EVENT_MAX; i++) {
+        atomic_store_explicit(&counts[i], 0, memory_order_relaxed);
+    }
+    stats_since = esp_timer_get_time();
+
+    for (uint32_t i = 0; i < buttons_count; i++) {
+        btnin_button_t* b = &buttons[i];
+        gpio_reset_pin(b->gpio);
+        gpio_set_direction(b->gpio, GPIO_MODE_INPUT);
+        gpio_set_pull_mode(b->gpio, b->active_level ? GPIO_PULLDOWN_ONLY : GPIO_PULLUP_ONLY);
+        b->pressed = (gpio_get_level(b->gpio) == b->active_level);
+        if (((ret = gpio_isr_handler_add(b->gpio, btnin_isr, b)) != ESP_OK) || ((ret = btnin_arm_gpio(b)) != ESP_OK)) {
+            ESP_LOGE(TAG, "Cannot set up the interrupt of GPIO %d: %s", b->gpio, esp_err_to_name(ret));
+            btnin_deinit();
+            return ret;
+        }
+    }
+    ESP_LOGI(TAG, "%" PRIu32 " buttons, %u table rows, debounce %d ms", buttons_count, (unsigned)count,
+             CONFIG_BTNIN_DEBOUNCE_MS);
+    return ESP_OK;
+}
+
+// void btnin_deinit(void)
+// Input: none
+// Output: none
+// Description: This function removes the interrupt handlers and deletes the scan timer, so btnin_init()
+// can be called with another table. Clicks in progress are lost. It must not race with the scan callback.
+void btnin_deinit(void)
+{
+    for (uint32_t i = 0; i < buttons_count; i++) {
+        gpio_intr_disable(buttons[i].gpio);
+        gpio_isr_handler_remove(buttons[i].gpio);
+#if defined(CONFIG_PM_ENABLE)
+        gpio_wakeup_disable(buttons[i].gpio);
+#endif  // defined(CONFIG_PM_ENABLE)
+    }
+    if (scan_timer != NULL) {
+        esp_timer_stop(scan_timer);
+        esp_timer_delete(scan_timer);
+        scan_timer = NULL;
+    }
+
+    portENTER_CRITICAL_SAFE(&btnin_mux);
+    uint32_t locks = pending;
+    pending = 0;
+    armed = false;
+    portEXIT_CRITICAL_SAFE(&btnin_mux);
+#if defined(CONFIG_PM_ENABLE)
+    for (; locks != 0; locks &= locks - 1) {
+        esp_pm_lock_release(pm_lock);
+    }
+#else
+    (void)locks;
+#endif  // defined(CONFIG_PM_ENABLE)
+    timed = 0;
+    buttons_count = 0;
+}
+
+// void btnin_get_stats(btnin_stats_t* stats, bool reset)
+// Input:
+//  stats: pointer to a variable where the counters to be written
+//  reset: true to restart the counters after reading them
+// Output: none
+// Description: This function returns the counters since btnin_init() or the last reset. The wakeups per
+// second of the buttons are stats->wakeups divided by the time since stats->since_us.
+void btnin_get_stats(btnin_stats_t* stats, bool reset)
+{
+    if (reset) {
+        stats->wakeups = atomic_exchange_explicit(&wakeups, 0, memory_order_relaxed);
+        stats->glitches = atomic_exchange_explicit(&glitches, 0, memory_order_relaxed);
+        stats->posted = atomic_exchange_explicit(&posted, 0, memory_order_relaxed);
+        for (int i = 0; i < BTNIN_EVENT_MAX; i++) {
+            stats->events[i] = atomic_exchange_explicit(&counts[i], 0, memory_order_relaxed);
+        }
+        stats->since_us = stats_since;
+        stats_since = esp_timer_get_time();
+    }
+    else {
+        stats->wakeups = atomic_load_explicit(&wakeups, memory_order_relaxed);
+        stats->glitches = atomic_load_explicit(&glitches, memory_order_relaxed);
+        stats->posted = atomic_load_explicit(&posted, memory_order_relaxed);
+        for (int i = 0; i < BTNIN_EVENT_MAX; i++) {
+            stats->events[i] = atomic_load_explicit(&counts[i], memory_order_relaxed);
+        }
+        stats->since_us = stats_since;
+    }
+}
+
+// end of btnin.c
@@ -0,0 +1,67 @@
+// btnin.h
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+#include "events.h"
+
+// Interrupt driven button input. The GPIO interrupt of a button is a level interrupt armed for the level
+// the button is not in, so nothing runs while the button rests or is held. An interrupt disables itself and
+// marks its button; one esp_timer, shared by all buttons as the timer wheel shares its one, is armed for the
+// earliest deadline: the end of a debounce, a long press, a repeat or the double click window. Its callback
+// visits only the buttons marked or with a deadline, reads the settled levels, classifies the clicks and
+// posts the FSM events. A click costs four wakeups, bounces included, and one more at the end of the double
+// click window if the button has one.
+// Level interrupts are also the GPIO wakeup sources of light sleep: with CONFIG_PM_ENABLE the buttons wake
+// the chip and an ESP_PM_NO_LIGHT_SLEEP lock is held only between an interrupt and the end of its debounce.
+// On the linux target the GPIO and its interrupt are the mock of host_bench/main/stubs.
+//
+// The buttons and their events are given by a const table of btnin_map_t, one row per (GPIO, button event)
+// pair; the rows of one GPIO make one button, up to CONFIG_BTNIN_MAX_BUTTONS. A button event without a row
+// is classified but not posted, with one exception: without a BTNIN_DOUBLE_CLICK row a click is a single
+// click at once, with one the single click waits for the end of the double click window.
+
+typedef enum {
+    BTNIN_PRESS_DOWN = 0,   // debounced press
+    BTNIN_PRESS_UP,         // debounced release
+    BTNIN_SINGLE_CLICK,     // release before CONFIG_BTNIN_LONG_PRESS_MS, not followed by a second click
+    BTNIN_DOUBLE_CLICK,     // second click within CONFIG_BTNIN_DOUBLE_CLICK_MS of the first release
+    BTNIN_LONG_PRESS,       // held for CONFIG_BTNIN_LONG_PRESS_MS
+    BTNIN_REPEAT,           // every CONFIG_BTNIN_REPEAT_MS while held after BTNIN_LONG_PRESS
+    BTNIN_EVENT_MAX,
+} btnin_event_t;
+
+typedef struct {
+    int8_t gpio;
+    uint8_t active_level;   // level of the pressed button, 0 or 1
+    uint8_t event;          // btnin_event_t
+    sm_event_type_t fsm_event;
+} btnin_map_t;
+
+typedef struct {
+    uint32_t wakeups;               // interrupts plus timer callbacks, i.e. times the CPU worked for the buttons
+    uint32_t glitches;              // interrupts after which the level was back at the end of the debounce
+    uint32_t events[BTNIN_EVENT_MAX];   // classified, posted or not
+    uint32_t posted;                // FSM events posted
+    int64_t since_us;               // esp_timer_get_time() of btnin_init() or of the last reset of the counters
+} btnin_stats_t;
+
+esp_err_t btnin_init(const btnin_map_t* map, size_t count);
+void btnin_deinit(void);
+void btnin_get_stats(btnin_stats_t* stats, bool reset);
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of btnin.h
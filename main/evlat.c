@@ -0,0 +1,143 @@
+// evlat.c
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "commondefs.h"
+#include "evlat.h"
+
+static const char TAG[] = "EVLAT";
+
+evlat_histogram_t evlat_histograms[CONFIG_EVLOOP_LOOPS][sm_EVENTS_NUMBER][EVLAT_STAGES];
+
+static const char* const evlat_event_names[] = {
+    #define X(name, ...) #name,
+    EVENT_LIST
+    #undef X
+};
+
+static const char* const evlat_stage_names[EVLAT_STAGES] = { "wait", "dispatch", "action" };
+
+#if (CONFIG_EVLOOP_LATENCY_SUMMARY_PERIOD_MS > 0)
+static esp_timer_handle_t summary_timer = NULL;
+
+static void evlat_summary_cb(void* arg)
+{
+    evlat_log_summary();
+}
+#endif  // (CONFIG_EVLOOP_LATENCY_SUMMARY_PERIOD_MS > 0)
+
+// esp_err_t evlat_init(void)
+// Input: none
+// Output: ESP error code of esp_timer_create()
+// Description: This function starts the periodic summary, if CONFIG_EVLOOP_LATENCY_SUMMARY_PERIOD_MS is not 0.
+esp_err_t evlat_init(void)
+{
+#if (CONFIG_EVLOOP_LATENCY_SUMMARY_PERIOD_MS > 0)
+    if (summary_timer == NULL) {
+        esp_timer_create_args_t tca = {
+            .callback = evlat_summary_cb,
+            .arg = NULL,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "evlat_summary"
+        };
+        esp_err_t ret = esp_timer_create(&tca, &summary_timer);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+        return esp_timer_start_periodic(summary_timer, (uint64_t)CONFIG_EVLOOP_LATENCY_SUMMARY_PERIOD_MS * 1000);
+    }
+#endif  // (CONFIG_EVLOOP_LATENCY_SUMMARY_PERIOD_MS > 0)
+    return ESP_OK;
+}
+
+// esp_err_t evlat_get(sm_event_type_t event, evlat_stage_t stage, evlat_histogram_t* histogram)
+// Input:
+//  event: event type
+//  stage: EVLAT_WAIT, EVLAT_DISPATCH or EVLAT_ACTION
+//  histogram: pointer to a variable where the histogram to be copied
+// Output: ESP_OK or ESP_ERR_INVALID_ARG
+// Description: This function returns one histogram, the sum of the histograms of all event loops. The
+// copy is not synchronized with the loop tasks, so an event recorded during the copy may be counted in
+// some fields only.
+esp_err_t evlat_get(sm_event_type_t event, evlat_stage_t stage, evlat_histogram_t* histogram)
+{
+    if (((unsigned)event >= sm_EVENTS_NUMBER) || ((unsigned)stage >= EVLAT_STAGES) || (histogram == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *histogram = evlat_histograms[0][event][stage];
+    for (size_t l = 1; l < CONFIG_EVLOOP_LOOPS; l++) {
+        const evlat_histogram_t* h = &evlat_histograms[l][event][stage];
+        histogram->count += h->count;
+        histogram->sum_us += h->sum_us;
+        if (h->max_us > histogram->max_us) {
+            histogram->max_us = h->max_us;
+        }
+        for (size_t b = 0; b < EVLAT_BUCKETS; b++) {
+            histogram->buckets[b] += h->buckets[b];
+        }
+    }
+    return ESP_OK;
+}
+
+// void evlat_reset(void)
+// Input: none
+// Output: none
+// Description: This function clears all histograms.
+void evlat_reset(void)
+{
+    memset(evlat_histograms, 0, sizeof(evlat_histograms));
+}
+
+// uint32_t evlat_percentile(const evlat_histogram_t* histogram, uint32_t per_mille)
+// Input:
+//  histogram: histogram
+//  per_mille: 500 for the median, 990 for p99, 999 for p99.9
+// Output: upper bound of the bucket which contains the percentile, us; max_us for the last bucket
+// Description: This function estimates a percentile from the buckets.
+uint32_t evlat_percentile(const evlat_histogram_t* histogram, uint32_t per_mille)
+{
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = ((uint64_t)histogram->count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < EVLAT_BUCKETS - 1; b++) {
+        seen += histogram->buckets[b];
+        if (seen >= rank) {
+            uint32_t upper = (b == 0) ? 0 : (1u << b) - 1;
+            return (upper < histogram->max_us) ? upper : histogram->max_us;
+        }
+    }
+    return histogram->max_us;
+}
+
+// void evlat_log_summary(void)
+// Input: none
+// Output: none
+// Description: This function logs count, mean, p50, p99 and max of every stage of the events seen so far.
+void evlat_log_summary(void)
+{
+    for (size_t ev = 0; ev < ARRAY_SIZE(evlat_event_names); ev++) {
+        for (size_t st = 0; st < EVLAT_STAGES; st++) {
+            evlat_histogram_t h;
+            evlat_get((sm_event_type_t)ev, (evlat_stage_t)st, &h);
+            if (h.count == 0) {
+                continue;
+            }
+            ESP_LOGI(TAG,"%s %s: n=%" PRIu32 " mean=%" PRIu32 " p50<=%" PRIu32 " p99<=%" PRIu32 " max=%" PRIu32 " us",
+                evlat_event_names[ev],evlat_stage_names[st],h.count,(uint32_t)(h.sum_us / h.count),
+                evlat_percentile(&h,500),evlat_percentile(&h,990),h.max_us);
+        }
+    }
+}
+
+// end of evlat.c
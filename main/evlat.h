@@ -0,0 +1,72 @@
+// evlat.h
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+#include "events.h"
+
+// Latency histograms of the event loop. Every event is stamped by evloop_post(); the loop records, per
+// event type, the time the event waited in the queue, the time from its dequeue to the start of the
+// transition action and the execution time of the action.
+//
+// The buckets are powers of 2 in microseconds: bucket 0 counts 0 us, bucket b counts [2^(b-1), 2^b) us
+// and the last bucket counts everything above. Recording is an index computation and three increments.
+
+#define EVLAT_BUCKETS   (16)
+
+typedef enum {
+    EVLAT_WAIT = 0,     // evloop_post() to dequeue by the loop task
+    EVLAT_DISPATCH,     // dequeue to start of the transition action
+    EVLAT_ACTION,       // execution of the transition action
+    EVLAT_STAGES
+} evlat_stage_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t buckets[EVLAT_BUCKETS];
+} evlat_histogram_t;
+
+// One set per event loop, written by the task of that loop only. evlat_get() merges them.
+extern evlat_histogram_t evlat_histograms[CONFIG_EVLOOP_LOOPS][sm_EVENTS_NUMBER][EVLAT_STAGES];
+
+esp_err_t evlat_init(void);
+esp_err_t evlat_get(sm_event_type_t event, evlat_stage_t stage, evlat_histogram_t* histogram);
+void evlat_reset(void);
+uint32_t evlat_percentile(const evlat_histogram_t* histogram, uint32_t per_mille);
+void evlat_log_summary(void);
+
+static inline uint32_t evlat_bucket(uint32_t us)
+{
+    uint32_t b = (us == 0) ? 0 : 32 - __builtin_clz(us);
+    return (b < EVLAT_BUCKETS) ? b : EVLAT_BUCKETS - 1;
+}
+
+static inline void evlat_record(uint32_t loop, sm_event_type_t event, evlat_stage_t stage, uint32_t us)
+{
+    if ((unsigned)event < sm_EVENTS_NUMBER) {
+        evlat_histogram_t* h = &evlat_histograms[loop][event][stage];
+        h->count++;
+        h->sum_us += us;
+        if (us > h->max_us) {
+            h->max_us = us;
+        }
+        h->buckets[evlat_bucket(us)]++;
+    }
+}
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of evlat.h
@@ -0,0 +1,1413 @@
+// evloop.c
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#if defined(CONFIG_EVLOOP_PTHREADS)
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#endif  // defined(CONFIG_EVLOOP_PTHREADS)
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "commondefs.h"
+#include "evloop.h"
+#if defined(CONFIG_EVLOOP_LATENCY)
+#include "evlat.h"
+#endif  // defined(CONFIG_EVLOOP_LATENCY)
+#if defined(CONFIG_SM_RECORD)
+#include "smrec.h"
+#endif  // defined(CONFIG_SM_RECORD)
+
+static const char TAG[] = "EVL";
+
+static evloop_machine_t* machines[CONFIG_SM_MAX_STATE_MACHINES];
+static size_t machines_count = 0;
+
+// Instance groups. A group counts as one registration, whatever the number of its instances.
+static evloop_group_t* groups[CONFIG_EVLOOP_MAX_GROUPS];
+static size_t groups_count = 0;
+
+_Static_assert(CONFIG_SM_MAX_STATE_MACHINES <= UINT8_MAX, "routes_count holds up to 255 machines");
+
+// Queue item: the event, its receiver and the time it was posted
+typedef struct {
+    sm_event_type_t event;
+    uint16_t target;        // sm_machine_t.id of the receiver, EVLOOP_TARGET_ALL for all subscribers
+    bool coalesce;          // EV_OVF_COALESCE: the instance which set coalesce_pending, see evloop_post_()
+#if defined(CONFIG_EVLOOP_LATENCY)
+    uint32_t posted;        // low 32 bits of esp_timer_get_time(), us
+#endif  // defined(CONFIG_EVLOOP_LATENCY)
+} evloop_item_t;
+
+#define EVLOOP_RING_SIZE    (CONFIG_EVLOOP_RING_SIZE)
+#define EVLOOP_RING_MASK    (EVLOOP_RING_SIZE - 1)
+#define EVLOOP_CACHE_LINE   (64)
+
+_Static_assert((EVLOOP_RING_SIZE & EVLOOP_RING_MASK) == 0, "CONFIG_EVLOOP_RING_SIZE must be a power of 2");
+
+// Event queue: one bounded ring (D. Vyukov) per priority level, the same ring as the one of smtrace.c.
+// Producers claim a cell with a CAS on head and publish it by its sequence number, so tasks on both cores
+// and ISRs post without a lock and without disabling interrupts. A producer interrupted between the claim
+// and the publish only delays the consumer, which stops at the unpublished cell until the producer
+// notifies it. Cells are taken with a CAS on tail too: the loop task is the consumer, but a producer with
+// the EV_OVF_REPLACE_OLDEST policy takes the oldest event out of a full ring. head and the producer
+// counters are kept on one cache line, tail and the counters of the loop task on another.
+typedef struct {
+    _Atomic uint32_t seq;   // sequence number minus the index of the cell, see cell_seq()
+    evloop_item_t item;
+} evloop_cell_t;
+
+typedef struct {
+    _Atomic uint32_t head __attribute__((aligned(EVLOOP_CACHE_LINE)));
+    _Atomic uint32_t posted;
+    _Atomic uint32_t dropped;
+    _Atomic uint32_t tail __attribute__((aligned(EVLOOP_CACHE_LINE)));
+    uint32_t high_water;    // maximal number of events seen waiting by the loop task
+    uint32_t skipped;       // events of higher levels served while this level was waiting
+    uint32_t promoted;      // events served ahead of higher levels by the starvation bound
+    evloop_cell_t cells[EVLOOP_RING_SIZE] __attribute__((aligned(EVLOOP_CACHE_LINE)));
+} evloop_ring_t;
+
+// Event loop: one task pinned to its core, or one pthread with CONFIG_EVLOOP_PTHREADS, with its own rings
+// and routes. A machine is registered to one loop and all its transitions run in the task of that loop,
+// so they run to completion. Producers, the other loops included, post to a loop through its lock-free
+// rings; an event with subscribers on several loops is queued once on each of them.
+typedef struct {
+    evloop_ring_t rings[EV_PRIO_LEVELS];
+    // Routes: for every event, the machines and groups of the loop subscribed to it, in the order of
+    // registration. The loop walks the route of an event only, so the cost of an event depends on the
+    // number of its subscribers and not on the number of registered machines.
+    evloop_machine_t* routes[sm_EVENTS_NUMBER][CONFIG_SM_MAX_STATE_MACHINES];
+    uint8_t routes_count[sm_EVENTS_NUMBER];
+    evloop_group_t* group_routes[sm_EVENTS_NUMBER][CONFIG_EVLOOP_MAX_GROUPS];
+    uint8_t group_routes_count[sm_EVENTS_NUMBER];
+    // EV_OVF_COALESCE: set while an instance of the event is in the rings of the loop
+    _Atomic uint32_t coalesce_pending[sm_EVENTS_NUMBER];
+    // EV_OVF_BLOCK: producers waiting for room, woken by the loop through space
+    _Atomic uint32_t space_waiters;
+    // Published with release order once the task or the thread handle is stored: a producer that sees it
+    // set can wake the loop through the handle.
+    _Atomic bool running;
+#if defined(CONFIG_EVLOOP_PTHREADS)
+    pthread_t thread;
+    sem_t wake;
+    sem_t space;
+#else
+    TaskHandle_t task;
+    SemaphoreHandle_t space;
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+    StaticTask_t task_tcb;
+    StaticSemaphore_t space_buffer;
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+#endif  // defined(CONFIG_EVLOOP_PTHREADS)
+} evloop_loop_t;
+
+static evloop_loop_t loops[CONFIG_EVLOOP_LOOPS];
+
+#if defined(CONFIG_APP_STATIC_ALLOCATION) && !defined(CONFIG_EVLOOP_PTHREADS)
+// Stacks of the loop tasks, apart from loops[] so the linker map shows them as one symbol
+static StackType_t loop_stacks[CONFIG_EVLOOP_LOOPS][CONFIG_SM_EVENT_TASK_STACK_SIZE];
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION) && !defined(CONFIG_EVLOOP_PTHREADS)
+
+// Loops with subscribers of every event, one bit per loop. In DRAM, because it is read in ISR context.
+static DRAM_ATTR uint8_t event_loops[sm_EVENTS_NUMBER];
+
+_Static_assert(CONFIG_EVLOOP_LOOPS <= 8, "event_loops holds up to 8 loops");
+
+// Priority and overflow policy of every event, from EVENT_LIST. In DRAM, because they are read in
+// ISR context.
+static DRAM_ATTR const uint8_t event_priority[sm_EVENTS_NUMBER] = {
+    #define X(name, prio, ovf) prio,
+    EVENT_LIST
+    #undef X
+};
+
+static DRAM_ATTR const uint8_t event_overflow[sm_EVENTS_NUMBER] = {
+    #define X(name, prio, ovf) ovf,
+    EVENT_LIST
+    #undef X
+};
+
+// Counters per event type. See evloop_get_event_stats().
+typedef struct {
+    _Atomic uint32_t posted;
+    _Atomic uint32_t dropped;
+    _Atomic uint32_t coalesced;
+    _Atomic uint32_t evicted;
+    _Atomic uint32_t blocked;
+    _Atomic uint32_t timeouts;
+} evloop_event_counters_t;
+
+static evloop_event_counters_t event_counters[sm_EVENTS_NUMBER];
+
+// The sequence number of cell i starts at i. It is stored minus i, so the zero initialized ring is
+// ready before evloop_create() and events can be posted at any time.
+FORCE_INLINE_ATTR uint32_t cell_seq(evloop_ring_t* r, uint32_t i)
+{
+    return atomic_load_explicit(&r->cells[i].seq, memory_order_acquire) + i;
+}
+
+FORCE_INLINE_ATTR void cell_set_seq(evloop_ring_t* r, uint32_t i, uint32_t seq)
+{
+    atomic_store_explicit(&r->cells[i].seq, seq - i, memory_order_release);
+}
+
+static _Atomic uint32_t stat_posted = 0;
+static _Atomic uint32_t stat_dropped = 0;
+static _Atomic uint32_t stat_dispatched = 0;
+static _Atomic uint32_t stat_transitions = 0;
+static _Atomic uint32_t stat_lost = 0;
+static _Atomic uint32_t stat_wakeups = 0;
+static _Atomic uint32_t stat_batches = 0;
+static _Atomic uint32_t stat_coalesced = 0;
+static _Atomic uint32_t stat_evicted = 0;
+static _Atomic uint32_t stat_delivered = 0;
+static _Atomic uint32_t stat_unrouted = 0;
+
+static void evloop_task(void* pvParameter);
+static esp_err_t evloop_send_(uint16_t target, sm_event_type_t event, bool isr, BaseType_t* woken, bool* queued);
+#if defined(CONFIG_EVLOOP_PTHREADS)
+static void* evloop_thread(void* arg);
+#endif  // defined(CONFIG_EVLOOP_PTHREADS)
+static void evloop_loop_run(evloop_loop_t* lp);
+static esp_err_t evloop_post_wait(evloop_loop_t* lp, evloop_ring_t* r, sm_event_type_t event, uint16_t target);
+static void evloop_dispatch_(evloop_machine_t* m, sm_event_type_t event, uint32_t dequeued);
+static void evloop_execute_(const evloop_machine_t* m, const sm_transition_t* tr, sm_event_type_t event, uint32_t dequeued);
+static uint32_t evloop_group_dispatch_(evloop_group_t* g, size_t first, size_t end, sm_event_type_t event, uint32_t dequeued);
+
+// static void evloop_subscriptions(const evloop_index_row_t* index, size_t sizes, evloop_event_mask_t* mask)
+// Input:
+//  index: dense index of a machine type
+//  sizes: number of states, i.e. rows of index
+//  mask: event set where the events of the machine type to be added
+// Output: none
+// Description: This function adds to mask every event which has a transition in at least one state.
+static void evloop_subscriptions(const evloop_index_row_t* index, size_t sizes, evloop_event_mask_t* mask)
+{
+    for (size_t st = 0; st < sizes; st++) {
+        for (int e = 0; e < sm_EVENTS_NUMBER; e++) {
+            if (index[st][e] != NULL) {
+                evloop_mask_set(mask, (sm_event_type_t)e);
+            }
+        }
+    }
+}
+
+// esp_err_t evloop_register(evloop_machine_t* m)
+// Input:
+//  m: machine descriptor with its dense index and tracers
+// Output: ESP_OK, ESP_ERR_INVALID_ARG if m->loop is not a loop, or ESP_ERR_NO_MEM if
+// CONFIG_SM_MAX_STATE_MACHINES are already registered
+// Description: This function adds a machine to the event loop m->loop. The events of the machine are the
+// ones with a transition in its index; they are added to m->subscribed, which may hold more events set
+// by the user, e.g. to have them reported by the lost event tracer. The machine is added to the route of
+// each of them and receives no other event. Registration must be done before evloop_create().
+esp_err_t evloop_register(evloop_machine_t* m)
+{
+    if (m->loop >= CONFIG_EVLOOP_LOOPS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (machines_count >= ARRAY_SIZE(machines)) {
+        return ESP_ERR_NO_MEM;
+    }
+    machines[machines_count++] = m;
+    evloop_subscriptions(m->index, m->machine->sizes, &m->subscribed);
+
+    evloop_loop_t* lp = &loops[m->loop];
+    for (int e = 0; e < sm_EVENTS_NUMBER; e++) {
+        if (evloop_mask_has(&m->subscribed, (sm_event_type_t)e)) {
+            lp->routes[e][lp->routes_count[e]++] = m;
+            event_loops[e] |= 1u << m->loop;
+        }
+    }
+    return ESP_OK;
+}
+
+FORCE_INLINE_ATTR bool evloop_loop_running(evloop_loop_t* lp)
+{
+    return atomic_load_explicit(&lp->running, memory_order_acquire);
+}
+
+#if defined(CONFIG_EVLOOP_PTHREADS)
+
+// Signals between the producers and a loop: POSIX semaphores, as the loops are pthreads. sem_post() is
+// async-signal-safe, so the simulated ISRs of the linux target can post too.
+static esp_err_t evloop_loop_start(evloop_loop_t* lp, uint32_t l)
+{
+    if ((sem_init(&lp->wake, 0, 0) != 0) || (sem_init(&lp->space, 0, 0) != 0)) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (pthread_create(&lp->thread, NULL, evloop_thread, lp) != 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    evloop_loop_run(lp);
+    return ESP_OK;
+}
+
+FORCE_INLINE_ATTR void evloop_wake(evloop_loop_t* lp, bool isr, BaseType_t* woken)
+{
+    sem_post(&lp->wake);
+}
+
+// Several posts wake the loop once: the count of the semaphore is consumed with the first wait.
+static void evloop_wait(evloop_loop_t* lp)
+{
+    while ((sem_wait(&lp->wake) != 0) && (errno == EINTR)) {
+    }
+    while (sem_trywait(&lp->wake) == 0) {
+    }
+}
+
+static bool evloop_in_loop(void)
+{
+    for (size_t l = 0; l < CONFIG_EVLOOP_LOOPS; l++) {
+        if (evloop_loop_running(&loops[l]) && pthread_equal(pthread_self(), loops[l].thread)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void evloop_space_give(evloop_loop_t* lp)
+{
+    int value;
+    if ((sem_getvalue(&lp->space, &value) == 0) && (value == 0)) {
+        sem_post(&lp->space);
+    }
+}
+
+static bool evloop_space_take(evloop_loop_t* lp, int64_t timeout_us)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t ns = ts.tv_nsec + (timeout_us % 1000000) * 1000;
+    ts.tv_sec += timeout_us / 1000000 + ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    int ret;
+    while (((ret = sem_timedwait(&lp->space, &ts)) != 0) && (errno == EINTR)) {
+    }
+    return ret == 0;
+}
+
+#else
+
+// Signals between the producers and a loop: the task notification of the loop task wakes it, a binary
+// semaphore signals room to the blocked producers. Loop l runs on core l modulo the number of cores. With
+// CONFIG_APP_STATIC_ALLOCATION the semaphore and the task are built in loops[l] and loop_stacks[l].
+static esp_err_t evloop_loop_start(evloop_loop_t* lp, uint32_t l)
+{
+    char name[configMAX_TASK_NAME_LEN];
+
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+    lp->space = xSemaphoreCreateBinaryStatic(&lp->space_buffer);
+#else
+    lp->space = xSemaphoreCreateBinary();
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+    if (lp->space == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    snprintf(name, sizeof(name), "SM_Loop%" PRIu32, l);
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+    lp->task = xTaskCreateStaticPinnedToCore(evloop_task, name, CONFIG_SM_EVENT_TASK_STACK_SIZE, lp, 5,
+                                             loop_stacks[l], &lp->task_tcb, l % portNUM_PROCESSORS);
+    if (lp->task == NULL) {
+#else
+    if (xTaskCreatePinnedToCore(evloop_task, name, CONFIG_SM_EVENT_TASK_STACK_SIZE, lp, 5, &lp->task, l % portNUM_PROCESSORS) != pdPASS) {
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+        return ESP_ERR_NO_MEM;
+    }
+    evloop_loop_run(lp);
+    return ESP_OK;
+}
+
+FORCE_INLINE_ATTR void evloop_wake(evloop_loop_t* lp, bool isr, BaseType_t* woken)
+{
+    if (isr) {
+        vTaskNotifyGiveFromISR(lp->task, woken);
+    }
+    else {
+        xTaskNotifyGive(lp->task);
+    }
+}
+
+static void evloop_wait(evloop_loop_t* lp)
+{
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+static bool evloop_in_loop(void)
+{
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    for (size_t l = 0; l < CONFIG_EVLOOP_LOOPS; l++) {
+        if (evloop_loop_running(&loops[l]) && (loops[l].task == self)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void evloop_space_give(evloop_loop_t* lp)
+{
+    xSemaphoreGive(lp->space);
+}
+
+static bool evloop_space_take(evloop_loop_t* lp, int64_t timeout_us)
+{
+    return xSemaphoreTake(lp->space, pdMS_TO_TICKS((timeout_us + 999) / 1000)) == pdTRUE;
+}
+
+#endif  // defined(CONFIG_EVLOOP_PTHREADS)
+
+// static void evloop_loop_run(evloop_loop_t* lp)
+// Input:
+//  lp: loop whose task or thread handle is stored
+// Output: none
+// Description: This function publishes the loop to the producers once its handle is valid, so no producer
+// wakes it through an unset handle. The producers which posted in between skipped the wake; the loop is
+// woken once here for their events.
+static void evloop_loop_run(evloop_loop_t* lp)
+{
+    atomic_store_explicit(&lp->running, true, memory_order_release);
+    evloop_wake(lp, false, NULL);
+}
+
+// esp_err_t evloop_create(void)
+// Input: none
+// Output: ESP error code
+// Description: This function creates the CONFIG_EVLOOP_LOOPS loops which dispatch the events. Events
+// posted before are dispatched when the loops start.
+esp_err_t evloop_create(void)
+{
+#if defined(CONFIG_EVLOOP_LATENCY)
+    evlat_init();
+#endif  // defined(CONFIG_EVLOOP_LATENCY)
+    for (uint32_t l = 0; l < CONFIG_EVLOOP_LOOPS; l++) {
+        esp_err_t ret = evloop_loop_start(&loops[l], l);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG,"Cannot start event loop %" PRIu32,l);
+            return ret;
+        }
+    }
+    ESP_LOGI(TAG,"Created %d event loops",CONFIG_EVLOOP_LOOPS);
+    return ESP_OK;
+}
+
+// static bool evloop_ring_put(evloop_ring_t* r, const sm_event_type_t* events, uint32_t n, uint16_t target, bool coalesce)
+// Input:
+//  r: ring of the priority level
+//  events: events to be queued
+//  n: number of events, 1 to EVLOOP_RING_SIZE
+//  target: receiver of the events
+//  coalesce: true for the one event which set coalesce_pending, see evloop_post_()
+// Output: true if queued, false if the ring has not room for all of them
+// Description: Producer side of the ring. It claims n consecutive cells with one CAS on head, so the events
+// of one call are not interleaved with the events of other producers. Every cell of the claim is checked:
+// producers evicting with EV_OVF_REPLACE_OLDEST take cells too, so the cells are not always freed in order.
+// It is safe in ISR context. With CONFIG_EVLOOP_LATENCY the events are stamped with the time of the post.
+static IRAM_ATTR bool evloop_ring_put(evloop_ring_t* r, const sm_event_type_t* events, uint32_t n, uint16_t target, bool coalesce)
+{
+    uint32_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    while (true) {
+        int32_t dif = 0;
+        for (uint32_t k = 0; (k < n) && (dif == 0); k++) {
+            dif = (int32_t)(cell_seq(r, (pos + k) & EVLOOP_RING_MASK) - (pos + k));
+        }
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + n, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+        }
+    }
+
+#if defined(CONFIG_EVLOOP_LATENCY)
+    uint32_t posted = (uint32_t)esp_timer_get_time();
+#endif  // defined(CONFIG_EVLOOP_LATENCY)
+    for (uint32_t k = 0; k < n; k++) {
+        uint32_t i = (pos + k) & EVLOOP_RING_MASK;
+        r->cells[i].item.event = events[k];
+        r->cells[i].item.target = target;
+        r->cells[i].item.coalesce = coalesce;
+#if defined(CONFIG_EVLOOP_LATENCY)
+        r->cells[i].item.posted = posted;
+#endif  // defined(CONFIG_EVLOOP_LATENCY)
+        cell_set_seq(r, i, pos + k + 1);
+    }
+    atomic_fetch_add_explicit(&r->posted, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_posted, n, memory_order_relaxed);
+    return true;
+}
+
+// static bool evloop_ring_take(evloop_loop_t* lp, evloop_ring_t* r, evloop_item_t* item)
+// Input:
+//  lp: loop of the ring
+//  r: ring
+//  item: pointer to a variable where the oldest event to be copied
+// Output: true if an event was taken, false if the ring is empty
+// Description: Consumer side of the ring, used by the loop task and by the replace-oldest overflow policy.
+// It is safe in ISR context.
+static IRAM_ATTR bool evloop_ring_take(evloop_loop_t* lp, evloop_ring_t* r, evloop_item_t* item)
+{
+    uint32_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t i;
+
+    while (true) {
+        i = pos & EVLOOP_RING_MASK;
+        int32_t dif = (int32_t)(cell_seq(r, i) - (pos + 1));
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+    *item = r->cells[i].item;
+    cell_set_seq(r, i, pos + EVLOOP_RING_SIZE);
+
+    if (item->coalesce) {
+        atomic_store_explicit(&lp->coalesce_pending[item->event], 0, memory_order_release);
+    }
+    return true;
+}
+
+// static evloop_ring_t* evloop_ring_of(evloop_loop_t* lp, sm_event_type_t event)
+// Description: Ring of the priority level of event in loop lp.
+FORCE_INLINE_ATTR evloop_ring_t* evloop_ring_of(evloop_loop_t* lp, sm_event_type_t event)
+{
+    return &lp->rings[event_priority[event]];
+}
+
+FORCE_INLINE_ATTR void evloop_count_drop(evloop_ring_t* r, sm_event_type_t event, uint32_t n)
+{
+    atomic_fetch_add_explicit(&r->dropped, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&event_counters[event].dropped, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_dropped, n, memory_order_relaxed);
+}
+
+// static esp_err_t evloop_post_(evloop_loop_t* lp, sm_event_type_t event, uint16_t target, bool isr)
+// Input:
+//  lp: loop
+//  event: event to be queued
+//  target: receiver, see evloop_post_to()
+//  isr: true when called in ISR context
+// Output: see evloop_post()
+// Description: This function queues one event applying its overflow policy:
+//  EV_OVF_DROP: a post to a full queue is rejected.
+//  EV_OVF_COALESCE: while an instance of the event is in the queue, a new one is merged with it. Only
+//  posts to all subscribers are merged; a post to one machine is dropped when the queue is full.
+//  EV_OVF_REPLACE_OLDEST: the oldest event of the level is taken out of a full queue to make room. If
+//  there is still no room after EVLOOP_RING_SIZE attempts, the event is rejected.
+//  EV_OVF_BLOCK: the producer waits up to CONFIG_EVLOOP_BLOCK_TIMEOUT_MS for room. In ISR context and
+//  in the loop tasks, which could wait for each other, the event is rejected instead.
+static IRAM_ATTR esp_err_t evloop_post_(evloop_loop_t* lp, sm_event_type_t event, uint16_t target, bool isr)
+{
+    evloop_ring_t* r = evloop_ring_of(lp, event);
+    uint8_t ovf = event_overflow[event];
+    bool coalesce = (ovf == EV_OVF_COALESCE) && (target == EVLOOP_TARGET_ALL);
+    esp_err_t ret = ESP_OK;
+
+    if (coalesce) {
+        if (atomic_exchange_explicit(&lp->coalesce_pending[event], 1, memory_order_acq_rel) != 0) {
+            atomic_fetch_add_explicit(&event_counters[event].coalesced, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&stat_coalesced, 1, memory_order_relaxed);
+            return ESP_ERR_EVLOOP_COALESCED;
+        }
+    }
+
+    if (!evloop_ring_put(r, &event, 1, target, coalesce)) {
+        if (ovf == EV_OVF_REPLACE_OLDEST) {
+            // The oldest cell may be claimed by a producer preempted before publishing it, or be taken
+            // by the loop task meanwhile, so the retries are bounded.
+            evloop_item_t oldest;
+            uint32_t retries = 0;
+            do {
+                if (++retries > EVLOOP_RING_SIZE) {
+                    evloop_count_drop(r, event, 1);
+                    return ESP_FAIL;
+                }
+                if (evloop_ring_take(lp, r, &oldest)) {
+                    atomic_fetch_add_explicit(&event_counters[oldest.event].evicted, 1, memory_order_relaxed);
+                    atomic_fetch_add_explicit(&stat_evicted, 1, memory_order_relaxed);
+                    ret = ESP_ERR_EVLOOP_REPLACED;
+                }
+            } while (!evloop_ring_put(r, &event, 1, target, false));
+        }
+        else if ((ovf == EV_OVF_BLOCK) && !isr && evloop_loop_running(lp) && !evloop_in_loop()) {
+            ret = evloop_post_wait(lp, r, event, target);
+            if (ret != ESP_OK) {
+                return ret;
+            }
+        }
+        else {
+            if (coalesce) {
+                atomic_store_explicit(&lp->coalesce_pending[event], 0, memory_order_release);
+            }
+            evloop_count_drop(r, event, 1);
+            return ESP_FAIL;
+        }
+    }
+    atomic_fetch_add_explicit(&event_counters[event].posted, 1, memory_order_relaxed);
+    return ret;
+}
+
+// static esp_err_t evloop_post_wait(evloop_loop_t* lp, evloop_ring_t* r, sm_event_type_t event, uint16_t target)
+// Input:
+//  lp: loop
+//  r: ring of the event
+//  event: event to be queued
+//  target: receiver of the event
+// Output: ESP_OK or ESP_ERR_TIMEOUT
+// Description: EV_OVF_BLOCK policy. The waiter is counted before the first retry, so room made by the loop
+// task after the retry is always signalled. The loop task gives lp->space once per batch; a producer which
+// got room passes the signal on to the next waiter.
+static esp_err_t evloop_post_wait(evloop_loop_t* lp, evloop_ring_t* r, sm_event_type_t event, uint16_t target)
+{
+    int64_t deadline = esp_timer_get_time() + CONFIG_EVLOOP_BLOCK_TIMEOUT_MS * 1000LL;
+    esp_err_t ret = ESP_OK;
+
+    atomic_fetch_add_explicit(&event_counters[event].blocked, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&lp->space_waiters, 1, memory_order_acq_rel);
+    while (!evloop_ring_put(r, &event, 1, target, false)) {
+        int64_t left = deadline - esp_timer_get_time();
+        if ((left <= 0) || !evloop_space_take(lp, left)) {
+            if (evloop_ring_put(r, &event, 1, target, false)) {
+                break;
+            }
+            atomic_fetch_add_explicit(&event_counters[event].timeouts, 1, memory_order_relaxed);
+            evloop_count_drop(r, event, 1);
+            ret = ESP_ERR_TIMEOUT;
+            break;
+        }
+    }
+    if ((atomic_fetch_sub_explicit(&lp->space_waiters, 1, memory_order_acq_rel) > 1) && (ret == ESP_OK)) {
+        evloop_space_give(lp);
+    }
+    return ret;
+}
+
+static inline bool evloop_ring_waiting(evloop_ring_t* r)
+{
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    return cell_seq(r, tail & EVLOOP_RING_MASK) == tail + 1;
+}
+
+// static bool evloop_loop_take(evloop_loop_t* lp, evloop_ring_t* r, evloop_item_t* item)
+// Input:
+//  lp: loop
+//  r: ring selected by evloop_select()
+//  item: pointer to a variable where the event to be copied
+// Output: true if an event was taken; false if a producer emptied the ring meanwhile
+// Description: Take of the loop task. It updates the occupancy high-water mark of the level.
+static bool evloop_loop_take(evloop_loop_t* lp, evloop_ring_t* r, evloop_item_t* item)
+{
+    uint32_t waiting = atomic_load_explicit(&r->head, memory_order_relaxed) - atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    if (waiting > r->high_water) {
+        r->high_water = waiting;
+    }
+    return evloop_ring_take(lp, r, item);
+}
+
+// static evloop_ring_t* evloop_select(evloop_loop_t* lp)
+// Input:
+//  lp: loop
+// Output: ring to take the next event from, NULL if all are empty
+// Description: Higher levels are served first. Every event served while a lower level is waiting is
+// counted for that level; when the count reaches CONFIG_EVLOOP_STARVATION_LIMIT, the lower level is served
+// once ahead of the higher ones. So a waiting event of the lowest level is delayed by at most
+// CONFIG_EVLOOP_STARVATION_LIMIT events of each higher level.
+static evloop_ring_t* evloop_select(evloop_loop_t* lp)
+{
+    evloop_ring_t* rings = lp->rings;
+    int level = -1;
+
+    for (int l = EV_PRIO_LEVELS - 1; l > 0; l--) {
+        if ((rings[l].skipped >= CONFIG_EVLOOP_STARVATION_LIMIT) && evloop_ring_waiting(&rings[l])) {
+            level = l;
+            rings[l].promoted++;
+            break;
+        }
+    }
+    if (level < 0) {
+        for (int l = 0; l < EV_PRIO_LEVELS; l++) {
+            if (evloop_ring_waiting(&rings[l])) {
+                level = l;
+                break;
+            }
+        }
+        if (level < 0) {
+            return NULL;
+        }
+    }
+    for (int l = level + 1; l < EV_PRIO_LEVELS; l++) {
+        if (evloop_ring_waiting(&rings[l])) {
+            rings[l].skipped++;
+        }
+    }
+    rings[level].skipped = 0;
+    return &rings[level];
+}
+
+#if defined(CONFIG_SM_RECORD)
+
+// static esp_err_t evloop_send_recorded_(uint16_t target, sm_event_type_t event, bool isr, BaseType_t* woken)
+// Input: see evloop_send_()
+// Output: see evloop_send_()
+// Description: evloop_send_() with the post recorded while the recorder runs, see smrec.h. The record
+// carries the time before the event was queued, and SMREC_F_DISCARDED when no loop queued it, so the
+// player skips it.
+static IRAM_ATTR esp_err_t evloop_send_recorded_(uint16_t target, sm_event_type_t event, bool isr, BaseType_t* woken)
+{
+    if (!atomic_load_explicit(&smrec_active, memory_order_relaxed)) {
+        return evloop_send_(target, event, isr, woken, NULL);
+    }
+    uint32_t now = (uint32_t)esp_timer_get_time();
+    bool queued = false;
+    esp_err_t ret = evloop_send_(target, event, isr, woken, &queued);
+    if (ret != ESP_ERR_INVALID_ARG) {
+        uint8_t flags = isr ? SMREC_F_ISR : (evloop_in_loop() ? SMREC_F_INTERNAL : 0);
+        if ((ret != ESP_OK) && !queued) {
+            flags |= SMREC_F_DISCARDED;
+        }
+        smrec_put(now, target, SMREC_POST, event, 0, 0, 0, flags);
+    }
+    return ret;
+}
+
+#endif  // defined(CONFIG_SM_RECORD)
+
+// esp_err_t evloop_post(sm_event_type_t event)
+// Input:
+//  event: event to be dispatched to all machines subscribed to it
+// Output: see evloop_post_to()
+// Description: This function queues an event for all its subscribers, see evloop_post_to().
+esp_err_t evloop_post(sm_event_type_t event)
+{
+    return evloop_post_to(EVLOOP_TARGET_ALL, event);
+}
+
+// esp_err_t evloop_post_to(uint16_t target, sm_event_type_t event)
+// Input:
+//  target: sm_machine_t.id of the receiver, an instance of a group included; EVLOOP_TARGET_ALL for all
+//  machines subscribed to the event
+//  event: event to be dispatched
+// Output:
+//  ESP_OK: queued
+//  ESP_ERR_EVLOOP_COALESCED: merged with an instance of the event already in the queue
+//  ESP_ERR_EVLOOP_REPLACED: queued, the oldest event of the priority level was discarded
+//  ESP_FAIL: dropped, the queue is full
+//  ESP_ERR_TIMEOUT: dropped, the queue stayed full for CONFIG_EVLOOP_BLOCK_TIMEOUT_MS
+//  ESP_ERR_INVALID_ARG: not an event of EVENT_LIST
+// Description: This function queues an event on the loops of its receivers and wakes them. It does not
+// take a lock and blocks only for events with the EV_OVF_BLOCK policy, see evloop_post_(). The event is
+// dispatched to the target only if the target is subscribed to it; otherwise it is counted as unrouted.
+// It must not be called from ISR context, see evloop_post_to_from_isr().
+esp_err_t evloop_post_to(uint16_t target, sm_event_type_t event)
+{
+#if defined(CONFIG_SM_RECORD)
+    return evloop_send_recorded_(target, event, false, NULL);
+#else
+    return evloop_send_(target, event, false, NULL, NULL);
+#endif  // defined(CONFIG_SM_RECORD)
+}
+
+// esp_err_t evloop_post_from_isr(sm_event_type_t event, BaseType_t* woken)
+// Input:
+//  event: event to be dispatched to all machines subscribed to it
+//  woken: set to pdTRUE if a loop task has to run at the end of the ISR, may be NULL
+// Output: see evloop_post_to()
+// Description: ISR version of evloop_post(), see evloop_post_to_from_isr().
+IRAM_ATTR esp_err_t evloop_post_from_isr(sm_event_type_t event, BaseType_t* woken)
+{
+    return evloop_post_to_from_isr(EVLOOP_TARGET_ALL, event, woken);
+}
+
+// esp_err_t evloop_post_to_from_isr(uint16_t target, sm_event_type_t event, BaseType_t* woken)
+// Input:
+//  target: receiver, see evloop_post_to()
+//  event: event to be dispatched
+//  woken: set to pdTRUE if a loop task has to run at the end of the ISR, may be NULL
+// Output: see evloop_post_to()
+// Description: ISR version of evloop_post_to(). It is placed in IRAM and never blocks: EV_OVF_BLOCK events
+// are dropped when the queue is full. The caller ends the ISR with portYIELD_FROM_ISR(), or, in an
+// esp_timer callback with ESP_TIMER_ISR dispatch, calls esp_timer_isr_dispatch_need_yield() when *woken
+// is pdTRUE.
+IRAM_ATTR esp_err_t evloop_post_to_from_isr(uint16_t target, sm_event_type_t event, BaseType_t* woken)
+{
+#if defined(CONFIG_SM_RECORD)
+    return evloop_send_recorded_(target, event, true, woken);
+#else
+    return evloop_send_(target, event, true, woken, NULL);
+#endif  // defined(CONFIG_SM_RECORD)
+}
+
+// static uint32_t evloop_target_loops(sm_event_type_t event, uint16_t target)
+// Input:
+//  event: event
+//  target: sm_machine_t.id of a machine or of a group instance
+// Output: bit of the loop of the target, 0 if the target is not subscribed to event
+// Description: This function looks for the target in the routes of the event only.
+static IRAM_ATTR uint32_t evloop_target_loops(sm_event_type_t event, uint16_t target)
+{
+    for (uint32_t l = 0; l < CONFIG_EVLOOP_LOOPS; l++) {
+        evloop_loop_t* lp = &loops[l];
+        for (size_t i = 0; i < lp->routes_count[event]; i++) {
+            if (lp->routes[event][i]->machine->id == target) {
+                return 1u << l;
+            }
+        }
+        for (size_t i = 0; i < lp->group_routes_count[event]; i++) {
+            evloop_group_t* g = lp->group_routes[event][i];
+            if ((uint16_t)(target - g->cfg.first_id) < g->count) {
+                return 1u << l;
+            }
+        }
+    }
+    return 0;
+}
+
+// static esp_err_t evloop_send_(uint16_t target, sm_event_type_t event, bool isr, BaseType_t* woken, bool* queued)
+// Input:
+//  target: receiver, see evloop_post_to()
+//  event: event to be queued
+//  isr: true when called in ISR context
+//  woken: see evloop_post_to_from_isr(), used when isr is true
+//  queued: set to true if at least one loop queued the event, may be NULL
+// Output: see evloop_post_to(); with several loops, the first error
+// Description: This function queues the event on every loop with a subscriber of it, or on the loop of
+// the target, and wakes these loops. An event without a receiver is counted as unrouted and not queued.
+static IRAM_ATTR esp_err_t evloop_send_(uint16_t target, sm_event_type_t event, bool isr, BaseType_t* woken, bool* queued)
+{
+    if ((unsigned)event >= sm_EVENTS_NUMBER) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint32_t mask = (target == EVLOOP_TARGET_ALL) ? event_loops[event] : evloop_target_loops(event, target);
+    esp_err_t ret = ESP_OK;
+
+    if (mask == 0) {
+        atomic_fetch_add_explicit(&stat_unrouted, 1, memory_order_relaxed);
+        return ESP_OK;
+    }
+    for (uint32_t l = 0; l < CONFIG_EVLOOP_LOOPS; l++) {
+        if ((mask & (1u << l)) == 0) {
+            continue;
+        }
+        esp_err_t r = evloop_post_(&loops[l], event, target, isr);
+        if ((r == ESP_OK) || (r == ESP_ERR_EVLOOP_REPLACED)) {
+            if (queued != NULL) {
+                *queued = true;
+            }
+            if (evloop_loop_running(&loops[l])) {
+                evloop_wake(&loops[l], isr, woken);
+            }
+        }
+        if (ret == ESP_OK) {
+            ret = r;
+        }
+    }
+    return ret;
+}
+
+// esp_err_t evloop_post_events(const sm_event_type_t* events, size_t n)
+// Input:
+//  events: events to be dispatched, in this order
+//  n: number of events, 1 to CONFIG_EVLOOP_RING_SIZE
+// Output: ESP_OK, ESP_ERR_INVALID_ARG or ESP_FAIL if a loop has not room for all events
+// Description: This function queues n events with one claim of a ring per loop and wakes each loop once.
+// Every loop with a subscriber of one of the events gets all of them, or none; they are dispatched back
+// to back, without events of other producers between them, and a loop skips the events it has no
+// subscriber of. To keep their order, all events go to the ring of the highest priority among them.
+// The overflow policies do not apply: when there is no room, all events are dropped on that loop.
+// With CONFIG_SM_RECORD the events are recorded one by one; a burst without any receiver is not. They
+// are flagged SMREC_F_DISCARDED only when no loop queued them: the player posts them again to all loops.
+esp_err_t evloop_post_events(const sm_event_type_t* events, size_t n)
+{
+    if ((events == NULL) || (n == 0) || (n > EVLOOP_RING_SIZE)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (size_t k = 0; k < n; k++) {
+        if ((unsigned)events[k] >= sm_EVENTS_NUMBER) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+#if defined(CONFIG_SM_RECORD)
+    uint32_t now = (uint32_t)esp_timer_get_time();
+#endif  // defined(CONFIG_SM_RECORD)
+    uint32_t mask = 0;
+    sm_event_prio_t prio = EV_PRIO_LEVELS;
+    for (size_t k = 0; k < n; k++) {
+        mask |= event_loops[events[k]];
+        if (event_priority[events[k]] < prio) {
+            prio = (sm_event_prio_t)event_priority[events[k]];
+        }
+    }
+    if (mask == 0) {
+        atomic_fetch_add_explicit(&stat_unrouted, n, memory_order_relaxed);
+        return ESP_OK;
+    }
+
+    esp_err_t ret = ESP_OK;
+#if defined(CONFIG_SM_RECORD)
+    bool queued = false;
+#endif  // defined(CONFIG_SM_RECORD)
+    for (uint32_t l = 0; l < CONFIG_EVLOOP_LOOPS; l++) {
+        if ((mask & (1u << l)) == 0) {
+            continue;
+        }
+        evloop_ring_t* r = &loops[l].rings[prio];
+        if (!evloop_ring_put(r, events, n, EVLOOP_TARGET_ALL, false)) {
+            for (size_t k = 0; k < n; k++) {
+                evloop_count_drop(r, events[k], 1);
+            }
+            ret = ESP_FAIL;
+            continue;
+        }
+#if defined(CONFIG_SM_RECORD)
+        queued = true;
+#endif  // defined(CONFIG_SM_RECORD)
+        for (size_t k = 0; k < n; k++) {
+            atomic_fetch_add_explicit(&event_counters[events[k]].posted, 1, memory_order_relaxed);
+        }
+        if (evloop_loop_running(&loops[l])) {
+            evloop_wake(&loops[l], false, NULL);
+        }
+    }
+#if defined(CONFIG_SM_RECORD)
+    if (atomic_load_explicit(&smrec_active, memory_order_relaxed)) {
+        uint8_t flags = SMREC_F_BATCH | (evloop_in_loop() ? SMREC_F_INTERNAL : 0) | (queued ? 0 : SMREC_F_DISCARDED);
+        for (size_t k = 0; k < n; k++) {
+            smrec_put(now, EVLOOP_TARGET_ALL, SMREC_POST, events[k], 0, 0, 0, flags);
+        }
+    }
+#endif  // defined(CONFIG_SM_RECORD)
+    return ret;
+}
+
+// esp_err_t evloop_start_with_event(evloop_machine_t* m, sm_state_idx_t state, sm_event_type_t event)
+// Input:
+//  m: machine descriptor
+//  state: initial state
+//  event: first event
+// Output: ESP error code of evloop_post()
+// Description: This function activates the machine in state and posts event.
+esp_err_t evloop_start_with_event(evloop_machine_t* m, sm_state_idx_t state, sm_event_type_t event)
+{
+    m->machine->s1 = state;
+    m->active = true;
+    return evloop_post(event);
+}
+
+// void evloop_start(evloop_machine_t* m, sm_state_idx_t state)
+// Input:
+//  m: machine descriptor
+//  state: state to start in
+// Output: none
+// Description: This function activates the machine in state without posting an event, for a machine whose
+// state has already been set up, e.g. restored from a snapshot.
+void evloop_start(evloop_machine_t* m, sm_state_idx_t state)
+{
+    m->machine->s1 = state;
+    m->active = true;
+}
+
+void evloop_stop(evloop_machine_t* m)
+{
+    m->active = false;
+}
+
+// void evloop_dispatch(evloop_machine_t* m, sm_event_type_t event)
+// Input:
+//  m: machine descriptor
+//  event: event to be processed
+// Output: none
+// Description: This function runs one transition to completion. The transition is found by one load
+// from the dense index. The order of the actions and the tracers is the one of the state_machine component:
+// 1. trace_context(false), 2. s1 exit action, 3. transition action, 4. trace_machine, 5. s2 entry action,
+// 6. trace_context(true). Exit and entry actions are executed only when s1 != s2. When the guard does
+// not permit the transition, trace_context(true) and trace_machine are called only.
+void evloop_dispatch(evloop_machine_t* m, sm_event_type_t event)
+{
+    evloop_dispatch_(m, event, (uint32_t)esp_timer_get_time());
+}
+
+// static void evloop_dispatch_(evloop_machine_t* m, sm_event_type_t event, uint32_t dequeued)
+// Input:
+//  m: machine descriptor
+//  event: event to be processed
+//  dequeued: time the event was taken from the queue, us
+// Output: none
+// Description: See evloop_dispatch(). With CONFIG_EVLOOP_LATENCY the time from dequeued to the start of the
+// transition action and the execution time of the action are recorded.
+static void evloop_dispatch_(evloop_machine_t* m, sm_event_type_t event, uint32_t dequeued)
+{
+    sm_machine_t* machine = m->machine;
+    const sm_transition_t* tr = ((unsigned)event < sm_EVENTS_NUMBER) ? m->index[machine->s1][event] : NULL;
+
+    machine->event = event;
+    machine->event_data = NULL;
+
+    if (tr == NULL) {
+        atomic_fetch_add_explicit(&stat_lost, 1, memory_order_relaxed);
+        if (m->lost_event != NULL) {
+            m->lost_event(machine);
+        }
+        return;
+    }
+    evloop_execute_(m, tr, event, dequeued);
+}
+
+// static void evloop_execute_(const evloop_machine_t* m, const sm_transition_t* tr, sm_event_type_t event,
+//                             uint32_t dequeued)
+// Input:
+//  m: machine descriptor; m->machine has s1 and the event set
+//  tr: transition found for (s1, event)
+//  event: event being processed
+//  dequeued: time the event was taken from the queue, us
+// Output: none
+// Description: Guard, actions and tracers of one transition, see evloop_dispatch().
+static void evloop_execute_(const evloop_machine_t* m, const sm_transition_t* tr, sm_event_type_t event, uint32_t dequeued)
+{
+    sm_machine_t* machine = m->machine;
+
+    if ((tr->guard == NULL) || ((tr->guard(machine) != 0) == (tr->gpol == SM_GPOL_POSITIVE))) {
+        machine->flags |= SM_TREN;
+    }
+    else {
+        machine->flags &= ~SM_TREN;
+#if defined(CONFIG_SM_RECORD)
+        smrec_transition(machine->id, machine->s1, tr->s2, event, tr->actidx, false);
+#endif  // defined(CONFIG_SM_RECORD)
+        if (m->trace_context != NULL) {
+            m->trace_context(machine, true);
+        }
+        if (m->trace_machine != NULL) {
+            m->trace_machine(machine, tr);
+        }
+        return;
+    }
+
+    sm_state_idx_t s1 = machine->s1;
+    sm_state_idx_t s2 = tr->s2;
+
+    atomic_fetch_add_explicit(&stat_transitions, 1, memory_order_relaxed);
+
+    if (m->trace_context != NULL) {
+        m->trace_context(machine, false);
+    }
+    if ((s1 != s2) && (machine->states[s1].exit_action != NULL)) {
+        machine->states[s1].exit_action(machine);
+    }
+    if (tr->action != NULL) {
+#if defined(CONFIG_EVLOOP_LATENCY)
+        uint32_t t0 = (uint32_t)esp_timer_get_time();
+        tr->action(machine);
+        uint32_t t1 = (uint32_t)esp_timer_get_time();
+        evlat_record(m->loop, event, EVLAT_DISPATCH, t0 - dequeued);
+        evlat_record(m->loop, event, EVLAT_ACTION, t1 - t0);
+#else
+        tr->action(machine);
+#endif  // defined(CONFIG_EVLOOP_LATENCY)
+    }
+    if (m->trace_machine != NULL) {
+        m->trace_machine(machine, tr);
+    }
+#if defined(CONFIG_SM_RECORD)
+    smrec_transition(machine->id, s1, s2, event, tr->actidx, true);
+#endif  // defined(CONFIG_SM_RECORD)
+    machine->s1 = s2;
+    if ((s1 != s2) && (machine->states[s2].entry_action != NULL)) {
+        machine->states[s2].entry_action(machine);
+    }
+    if (m->trace_context != NULL) {
+        m->trace_context(machine, true);
+    }
+}
+
+// esp_err_t evloop_group_create(const evloop_group_config_t* cfg, size_t count, evloop_group_t** group)
+// Input:
+//  cfg: machine type of the instances; copied
+//  count: number of instances
+//  group: pointer to a variable where the group to be written
+// Output: ESP_OK, ESP_ERR_INVALID_ARG or ESP_ERR_NO_MEM
+// Description: This function allocates a group of instances of one machine type in one arena: first the
+// current states and the flags of all instances as two arrays, which are all the broadcast sweep reads,
+// then the sm_machine_t and the context of every instance, which are touched only when an instance takes
+// a transition. The instances are stopped and their contexts are zeroed. The group is not dispatched to
+// until it is registered with evloop_register_group().
+esp_err_t evloop_group_create(const evloop_group_config_t* cfg, size_t count, evloop_group_t** group)
+{
+    if ((cfg == NULL) || (cfg->states == NULL) || (cfg->index == NULL) || (count == 0) || (group == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const size_t align = sizeof(uint64_t);
+    size_t ctx_size = (cfg->ctx_size + align - 1) & ~(align - 1);
+    size_t hot = (count * (sizeof(sm_state_idx_t) + sizeof(uint8_t)) + align - 1) & ~(align - 1);
+    evloop_group_t* g = calloc(1, sizeof(evloop_group_t) + hot + count * (sizeof(sm_machine_t) + ctx_size));
+    if (g == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    uint8_t* arena = (uint8_t*)(g + 1);
+    g->cfg = *cfg;
+    g->count = count;
+    g->s1 = (sm_state_idx_t*)arena;
+    g->flags = (uint8_t*)(g->s1 + count);
+    g->machines = (sm_machine_t*)(arena + hot);
+    g->ctx = (uint8_t*)(g->machines + count);
+    g->ctx_size = ctx_size;
+    for (size_t i = 0; i < count; i++) {
+        sm_machine_t* machine = &g->machines[i];
+        machine->ctx = (cfg->ctx_size > 0) ? g->ctx + i * ctx_size : NULL;
+        machine->id = cfg->first_id + i;
+        machine->states = cfg->states;
+        machine->sizes = cfg->sizes;
+        machine->event = evNullEvent;
+    }
+    evloop_subscriptions(cfg->index, cfg->sizes, &g->subscribed);
+    *group = g;
+    return ESP_OK;
+}
+
+// void evloop_group_delete(evloop_group_t* group)
+// Description: This function frees a group which is not registered.
+void evloop_group_delete(evloop_group_t* group)
+{
+    free(group);
+}
+
+// esp_err_t evloop_register_group(evloop_group_t* group)
+// Input:
+//  group: group created by evloop_group_create()
+// Output: ESP_OK, ESP_ERR_INVALID_ARG if cfg.loop of the group is not a loop, or ESP_ERR_NO_MEM if
+// CONFIG_EVLOOP_MAX_GROUPS are already registered
+// Description: This function adds a group to the event loop cfg.loop. Every event the machine type has a
+// transition for is then dispatched to all its started instances, or to the one addressed by
+// evloop_post_to(). Registration must be done before evloop_create().
+esp_err_t evloop_register_group(evloop_group_t* group)
+{
+    if (group->cfg.loop >= CONFIG_EVLOOP_LOOPS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (groups_count >= ARRAY_SIZE(groups)) {
+        return ESP_ERR_NO_MEM;
+    }
+    groups[groups_count++] = group;
+
+    evloop_loop_t* lp = &loops[group->cfg.loop];
+    for (int e = 0; e < sm_EVENTS_NUMBER; e++) {
+        if (evloop_mask_has(&group->subscribed, (sm_event_type_t)e)) {
+            lp->group_routes[e][lp->group_routes_count[e]++] = group;
+            event_loops[e] |= 1u << group->cfg.loop;
+        }
+    }
+    return ESP_OK;
+}
+
+// esp_err_t evloop_group_start(evloop_group_t* group, size_t first, size_t n, sm_state_idx_t state)
+// Input:
+//  group: group
+//  first, n: range of instances
+//  state: initial state
+// Output: ESP_OK or ESP_ERR_INVALID_ARG
+// Description: This function sets the state of instances and lets them receive events. Unlike
+// evloop_start_with_event(), no event is posted: one event posted after starting a range of instances
+// reaches all of them.
+esp_err_t evloop_group_start(evloop_group_t* group, size_t first, size_t n, sm_state_idx_t state)
+{
+    if ((first > group->count) || (n > group->count - first) || (state >= group->cfg.sizes)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (size_t i = first; i < first + n; i++) {
+        group->s1[i] = state;
+        group->machines[i].s1 = state;
+        group->flags[i] = EVLOOP_INST_ACTIVE;
+    }
+    return ESP_OK;
+}
+
+// esp_err_t evloop_group_stop(evloop_group_t* group, size_t first, size_t n)
+// Input:
+//  group: group
+//  first, n: range of instances
+// Output: ESP_OK or ESP_ERR_INVALID_ARG
+// Description: This function stops instances. Their states and contexts are kept.
+esp_err_t evloop_group_stop(evloop_group_t* group, size_t first, size_t n)
+{
+    if ((first > group->count) || (n > group->count - first)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (size_t i = first; i < first + n; i++) {
+        group->flags[i] &= ~EVLOOP_INST_ACTIVE;
+    }
+    return ESP_OK;
+}
+
+// void evloop_group_dispatch(evloop_group_t* group, sm_event_type_t event)
+// Input:
+//  group: group
+//  event: event to be processed
+// Output: none
+// Description: This function runs the transitions of all started instances for one event, as the event
+// loop does for a registered group. It must not be called for a registered group from another task than
+// the event loop task.
+void evloop_group_dispatch(evloop_group_t* group, sm_event_type_t event)
+{
+    evloop_group_dispatch_(group, 0, group->count, event, (uint32_t)esp_timer_get_time());
+}
+
+// static uint32_t evloop_group_dispatch_(evloop_group_t* g, size_t first, size_t end, sm_event_type_t event,
+//                                        uint32_t dequeued)
+// Input:
+//  g: group
+//  first, end: range of instances, end excluded
+//  event: event to be processed
+//  dequeued: time the event was taken from the queue, us
+// Output: number of started instances in the range, i.e. the instances the event was delivered to
+// Description: Broadcast sweep. The flags and the states of the instances are read in order from their
+// arrays, and the transition from the dense index; an instance without a transition costs these three
+// loads. Only an instance which takes a transition, or has a lost event tracer, has its sm_machine_t
+// brought up to date and passed to the actions.
+static uint32_t evloop_group_dispatch_(evloop_group_t* g, size_t first, size_t end, sm_event_type_t event, uint32_t dequeued)
+{
+    if ((unsigned)event >= sm_EVENTS_NUMBER) {
+        return 0;
+    }
+
+    evloop_machine_t m = {
+        .index = g->cfg.index,
+        .trace_machine = g->cfg.trace_machine,
+        .trace_context = g->cfg.trace_context,
+        .lost_event = g->cfg.lost_event,
+        .loop = g->cfg.loop,
+        .active = true,
+    };
+    const evloop_index_row_t* index = g->cfg.index;
+    sm_state_idx_t* s1 = g->s1;
+    uint8_t* flags = g->flags;
+    uint32_t lost = 0;
+    uint32_t reached = 0;
+
+    for (size_t i = first; i < end; i++) {
+        if ((flags[i] & EVLOOP_INST_ACTIVE) == 0) {
+            continue;
+        }
+        reached++;
+        const sm_transition_t* tr = index[s1[i]][event];
+        if ((tr == NULL) && (m.lost_event == NULL)) {
+            lost++;
+            continue;
+        }
+
+        sm_machine_t* machine = &g->machines[i];
+        machine->s1 = s1[i];
+        machine->event = event;
+        machine->event_data = NULL;
+        m.machine = machine;
+        if (tr == NULL) {
+            lost++;
+            m.lost_event(machine);
+            continue;
+        }
+        evloop_execute_(&m, tr, event, dequeued);
+        s1[i] = machine->s1;
+    }
+    if (lost > 0) {
+        atomic_fetch_add_explicit(&stat_lost, lost, memory_order_relaxed);
+    }
+    return reached;
+}
+
+// static void evloop_route_(evloop_loop_t* lp, const evloop_item_t* item, uint32_t dequeued)
+// Input:
+//  lp: loop
+//  item: event taken from the queue of the loop
+//  dequeued: time the event was taken from the queue, us
+// Output: none
+// Description: This function dispatches an event along its route in the loop: to the active machines
+// and the started group instances subscribed to it, or to the one of them whose id is item->target. An
+// event which reaches no machine is counted as unrouted, unless it is an event of a burst of
+// evloop_post_events() whose subscribers are on other loops only.
+static void evloop_route_(evloop_loop_t* lp, const evloop_item_t* item, uint32_t dequeued)
+{
+    sm_event_type_t event = item->event;
+    uint16_t target = item->target;
+    uint32_t delivered = 0;
+
+    for (size_t i = 0; i < lp->routes_count[event]; i++) {
+        evloop_machine_t* m = lp->routes[event][i];
+        if (m->active && ((target == EVLOOP_TARGET_ALL) || (m->machine->id == target))) {
+            evloop_dispatch_(m, event, dequeued);
+            delivered++;
+        }
+    }
+    for (size_t i = 0; i < lp->group_routes_count[event]; i++) {
+        evloop_group_t* g = lp->group_routes[event][i];
+        if (target == EVLOOP_TARGET_ALL) {
+            delivered += evloop_group_dispatch_(g, 0, g->count, event, dequeued);
+        }
+        else if ((uint16_t)(target - g->cfg.first_id) < g->count) {
+            size_t k = (uint16_t)(target - g->cfg.first_id);
+            delivered += evloop_group_dispatch_(g, k, k + 1, event, dequeued);
+        }
+    }
+    if (delivered > 0) {
+        atomic_fetch_add_explicit(&stat_delivered, delivered, memory_order_relaxed);
+    }
+    else if ((target != EVLOOP_TARGET_ALL) || (lp->routes_count[event] + lp->group_routes_count[event] > 0)) {
+        atomic_fetch_add_explicit(&stat_unrouted, 1, memory_order_relaxed);
+    }
+}
+
+// static void evloop_task(void* pvParameter)
+// Input:
+//  pvParameter: loop
+// Output: none
+// Description: Task of one loop. It waits for a notification from the producers. On every pass it takes up to
+// CONFIG_EVLOOP_DRAIN_BATCH published events out of the rings, in the order given by evloop_select(),
+// which frees their cells for the producers, and dispatches them back to back along their routes.
+// It waits again only when all rings are empty. An urgent event posted during a batch waits for the
+// rest of the batch only.
+static void evloop_task(void* pvParameter)
+{
+    evloop_loop_t* lp = (evloop_loop_t*)pvParameter;
+    evloop_item_t batch[CONFIG_EVLOOP_DRAIN_BATCH];
+
+    ESP_LOGI(TAG,"Event loop task %d entered",(int)(lp - loops));
+    while (true) {
+        size_t count = 0;
+        while (count < ARRAY_SIZE(batch)) {
+            evloop_ring_t* r = evloop_select(lp);
+            if (r == NULL) {
+                break;
+            }
+            if (evloop_loop_take(lp, r, &batch[count])) {
+                count++;
+            }
+        }
+        if ((count > 0) && (atomic_load_explicit(&lp->space_waiters, memory_order_acquire) > 0)) {
+            evloop_space_give(lp);
+        }
+        if (count == 0) {
+            evloop_wait(lp);
+            atomic_fetch_add_explicit(&stat_wakeups, 1, memory_order_relaxed);
+            continue;
+        }
+        atomic_fetch_add_explicit(&stat_batches, 1, memory_order_relaxed);
+
+        uint32_t dequeued = 0;
+#if defined(CONFIG_EVLOOP_LATENCY)
+        dequeued = (uint32_t)esp_timer_get_time();
+#endif  // defined(CONFIG_EVLOOP_LATENCY)
+        for (size_t k = 0; k < count; k++) {
+#if defined(CONFIG_EVLOOP_LATENCY)
+            evlat_record(lp - loops, batch[k].event, EVLAT_WAIT, dequeued - batch[k].posted);
+#endif  // defined(CONFIG_EVLOOP_LATENCY)
+            evloop_route_(lp, &batch[k], dequeued);
+            atomic_fetch_add_explicit(&stat_dispatched, 1, memory_order_relaxed);
+        }
+    }
+}
+
+#if defined(CONFIG_EVLOOP_PTHREADS)
+static void* evloop_thread(void* arg)
+{
+    evloop_task(arg);
+    return NULL;
+}
+#endif  // defined(CONFIG_EVLOOP_PTHREADS)
+
+// esp_err_t evloop_get_prio_stats(sm_event_prio_t prio, evloop_prio_stats_t* stats)
+// Input:
+//  prio: priority level
+//  stats: pointer to a variable where the counters to be written
+// Output: ESP_OK or ESP_ERR_INVALID_ARG
+// Description: This function returns the occupancy and the counters of the queues of one priority level,
+// summed over the loops; high_water is the highest of the loops.
+esp_err_t evloop_get_prio_stats(sm_event_prio_t prio, evloop_prio_stats_t* stats)
+{
+    if (((unsigned)prio >= EV_PRIO_LEVELS) || (stats == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(stats, 0, sizeof(*stats));
+    for (size_t l = 0; l < CONFIG_EVLOOP_LOOPS; l++) {
+        evloop_ring_t* r = &loops[l].rings[prio];
+        stats->posted += atomic_load_explicit(&r->posted, memory_order_relaxed);
+        stats->dropped += atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        stats->waiting += atomic_load_explicit(&r->head, memory_order_relaxed) - atomic_load_explicit(&r->tail, memory_order_relaxed);
+        if (r->high_water > stats->high_water) {
+            stats->high_water = r->high_water;
+        }
+        stats->promoted += r->promoted;
+    }
+    return ESP_OK;
+}
+
+// esp_err_t evloop_get_event_stats(sm_event_type_t event, evloop_event_stats_t* stats)
+// Input:
+//  event: event type
+//  stats: pointer to a variable where the counters to be written
+// Output: ESP_OK or ESP_ERR_INVALID_ARG
+// Description: This function returns the counters of the overflow handling of one event type.
+esp_err_t evloop_get_event_stats(sm_event_type_t event, evloop_event_stats_t* stats)
+{
+    if (((unsigned)event >= sm_EVENTS_NUMBER) || (stats == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    evloop_event_counters_t* c = &event_counters[event];
+    stats->posted = atomic_load_explicit(&c->posted, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&c->dropped, memory_order_relaxed);
+    stats->coalesced = atomic_load_explicit(&c->coalesced, memory_order_relaxed);
+    stats->evicted = atomic_load_explicit(&c->evicted, memory_order_relaxed);
+    stats->blocked = atomic_load_explicit(&c->blocked, memory_order_relaxed);
+    stats->timeouts = atomic_load_explicit(&c->timeouts, memory_order_relaxed);
+    return ESP_OK;
+}
+
+// void evloop_get_stats(evloop_stats_t* stats)
+// Input:
+//  stats: pointer to a variable where the counters to be written
+// Output: none
+// Description: This function returns the counters of the event loop.
+void evloop_get_stats(evloop_stats_t* stats)
+{
+    stats->posted = atomic_load_explicit(&stat_posted, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&stat_dropped, memory_order_relaxed);
+    stats->dispatched = atomic_load_explicit(&stat_dispatched, memory_order_relaxed);
+    stats->transitions = atomic_load_explicit(&stat_transitions, memory_order_relaxed);
+    stats->lost = atomic_load_explicit(&stat_lost, memory_order_relaxed);
+    stats->wakeups = atomic_load_explicit(&stat_wakeups, memory_order_relaxed);
+    stats->batches = atomic_load_explicit(&stat_batches, memory_order_relaxed);
+    stats->coalesced = atomic_load_explicit(&stat_coalesced, memory_order_relaxed);
+    stats->evicted = atomic_load_explicit(&stat_evicted, memory_order_relaxed);
+    stats->delivered = atomic_load_explicit(&stat_delivered, memory_order_relaxed);
+    stats->unrouted = atomic_load_explicit(&stat_unrouted, memory_order_relaxed);
+}
+
+// end of evloop.c
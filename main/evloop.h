@@ -0,0 +1,186 @@
+// evloop.h
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+#include "freertos/FreeRTOS.h"
+#include "state_machine.h"
+
+// Application event loop. It replaces the loop of the state_machine component: events are queued by
+// evloop_post() or, from ISRs, by evloop_post_from_isr() in lock-free rings and dispatched by the loop tasks
+// to the registered machines. Every event has a priority level, given in EVENT_LIST; each level has its own
+// ring and the higher levels are served first, see CONFIG_EVLOOP_STARVATION_LIMIT. The transition for (s1, event)
+// is found in a dense [state][event] index compiled from the transition tables, so the lookup is a
+// single indexed load instead of a linear scan of the transitions of s1. What a post to a full queue
+// does is the overflow policy of the event, also given in EVENT_LIST. A machine receives only the events
+// it has a transition for, its subscriptions, computed from its index at registration; an event can
+// also be addressed to one machine with evloop_post_to().
+// There are CONFIG_EVLOOP_LOOPS loops, one task per core. A machine runs in the loop given by its loop
+// field, so its transitions still run to completion; events cross loops through the lock-free rings.
+
+// Return codes of evloop_post() besides the ESP ones
+#define ESP_ERR_EVLOOP_BASE         (0x10000)
+#define ESP_ERR_EVLOOP_COALESCED    (ESP_ERR_EVLOOP_BASE + 1)   // merged with the queued instance
+#define ESP_ERR_EVLOOP_REPLACED     (ESP_ERR_EVLOOP_BASE + 2)   // queued, the oldest event was discarded
+
+// Target of evloop_post_to(): every machine subscribed to the event
+#define EVLOOP_TARGET_ALL           (0xFFFFu)
+
+// Dense index: index[s][e] points to the transition taken on event e in state s, NULL if there is none.
+typedef const sm_transition_t* const evloop_index_row_t[sm_EVENTS_NUMBER];
+
+// Dispatch method of the timers whose callbacks post events, see CONFIG_EVLOOP_TIMER_ISR_DISPATCH
+#if defined(CONFIG_EVLOOP_TIMER_ISR_DISPATCH)
+#define EVLOOP_TIMER_DISPATCH   ESP_TIMER_ISR
+#else
+#define EVLOOP_TIMER_DISPATCH   ESP_TIMER_TASK
+#endif  // defined(CONFIG_EVLOOP_TIMER_ISR_DISPATCH)
+
+// Set of events, one bit per event of EVENT_LIST
+#define EVLOOP_MASK_WORDS   ((sm_EVENTS_NUMBER + 31) / 32)
+
+typedef struct {
+    uint32_t bits[EVLOOP_MASK_WORDS];
+} evloop_event_mask_t;
+
+static inline void evloop_mask_set(evloop_event_mask_t* mask, sm_event_type_t event)
+{
+    mask->bits[event / 32] |= 1u << (event % 32);
+}
+
+static inline bool evloop_mask_has(const evloop_event_mask_t* mask, sm_event_type_t event)
+{
+    return (mask->bits[event / 32] & (1u << (event % 32))) != 0;
+}
+
+// uint32_t evloop_action_index(const evloop_index_row_t* index, const sm_machine_t* machine)
+// Description: Action index (sm_transition_t.actidx) of the transition being executed, for actions which
+// are one executor with their parameters in a const table indexed by it. Valid in a transition action
+// only: s1 is then still the source state and event the event being processed.
+static inline uint32_t evloop_action_index(const evloop_index_row_t* index, const sm_machine_t* machine)
+{
+    return index[machine->s1][machine->event]->actidx;
+}
+
+typedef void (*evloop_trace_machine_t)(sm_machine_t* machine, const sm_transition_t* tr);
+typedef void (*evloop_trace_context_t)(sm_machine_t* machine, bool when);
+typedef void (*evloop_lost_event_t)(sm_machine_t* machine);
+
+typedef struct {
+    sm_machine_t* machine;
+    const evloop_index_row_t* index;        // sm_machine_t.sizes rows
+    evloop_trace_machine_t trace_machine;   // tracers, NULL to disable
+    evloop_trace_context_t trace_context;
+    evloop_lost_event_t lost_event;
+    evloop_event_mask_t subscribed;         // events dispatched to the machine, see evloop_register()
+    uint8_t loop;                           // affinity: loop, and core, running the machine
+    volatile bool active;
+} evloop_machine_t;
+
+// Group of instances of one machine type, see evloop_group_create(). The instances share the transition
+// tables, the dense index and the tracers; each one has its own sm_machine_t and context.
+typedef struct {
+    const sm_state_t* states;
+    size_t sizes;
+    const evloop_index_row_t* index;
+    size_t ctx_size;                        // bytes of the context of one instance, 0 for none
+    uint16_t first_id;                      // sm_machine_t.id of instance 0; instance i has first_id + i
+    uint8_t loop;                           // affinity: loop running all instances
+    evloop_trace_machine_t trace_machine;   // tracers, NULL to disable
+    evloop_trace_context_t trace_context;
+    evloop_lost_event_t lost_event;
+} evloop_group_config_t;
+
+#define EVLOOP_INST_ACTIVE  (0x01)          // flag of a started instance
+
+typedef struct {
+    evloop_group_config_t cfg;
+    size_t count;
+    sm_state_idx_t* s1;                     // current state of every instance
+    uint8_t* flags;                         // EVLOOP_INST_* of every instance
+    sm_machine_t* machines;
+    uint8_t* ctx;                           // count contexts of ctx_size bytes
+    size_t ctx_size;                        // cfg.ctx_size rounded up for alignment
+    evloop_event_mask_t subscribed;         // events with a transition in cfg.index
+} evloop_group_t;
+
+static inline sm_machine_t* evloop_group_machine(evloop_group_t* group, size_t i)
+{
+    return &group->machines[i];
+}
+
+static inline void* evloop_group_ctx(evloop_group_t* group, size_t i)
+{
+    return group->machines[i].ctx;
+}
+
+// Counters of the event loop. See evloop_get_stats().
+typedef struct {
+    uint32_t posted;        // events accepted by evloop_post(); posted = dispatched + evicted + queued
+    uint32_t dropped;       // events rejected because the queue was full
+    uint32_t dispatched;    // events taken from the queue and dispatched along their routes
+    uint32_t transitions;   // permitted transitions executed
+    uint32_t lost;          // events delivered to a machine without a transition in its current state
+    uint32_t wakeups;       // times the loop task was woken from its wait, i.e. context switches to it
+    uint32_t batches;       // groups of up to CONFIG_EVLOOP_DRAIN_BATCH events taken out of the queue
+    uint32_t coalesced;     // posts merged with a queued instance of the event (EV_OVF_COALESCE)
+    uint32_t evicted;       // queued events discarded to make room (EV_OVF_REPLACE_OLDEST)
+    uint32_t delivered;     // dispatches to machines and group instances subscribed to the events
+    uint32_t unrouted;      // events dispatched which reached no machine
+} evloop_stats_t;
+
+// Counters of the queue of one priority level. See evloop_get_prio_stats().
+typedef struct {
+    uint32_t posted;        // events accepted
+    uint32_t dropped;       // events rejected because the queue of the level was full
+    uint32_t waiting;       // events waiting now
+    uint32_t high_water;    // maximal number of events seen waiting
+    uint32_t promoted;      // events served ahead of higher levels by the starvation bound
+} evloop_prio_stats_t;
+
+// Counters of one event type. See evloop_get_event_stats().
+typedef struct {
+    uint32_t posted;        // instances accepted
+    uint32_t dropped;       // instances rejected, including the timeouts
+    uint32_t coalesced;     // posts merged with a queued instance
+    uint32_t evicted;       // queued instances discarded to make room for a replace-oldest event
+    uint32_t blocked;       // posts which waited for room
+    uint32_t timeouts;      // waits which expired
+} evloop_event_stats_t;
+
+esp_err_t evloop_register(evloop_machine_t* m);
+esp_err_t evloop_create(void);
+esp_err_t evloop_post(sm_event_type_t event);
+esp_err_t evloop_post_from_isr(sm_event_type_t event, BaseType_t* woken);
+esp_err_t evloop_post_to(uint16_t target, sm_event_type_t event);
+esp_err_t evloop_post_to_from_isr(uint16_t target, sm_event_type_t event, BaseType_t* woken);
+esp_err_t evloop_post_events(const sm_event_type_t* events, size_t n);
+esp_err_t evloop_group_create(const evloop_group_config_t* cfg, size_t count, evloop_group_t** group);
+void evloop_group_delete(evloop_group_t* group);
+esp_err_t evloop_register_group(evloop_group_t* group);
+esp_err_t evloop_group_start(evloop_group_t* group, size_t first, size_t n, sm_state_idx_t state);
+esp_err_t evloop_group_stop(evloop_group_t* group, size_t first, size_t n);
+void evloop_group_dispatch(evloop_group_t* group, sm_event_type_t event);
+esp_err_t evloop_start_with_event(evloop_machine_t* m, sm_state_idx_t state, sm_event_type_t event);
+void evloop_start(evloop_machine_t* m, sm_state_idx_t state);
+void evloop_stop(evloop_machine_t* m);
+void evloop_dispatch(evloop_machine_t* m, sm_event_type_t event);
+void evloop_get_stats(evloop_stats_t* stats);
+esp_err_t evloop_get_prio_stats(sm_event_prio_t prio, evloop_prio_stats_t* stats);
+esp_err_t evloop_get_event_stats(sm_event_type_t event, evloop_event_stats_t* stats);
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of evloop.h
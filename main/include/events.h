@@ -6,16 +6,35 @@
 extern "C" {
 #endif
 
+// Priority levels of the events. The event loop serves higher levels first.
+typedef enum {
+    EV_PRIO_HIGH = 0,       // user input
+    EV_PRIO_NORMAL,         // internal sequencing
+    EV_PRIO_LOW,            // periodic ticks
+    EV_PRIO_LEVELS
+} sm_event_prio_t;
+
+// What a post does when the queue of the priority level of the event is full. See evloop_post().
+typedef enum {
+    EV_OVF_DROP = 0,        // the new event is rejected
+    EV_OVF_COALESCE,        // idempotent event: at most one instance is queued, later posts merge with it
+    EV_OVF_REPLACE_OLDEST,  // the oldest event of the level is discarded to make room
+    EV_OVF_BLOCK,           // the producer task waits for room, see CONFIG_EVLOOP_BLOCK_TIMEOUT_MS
+} sm_event_overflow_t;
+
+// X(event, priority, overflow policy)
 #define EVENT_LIST \
-    X(evNullEvent) \
-    X(evP1Start) \
-    X(evP1Trigger1) X(evP1Trigger2) X(evP1Trigger3) X(evP1Trigger4) X(evP1Trigger5) \
-    X(evButtonSingleClick) \
-    X(ev_t_blink_changer_tick) \
+    X(evNullEvent, EV_PRIO_NORMAL, EV_OVF_DROP) \
+    X(evP1Start, EV_PRIO_NORMAL, EV_OVF_DROP) \
+    X(evP1Trigger1, EV_PRIO_NORMAL, EV_OVF_DROP) X(evP1Trigger2, EV_PRIO_NORMAL, EV_OVF_DROP) \
+    X(evP1Trigger3, EV_PRIO_NORMAL, EV_OVF_DROP) X(evP1Trigger4, EV_PRIO_NORMAL, EV_OVF_DROP) \
+    X(evP1Trigger5, EV_PRIO_NORMAL, EV_OVF_DROP) \
+    X(evButtonSingleClick, EV_PRIO_HIGH, EV_OVF_BLOCK) \
+    X(ev_t_blink_changer_tick, EV_PRIO_LOW, EV_OVF_COALESCE) \
 
 // Generate the enum automatically
 typedef enum {
-    #define X(name) name,
+    #define X(name, ...) name,
     EVENT_LIST
     #undef X
     sm_EVENTS_NUMBER  // Total count of events
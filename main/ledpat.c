@@ -0,0 +1,301 @@
+// ledpat.c
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#if defined(CONFIG_LEDPAT_BACKEND_RMT)
+#include "driver/rmt_tx.h"
+#endif  // defined(CONFIG_LEDPAT_BACKEND_RMT)
+
+#include "commondefs.h"
+#include "ledpat.h"
+
+static const char TAG[] = "LEDPAT";
+
+#define LEDPAT_MAX_HALF     (0x7FFFu)                       // longest half symbol, units
+#define LEDPAT_MS_UNITS     (LEDPAT_RESOLUTION_HZ / 1000)   // units per ms
+
+_Static_assert(LEDPAT_RESOLUTION_HZ % 1000 == 0, "LEDPAT_RESOLUTION_HZ must be a multiple of 1 kHz");
+
+typedef struct {
+    ledpat_symbol_t symbols[LEDPAT_MAX_SYMBOLS];
+    uint32_t count;             // symbols in use
+    uint32_t period;            // duration of the table, units
+    uint32_t edges;             // level changes per table
+    uint32_t updates;
+#if defined(CONFIG_LEDPAT_BACKEND_RMT)
+    rmt_channel_handle_t channel;
+    rmt_encoder_handle_t encoder;
+#endif  // defined(CONFIG_LEDPAT_BACKEND_RMT)
+#if defined(CONFIG_LEDPAT_BACKEND_MOCK)
+    int64_t start_us;           // time the current pattern was started
+#endif  // defined(CONFIG_LEDPAT_BACKEND_MOCK)
+} ledpat_channel_t;
+
+static ledpat_channel_t leds[CONFIG_LEDPAT_MAX_LEDS];
+static int leds_count = 0;
+
+// static bool ledpat_emit(ledpat_symbol_t* symbols, uint32_t* halves, bool on, uint32_t units)
+// Input:
+//  symbols: table
+//  halves: number of halves written so far, updated
+//  on: level
+//  units: duration; 0 writes nothing
+// Output: false if the table is full
+// Description: This function appends one level to the table, split in halves of up to LEDPAT_MAX_HALF.
+static bool ledpat_emit(ledpat_symbol_t* symbols, uint32_t* halves, bool on, uint32_t units)
+{
+    while (units > 0) {
+        uint32_t d = (units > LEDPAT_MAX_HALF) ? LEDPAT_MAX_HALF : units;
+        uint32_t h = *halves;
+        if (h >= 2 * LEDPAT_MAX_SYMBOLS) {
+            return false;
+        }
+        if ((h & 1) == 0) {
+            symbols[h / 2].duration0 = d;
+            symbols[h / 2].level0 = on;
+        }
+        else {
+            symbols[h / 2].duration1 = d;
+            symbols[h / 2].level1 = on;
+        }
+        *halves = h + 1;
+        units -= d;
+    }
+    return true;
+}
+
+// static esp_err_t ledpat_compile(ledpat_channel_t* ch, const ledpat_step_t* steps, size_t count)
+// Input:
+//  ch: LED
+//  steps: pattern
+//  count: number of steps
+// Output: ESP_OK, ESP_ERR_INVALID_ARG if the pattern has no duration, ESP_ERR_INVALID_SIZE if it does not
+// fit in LEDPAT_MAX_SYMBOLS
+// Description: This function compiles a pattern into the symbol table of the LED. A symbol has two halves,
+// so a pattern with an odd number of halves is written twice; repeated forever, it is the same signal.
+static esp_err_t ledpat_compile(ledpat_channel_t* ch, const ledpat_step_t* steps, size_t count)
+{
+    uint32_t halves = 0;
+
+    memset(ch->symbols, 0, sizeof(ch->symbols));
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < count; i++) {
+            if (!ledpat_emit(ch->symbols, &halves, true, steps[i].on_ms * LEDPAT_MS_UNITS) ||
+                !ledpat_emit(ch->symbols, &halves, false, steps[i].off_ms * LEDPAT_MS_UNITS)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+        }
+        if ((halves == 0) || ((halves & 1) == 0)) {
+            break;
+        }
+    }
+    if (halves == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    ch->count = halves / 2;
+    ch->period = 0;
+    ch->edges = 0;
+    for (uint32_t i = 0; i < ch->count; i++) {
+        const ledpat_symbol_t* next = &ch->symbols[(i + 1) % ch->count];
+        ch->period += ch->symbols[i].duration0 + ch->symbols[i].duration1;
+        ch->edges += (ch->symbols[i].level0 != ch->symbols[i].level1) + (ch->symbols[i].level1 != next->level0);
+    }
+    return ESP_OK;
+}
+
+#if defined(CONFIG_LEDPAT_BACKEND_RMT)
+
+static esp_err_t ledpat_backend_add(ledpat_channel_t* ch, int gpio, int active_level)
+{
+    rmt_tx_channel_config_t tx_cfg = {
+        .gpio_num = gpio,
+        .clk_src = RMT_CLK_SRC_XTAL,
+        .resolution_hz = LEDPAT_RESOLUTION_HZ,
+        .mem_block_symbols = LEDPAT_MAX_SYMBOLS + 1,
+        .trans_queue_depth = 1,
+        .flags.invert_out = (active_level == 0),
+    };
+    rmt_copy_encoder_config_t enc_cfg = {};
+
+    esp_err_t ret = rmt_new_tx_channel(&tx_cfg, &ch->channel);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = rmt_new_copy_encoder(&enc_cfg, &ch->encoder);
+    if (ret != ESP_OK) {
+        rmt_del_channel(ch->channel);
+    }
+    return ret;
+}
+
+// The looped transmission is stopped by disabling the channel; the table is written only while the
+// channel does not read it. A channel which was never started is not enabled yet.
+static esp_err_t ledpat_backend_stop(ledpat_channel_t* ch)
+{
+    esp_err_t ret = rmt_disable(ch->channel);
+    return (ret == ESP_ERR_INVALID_STATE) ? ESP_OK : ret;
+}
+
+static esp_err_t ledpat_backend_start(ledpat_channel_t* ch)
+{
+    rmt_transmit_config_t tx_cfg = {
+        .loop_count = -1,
+        .flags.eot_level = 0,
+    };
+
+    esp_err_t ret = rmt_enable(ch->channel);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    return rmt_transmit(ch->channel, ch->encoder, ch->symbols, ch->count * sizeof(ch->symbols[0]), &tx_cfg);
+}
+
+#endif  // defined(CONFIG_LEDPAT_BACKEND_RMT)
+
+#if defined(CONFIG_LEDPAT_BACKEND_MOCK)
+
+static esp_err_t ledpat_backend_add(ledpat_channel_t* ch, int gpio, int active_level)
+{
+    return ESP_OK;
+}
+
+static esp_err_t ledpat_backend_stop(ledpat_channel_t* ch)
+{
+    return ESP_OK;
+}
+
+static esp_err_t ledpat_backend_start(ledpat_channel_t* ch)
+{
+    ch->start_us = esp_timer_get_time();
+    return ESP_OK;
+}
+
+// int ledpat_mock_level(ledpat_led_t led, int64_t time_us)
+// Input:
+//  led: LED
+//  time_us: time, in esp_timer_get_time() units
+// Output: 1 if the LED is on at time_us, 0 if it is off, -1 if led is not valid
+// Description: This function plays the symbol table of the current pattern as RMT would, from the time
+// the pattern was set.
+int ledpat_mock_level(ledpat_led_t led, int64_t time_us)
+{
+    if ((led < 0) || (led >= leds_count)) {
+        return -1;
+    }
+    ledpat_channel_t* ch = &leds[led];
+    if (ch->count == 0) {
+        return 0;
+    }
+    int64_t elapsed = (time_us > ch->start_us) ? time_us - ch->start_us : 0;
+    uint32_t t = (uint32_t)((elapsed * LEDPAT_MS_UNITS / 1000) % ch->period);
+
+    for (uint32_t i = 0; ; i = (i + 1) % ch->count) {
+        if (t < ch->symbols[i].duration0) {
+            return ch->symbols[i].level0;
+        }
+        t -= ch->symbols[i].duration0;
+        if (t < ch->symbols[i].duration1) {
+            return ch->symbols[i].level1;
+        }
+        t -= ch->symbols[i].duration1;
+    }
+}
+
+#endif  // defined(CONFIG_LEDPAT_BACKEND_MOCK)
+
+// esp_err_t ledpat_add(int gpio, int active_level, ledpat_led_t* led)
+// Input:
+//  gpio: GPIO of the LED
+//  active_level: level which turns the LED on
+//  led: pointer to a variable where the LED handle to be written
+// Output: ESP_OK, ESP_ERR_NO_MEM if CONFIG_LEDPAT_MAX_LEDS are already added, or the error of the backend
+// Description: This function assigns a backend channel to a LED. The LED stays off until a pattern is set.
+esp_err_t ledpat_add(int gpio, int active_level, ledpat_led_t* led)
+{
+    if (led == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (leds_count >= CONFIG_LEDPAT_MAX_LEDS) {
+        return ESP_ERR_NO_MEM;
+    }
+    ledpat_channel_t* ch = &leds[leds_count];
+    esp_err_t ret = ledpat_backend_add(ch, gpio, active_level);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "LED on GPIO %d: %s", gpio, esp_err_to_name(ret));
+        return ret;
+    }
+    *led = leds_count++;
+    return ESP_OK;
+}
+
+// esp_err_t ledpat_set(ledpat_led_t led, const ledpat_step_t* steps, size_t count)
+// Input:
+//  led: LED
+//  steps: pattern, repeated until the next call
+//  count: number of steps
+// Output: ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_INVALID_SIZE if the pattern is too long, or the error of
+// the backend
+// Description: This function replaces the pattern of a LED. It is the only point where the CPU works for
+// the LED. It must not be called for the same LED from two tasks at once.
+esp_err_t ledpat_set(ledpat_led_t led, const ledpat_step_t* steps, size_t count)
+{
+    if ((led < 0) || (led >= leds_count) || (steps == NULL) || (count == 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ledpat_channel_t* ch = &leds[led];
+
+    esp_err_t ret = ledpat_backend_stop(ch);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    ret = ledpat_compile(ch, steps, count);
+    if (ret != ESP_OK) {
+        ch->count = 0;
+        return ret;
+    }
+    ch->updates++;
+    return ledpat_backend_start(ch);
+}
+
+// esp_err_t ledpat_set_level(ledpat_led_t led, bool on)
+// Input:
+//  led: LED
+//  on: true to keep the LED on, false to keep it off
+// Output: see ledpat_set()
+// Description: This function sets a constant level, as a pattern of one level.
+esp_err_t ledpat_set_level(ledpat_led_t led, bool on)
+{
+    const ledpat_step_t step = { .on_ms = on ? 200 : 0, .off_ms = on ? 0 : 200 };
+    return ledpat_set(led, &step, 1);
+}
+
+// esp_err_t ledpat_get_stats(ledpat_led_t led, ledpat_stats_t* stats)
+// Input:
+//  led: LED
+//  stats: pointer to a variable where the counters to be written
+// Output: ESP_OK or ESP_ERR_INVALID_ARG
+// Description: This function returns the counters of a LED. edges per period_ms is the rate of the
+// interrupts a timer driven LED would take for the same pattern. period_ms may be twice the period of
+// the pattern, see ledpat_compile().
+esp_err_t ledpat_get_stats(ledpat_led_t led, ledpat_stats_t* stats)
+{
+    if ((led < 0) || (led >= leds_count) || (stats == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ledpat_channel_t* ch = &leds[led];
+    stats->updates = ch->updates;
+    stats->symbols = ch->count;
+    stats->period_ms = ch->period / LEDPAT_MS_UNITS;
+    stats->edges = ch->edges;
+    return ESP_OK;
+}
+
+// end of ledpat.c
@@ -0,0 +1,71 @@
+// ledpat.h
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <esp_err.h>
+
+// LED pattern engine. A pattern is a sequence of on/off steps repeated forever. It is compiled once into
+// a table of level/duration symbols and played by the hardware, so the CPU does no work per LED edge:
+//  CONFIG_LEDPAT_BACKEND_RMT: every LED is one RMT TX channel transmitting the table in an infinite loop.
+//  CONFIG_LEDPAT_BACKEND_MOCK: the table is kept in RAM and the level at any time is computed from it
+//  by ledpat_mock_level(), so the patterns can be checked on the linux target.
+// The CPU is involved only when a pattern is changed by ledpat_set().
+
+// Time unit of the symbols, 6.25 us: the 40 MHz XTAL divided by the 8 bit channel divider of RMT. A half
+// symbol lasts up to 32767 units, 204 ms; longer steps take several halves.
+#define LEDPAT_RESOLUTION_HZ    (160000)
+// Symbols per LED: one RMT memory block of ESP32-S3 less the end marker. A looped transmission must fit
+// in the memory block of the channel.
+#define LEDPAT_MAX_SYMBOLS      (47)
+
+typedef int ledpat_led_t;
+
+// One step of a pattern: the LED is on for on_ms, then off for off_ms. Zero durations are allowed,
+// e.g. { 1000, 0 } keeps the LED on, but not both in all steps.
+typedef struct {
+    uint16_t on_ms;
+    uint16_t off_ms;
+} ledpat_step_t;
+
+// Symbol of the compiled table, bit compatible with rmt_symbol_word_t: two halves of a level and a
+// duration in 1 / LEDPAT_RESOLUTION_HZ units. A duration of 0 ends the table.
+typedef union {
+    struct {
+        uint16_t duration0 : 15;
+        uint16_t level0 : 1;
+        uint16_t duration1 : 15;
+        uint16_t level1 : 1;
+    };
+    uint32_t val;
+} ledpat_symbol_t;
+
+typedef struct {
+    uint32_t updates;       // patterns set, i.e. times the CPU touched the LED
+    uint32_t symbols;       // symbols of the current pattern
+    uint32_t period_ms;     // period of the current pattern
+    uint32_t edges;         // level changes per period of the current pattern
+} ledpat_stats_t;
+
+esp_err_t ledpat_add(int gpio, int active_level, ledpat_led_t* led);
+esp_err_t ledpat_set(ledpat_led_t led, const ledpat_step_t* steps, size_t count);
+esp_err_t ledpat_set_level(ledpat_led_t led, bool on);
+esp_err_t ledpat_get_stats(ledpat_led_t led, ledpat_stats_t* stats);
+
+#if defined(CONFIG_LEDPAT_BACKEND_MOCK)
+int ledpat_mock_level(ledpat_led_t led, int64_t time_us);   // 1: on, 0: off, -1: invalid LED
+#endif  // defined(CONFIG_LEDPAT_BACKEND_MOCK)
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of ledpat.h
@@ -7,42 +7,196 @@
 #include "sdkconfig.h"
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
 
 #include "commondefs.h"
 #include "state_machine.h"
 #include "process.h"
+#include "evloop.h"
 #include "anvs.h"
 #include "proc.h"
+#include "twheel.h"
+#include "boottl.h"
+#include "rtcstate.h"
+#if defined(CONFIG_SM_TRACE_BINARY)
+#include "smtrace.h"
+#endif  // defined(CONFIG_SM_TRACE_BINARY)
+#if defined(CONFIG_SM_RECORD)
+#include "smrec.h"
+#endif  // defined(CONFIG_SM_RECORD)
+#if defined(CONFIG_APP_LIGHT_SLEEP)
+#include "esp_pm.h"
+#endif  // defined(CONFIG_APP_LIGHT_SLEEP)
 
 static char TAG[] = "APP";
 
+#if defined(CONFIG_ANVS_BOOT_DUMP)
+#define APP_BOOT_DUMP   (true)
+#else
+#define APP_BOOT_DUMP   (false)
+#endif  // defined(CONFIG_ANVS_BOOT_DUMP)
+
+// static esp_err_t app_storage_init(void)
+// Input: none
+// Output: ESP error code
+// Description: This function initializes NVS and loads appstore in a single pass, initializing it if it
+// does not exist. The values are left in the anvs cache, so P1 reads the operative mode from RAM.
+static esp_err_t app_storage_init(void)
+{
+    esp_err_t ret = anvs_initialize();
+    boottl_mark(BOOTTL_NVS_READY);
+    if (ret == ESP_OK) {
+        ret = anvs_load_appstore(APP_BOOT_DUMP);
+    }
+    boottl_mark(BOOTTL_APPSTORE_LOADED);
+    return ret;
+}
+
+#if defined(CONFIG_APP_LIGHT_SLEEP)
+
+// static void app_light_sleep_init(void)
+// Input: none
+// Output: none
+// Description: This function lets the CPU frequency drop to XTAL and the chip enter light sleep when idle.
+// The button wakes it, see btnin.h; the timers of esp_timer and the twheel wake it at their expiry.
+static void app_light_sleep_init(void)
+{
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_XTAL_FREQ,
+        .light_sleep_enable = true,
+    };
+    esp_err_t ret = esp_pm_configure(&pm_config);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG,"Light sleep is not enabled: %s",esp_err_to_name(ret));
+    }
+}
+
+#endif  // defined(CONFIG_APP_LIGHT_SLEEP)
+
+#if defined(CONFIG_FAST_BOOT)
+
+#define APP_BOOT_NVS_STACK_SIZE (4096)
+
+static SemaphoreHandle_t storage_ready;
+static esp_err_t storage_result;
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+static StaticSemaphore_t storage_ready_buffer;
+static StackType_t storage_task_stack[APP_BOOT_NVS_STACK_SIZE];
+static StaticTask_t storage_task_tcb;
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+
+// static void storage_init_task(void* pvParameter)
+// Input: none
+// Output: none
+// Description: This task runs app_storage_init() on the second core while app_main sets up the
+// peripherals, then signals storage_ready and exits.
+static void storage_init_task(void* pvParameter)
+{
+    storage_result = app_storage_init();
+    xSemaphoreGive(storage_ready);
+    vTaskDelete(NULL);
+}
+
+// static void storage_wait(void)
+// Input: none
+// Output: none
+// Description: This function waits for storage_init_task() and logs its result.
+static void storage_wait(void)
+{
+    if (storage_ready != NULL) {
+        xSemaphoreTake(storage_ready, portMAX_DELAY);
+        vSemaphoreDelete(storage_ready);
+        storage_ready = NULL;
+    }
+    if (storage_result != ESP_OK) {
+        ESP_LOGE(TAG,"appstore is not available: %s",esp_err_to_name(storage_result));
+    }
+}
+
+#endif  // defined(CONFIG_FAST_BOOT)
+
 // Application main
 void app_main(void)
 {
     esp_err_t ret;
 
+    boottl_mark(BOOTTL_APP_MAIN);
     ESP_LOGI(TAG,"Application version: %s",CONFIG_APP_PROJECT_VER);
 
-    /* Initialize NVS. */
-    ret = anvs_initialize();
-    if (ret == ESP_OK) {
-        ret = anvs_check_appstore();
-        if (ret == ESP_ERR_NVS_NOT_FOUND) {
-            ret = anvs_init_appstore();
+#if defined(CONFIG_FAST_BOOT)
+    // NVS on the second core, peripherals and registration here; P1 waits for both, unless it resumes from
+    // RTC memory. anvs_prepare() lets P1 write the mode before NVS is ready.
+    anvs_prepare();
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+    storage_ready = xSemaphoreCreateBinaryStatic(&storage_ready_buffer);
+    if ((storage_ready == NULL) ||
+        (xTaskCreateStaticPinnedToCore(storage_init_task, "Boot_NVS", APP_BOOT_NVS_STACK_SIZE, NULL, 5,
+                                       storage_task_stack, &storage_task_tcb, portNUM_PROCESSORS - 1) == NULL)) {
+#else
+    storage_ready = xSemaphoreCreateBinary();
+    if ((storage_ready == NULL) ||
+        (xTaskCreatePinnedToCore(storage_init_task, "Boot_NVS", APP_BOOT_NVS_STACK_SIZE, NULL, 5, NULL, portNUM_PROCESSORS - 1) != pdPASS)) {
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+        ESP_LOGE(TAG,"Cannot start the storage task, initializing NVS here");
+        storage_result = app_storage_init();
+        if (storage_ready != NULL) {
+            xSemaphoreGive(storage_ready);
         }
     }
+#else
+    ret = app_storage_init();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG,"appstore is not available: %s",esp_err_to_name(ret));
+    }
+#endif  // defined(CONFIG_FAST_BOOT)
 
-    ret = anvs_dump_appstore();
-
+#if defined(CONFIG_APP_LIGHT_SLEEP)
+    app_light_sleep_init();
+#endif  // defined(CONFIG_APP_LIGHT_SLEEP)
     init_button();
     init_led_blinking();
+    twheel_init();
+    boottl_mark(BOOTTL_PERIPHERALS_READY);
+
+#if defined(CONFIG_SM_TRACE_BINARY)
+    smtrace_init();
+#endif  // defined(CONFIG_SM_TRACE_BINARY)
+#if defined(CONFIG_SM_RECORD)
+    smrec_init();
+    smrec_start();
+#endif  // defined(CONFIG_SM_RECORD)
 
     if ((ret = register_state_machines()) != ESP_OK) {
         ESP_LOGI(TAG,"Not all state machines are registered : %d. This is implementation error",ret);
     }
-    sm_create_event_loop();
+    boottl_mark(BOOTTL_MACHINES_READY);
+#if defined(CONFIG_EVLOOP_DISPATCH_BENCHMARK)
+    P1_benchmark_dispatch();
+#endif  // defined(CONFIG_EVLOOP_DISPATCH_BENCHMARK)
+#if defined(CONFIG_TWHEEL_BENCHMARK)
+    twheel_benchmark();
+#endif  // defined(CONFIG_TWHEEL_BENCHMARK)
 
+    evloop_create();
+    boottl_mark(BOOTTL_LOOP_STARTED);
+
+#if defined(CONFIG_FAST_BOOT)
+    bool warm = rtcstate_is_warm();
+    if (!warm) {
+        storage_wait();
+    }
+#endif  // defined(CONFIG_FAST_BOOT)
+
+    boottl_mark(BOOTTL_P1_STARTED);
     P1_start();
-}
\ No newline at end of file
+
+#if defined(CONFIG_FAST_BOOT)
+    if (warm) {
+        storage_wait();
+    }
+#endif  // defined(CONFIG_FAST_BOOT)
+}
@@ -5,52 +5,150 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdatomic.h>
 
 #include "freertos/FreeRTOS.h"
 #include "esp_log.h"
-#include "driver/gpio.h"
+#if defined(CONFIG_BUTTON_INPUT_POLL)
 #include "iot_button.h"
 #include "button_gpio.h"
-#include "esp_timer.h"
+#endif  // defined(CONFIG_BUTTON_INPUT_POLL)
 
 #include "commondefs.h"
 #include "anvs.h"
 #include "state_machine.h"
+#include "evloop.h"
+#include "ledpat.h"
+#include "rtcstate.h"
+#include "btnin.h"
+#include "proc.h"
 
 static const char TAG[] = "proc";
 
-typedef struct {
-    device_modes_t opmode;  // actual operative mode
+// Operative state is published as one 32 bit word: the operative mode in the low half and a generation
+// counter, incremented on every change, in the high half. Readers on both cores take a consistent
+// snapshot with a single atomic load, without disabling interrupts.
+#define OPSTATE_MODE_MASK   (0xFFFFu)
+#define OPSTATE_GEN_SHIFT   (16)
+
+static _Atomic uint32_t operative_state = OP_MODE_STANDBY;
 
-    portMUX_TYPE mux;
-} operative_state_t;
+// Change subscribers. Entries are written before subscribers_count is published, so set_opmode() can
+// iterate them without locking. Registration is serialized by subscribers_mux.
+typedef struct {
+    opmode_change_cb_t cb;
+    void* arg;
+} opmode_subscriber_t;
 
-static operative_state_t operative_state = {
-    .opmode = OP_MODE_STANDBY,
-    .mux = portMUX_INITIALIZER_UNLOCKED
- };
+static opmode_subscriber_t subscribers[CONFIG_OPMODE_MAX_SUBSCRIBERS];
+static _Atomic uint32_t subscribers_count = 0;
+static portMUX_TYPE subscribers_mux = portMUX_INITIALIZER_UNLOCKED;
 
+// void set_opmode(device_modes_t mode)
+// Input:
+//  mode: new operative mode
+// Output: none
+// Description: This function publishes a new operative mode. When the mode changes, the generation is
+// incremented and the subscribers are called in the context of the caller, outside any critical section.
 void set_opmode(device_modes_t mode)
 {
-    portENTER_CRITICAL(&operative_state.mux);
-    operative_state.opmode = mode;
-    portEXIT_CRITICAL(&operative_state.mux);
+    uint32_t old_state = atomic_load_explicit(&operative_state, memory_order_relaxed);
+    uint32_t new_state;
+
+    do {
+        if ((old_state & OPSTATE_MODE_MASK) == (uint32_t)mode) {
+            return;
+        }
+        new_state = (((old_state >> OPSTATE_GEN_SHIFT) + 1) << OPSTATE_GEN_SHIFT) | (uint32_t)mode;
+    } while (!atomic_compare_exchange_weak_explicit(&operative_state, &old_state, new_state,
+                                                    memory_order_release, memory_order_relaxed));
+
+    uint32_t count = atomic_load_explicit(&subscribers_count, memory_order_acquire);
+    for (uint32_t i = 0; i < count; i++) {
+        subscribers[i].cb((device_modes_t)(old_state & OPSTATE_MODE_MASK), mode, subscribers[i].arg);
+    }
 }
 
 device_modes_t get_opmode(void)
 {
-    device_modes_t mode;
-    portENTER_CRITICAL(&operative_state.mux);
-    mode = operative_state.opmode;
-    portEXIT_CRITICAL(&operative_state.mux);
-    return mode;
+    return (device_modes_t)(atomic_load_explicit(&operative_state, memory_order_acquire) & OPSTATE_MODE_MASK);
+}
+
+// void get_opmode_snapshot(opmode_snapshot_t* snapshot)
+// Input:
+//  snapshot: pointer to a variable where the snapshot to be written
+// Output: none
+// Description: This function returns the operative mode together with its generation. Two snapshots with
+// equal generations are guaranteed to have the same mode.
+void get_opmode_snapshot(opmode_snapshot_t* snapshot)
+{
+    uint32_t state = atomic_load_explicit(&operative_state, memory_order_acquire);
+    snapshot->mode = (device_modes_t)(state & OPSTATE_MODE_MASK);
+    snapshot->generation = (uint16_t)(state >> OPSTATE_GEN_SHIFT);
 }
 
+// esp_err_t opmode_subscribe(opmode_change_cb_t cb, void* arg)
+// Input:
+//  cb: function called after every change of the operative mode
+//  arg: argument passed to cb
+// Output: ESP_OK or ESP_ERR_NO_MEM if CONFIG_OPMODE_MAX_SUBSCRIBERS are already registered
+// Description: This function registers a subscriber for operative mode changes. cb is called in the
+// context of the task that changes the mode, so it must be short and must not block.
+esp_err_t opmode_subscribe(opmode_change_cb_t cb, void* arg)
+{
+    esp_err_t ret = ESP_ERR_NO_MEM;
+
+    portENTER_CRITICAL(&subscribers_mux);
+    uint32_t count = atomic_load_explicit(&subscribers_count, memory_order_relaxed);
+    if (count < CONFIG_OPMODE_MAX_SUBSCRIBERS) {
+        subscribers[count].cb = cb;
+        subscribers[count].arg = arg;
+        atomic_store_explicit(&subscribers_count, count + 1, memory_order_release);
+        ret = ESP_OK;
+    }
+    portEXIT_CRITICAL(&subscribers_mux);
+    return ret;
+}
+
+// esp_err_t read_opmode(void)
+// Input: none
+// Output: ESP error code from anvs_app_op_mode_get(), ESP_ERR_INVALID_STATE if the saved mode is not valid
+// Description: This function restores the operative mode saved in anvs. The value is read into a local
+// variable and then published with set_opmode(), so no lock is held during the read.
 esp_err_t read_opmode(void)
 {
-    portENTER_CRITICAL(&operative_state.mux);
-    esp_err_t ret = anvs_app_op_mode_get((uint16_t* )&operative_state.opmode);
-    portEXIT_CRITICAL(&operative_state.mux);
+    uint16_t value;
+    esp_err_t ret = anvs_app_op_mode_get(&value);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (value >= OP_MODE_COUNT) {
+        ESP_LOGE(TAG, "Invalid saved operative mode: %u", value);
+        return ESP_ERR_INVALID_STATE;
+    }
+    set_opmode((device_modes_t)value);
+    return ret;
+}
+
+// esp_err_t resume_opmode(uint32_t* op_mode_changes)
+// Input:
+//  op_mode_changes: pointer to the counter of P1, or NULL for a machine which is not shadowed
+// Output: ESP_OK or the error code of read_opmode()
+// Description: This function restores the operative mode after a boot. The RTC memory shadow is used if it
+// was valid at boot, so a warm restart reads no flash; it restores *op_mode_changes too. Otherwise the mode
+// is read from NVS and, when op_mode_changes is given, the shadow is written for the next restart.
+esp_err_t resume_opmode(uint32_t* op_mode_changes)
+{
+    device_modes_t mode;
+
+    if (rtcstate_restore(&mode, op_mode_changes) == ESP_OK) {
+        set_opmode(mode);
+        return ESP_OK;
+    }
+    esp_err_t ret = read_opmode();
+    if (op_mode_changes != NULL) {
+        rtcstate_save(get_opmode(), *op_mode_changes);
+    }
     return ret;
 }
 
@@ -58,81 +156,122 @@ esp_err_t read_opmode(void)
 
 // button handling
 
+// Buttons of the application: one row per (GPIO, button event) pair, see btnin.h. Both input paths read
+// this table, so a button or an event is added by a row.
+static const btnin_map_t button_map[] = {
+    { CONFIG_BUTTON_GPIO, CONFIG_BUTTON_ACTIVE_LEVEL, BTNIN_SINGLE_CLICK, evButtonSingleClick },
+};
+
+#if defined(CONFIG_BUTTON_INPUT_IRQ)
+
+// The buttons are classified by btnin.c from GPIO interrupts, which posts the events itself.
+void init_button(void)
+{
+    esp_err_t ret = btnin_init(button_map, ARRAY_SIZE(button_map));
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to init buttons: %s", esp_err_to_name(ret));
+    }
+}
+
+#else
+
+// Events of espressif/button for the btnin_event_t of the table. Its long press hold event comes on every
+// sampling period, so BTNIN_REPEAT has no equivalent.
+static const button_event_t button_events[BTNIN_EVENT_MAX] = {
+    [BTNIN_PRESS_DOWN] = BUTTON_PRESS_DOWN,
+    [BTNIN_PRESS_UP] = BUTTON_PRESS_UP,
+    [BTNIN_SINGLE_CLICK] = BUTTON_SINGLE_CLICK,
+    [BTNIN_DOUBLE_CLICK] = BUTTON_DOUBLE_CLICK,
+    [BTNIN_LONG_PRESS] = BUTTON_LONG_PRESS_START,
+    [BTNIN_REPEAT] = BUTTON_EVENT_MAX,
+};
 
-button_handle_t btn;
+static button_handle_t buttons[ARRAY_SIZE(button_map)];
+static int buttons_gpio[ARRAY_SIZE(button_map)];
 
+// usr_data is the row of button_map
 static void button_event_cb(void *arg, void *data)
 {
-    button_event_t event = iot_button_get_event(arg);
-    ESP_LOGI(TAG, "%s", iot_button_get_event_str(event));
-    sm_post_event(evButtonSingleClick);
+    const btnin_map_t* row = (const btnin_map_t*)data;
+    evloop_post(row->fsm_event);
 }
 
 void init_button(void)
 {
-    button_config_t btn_cfg = {0};
-
-    button_gpio_config_t gpio_cfg = {
-        .gpio_num = CONFIG_BUTTON_GPIO,
-        .active_level = CONFIG_BUTTON_ACTIVE_LEVEL,
-        .enable_power_save = false,
-    };
+    size_t count = 0;
 
-    esp_err_t ret = iot_button_new_gpio_device(&btn_cfg, &gpio_cfg, &btn);
+    for (size_t i = 0; i < ARRAY_SIZE(button_map); i++) {
+        const btnin_map_t* row = &button_map[i];
+        size_t b = 0;
 
-    iot_button_register_cb(btn, BUTTON_SINGLE_CLICK, NULL, button_event_cb, NULL);
+        while ((b < count) && (buttons_gpio[b] != row->gpio)) {
+            b++;
+        }
+        if (b == count) {
+            // the timings of espressif/button stay its own; the CONFIG_BTNIN_* ones are for the interrupt path
+            button_config_t btn_cfg = {0};
+            button_gpio_config_t gpio_cfg = {
+                .gpio_num = row->gpio,
+                .active_level = row->active_level,
+                .enable_power_save = false,
+            };
+            esp_err_t ret = iot_button_new_gpio_device(&btn_cfg, &gpio_cfg, &buttons[count]);
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to init button on GPIO %d: %s", row->gpio, esp_err_to_name(ret));
+                continue;
+            }
+            buttons_gpio[count++] = row->gpio;
+        }
+        if ((row->event >= BTNIN_EVENT_MAX) || (button_events[row->event] == BUTTON_EVENT_MAX)) {
+            ESP_LOGW(TAG, "Button event %u of GPIO %d is not supported by espressif/button", row->event, row->gpio);
+            continue;
+        }
+        iot_button_register_cb(buttons[b], button_events[row->event], NULL, button_event_cb, (void*)row);
+    }
 }
 
+#endif  // defined(CONFIG_BUTTON_INPUT_IRQ)
+
 // OUTPUT DEVICE
 
 // led handling
 
-// Blinking intervals (full period in ms)
-static const int blink_intervals[] = {100, 500, 1000, 2000, 2500};  // 10Hz to 0.4Hz
+// Blinking patterns: one on/off step of half the period each, 10Hz to 0.4Hz. They are played by the LED
+// pattern engine, so the CPU works only when the period changes.
+static const ledpat_step_t blink_patterns[][1] = {
+    { { 50, 50 } }, { { 250, 250 } }, { { 500, 500 } }, { { 1000, 1000 } }, { { 1250, 1250 } }
+};
 
 static volatile int current_blink_index = 0;
-static esp_timer_handle_t led_timer = NULL;
-static bool led_state = !CONFIG_LED_ACTIVE_LEVEL;
-
-// LED toggle callback (called from esp_timer)
-static void led_timer_callback(void* arg)
-{
-    led_state = !led_state;
-    gpio_set_level(CONFIG_LED_GPIO, led_state);
-}
+static ledpat_led_t status_led = -1;
 
 void set_blink_period(int index)
 {
-    if (index < 0 || index >= ARRAY_SIZE(blink_intervals)) {
+    if (index < 0 || index >= ARRAY_SIZE(blink_patterns)) {
         ESP_LOGE(TAG, "Invalid blink index: %d", index);
         return;
     }
 
     current_blink_index = index;
 
-    if (led_timer) {
-        esp_timer_stop(led_timer);
-        esp_timer_start_periodic(led_timer, (blink_intervals[current_blink_index] / 2) * 1000);
+    if (status_led >= 0) {
+        esp_err_t ret = ledpat_set(status_led, blink_patterns[index], ARRAY_SIZE(blink_patterns[index]));
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to set LED pattern: %s", esp_err_to_name(ret));
+        }
     }
 }
 
+int get_status_led(void)
+{
+    return status_led;
+}
+
 void init_led_blinking(void)
 {
-    gpio_reset_pin(CONFIG_LED_GPIO);
-    gpio_set_direction(CONFIG_LED_GPIO, GPIO_MODE_OUTPUT);
-    gpio_set_level(CONFIG_LED_GPIO, !CONFIG_LED_ACTIVE_LEVEL);  // Start with LED off
-
-    esp_timer_create_args_t timer_args = {
-        .callback = &led_timer_callback,
-        .name = "led_blink_timer",
-        .arg = NULL,
-        .dispatch_method = ESP_TIMER_TASK,
-        .skip_unhandled_events = false,
-    };
-
-    esp_err_t ret = esp_timer_create(&timer_args, &led_timer);
+    esp_err_t ret = ledpat_add(CONFIG_LED_GPIO, CONFIG_LED_ACTIVE_LEVEL, &status_led);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to create LED timer: %s", esp_err_to_name(ret));
+        ESP_LOGE(TAG, "Failed to add LED: %s", esp_err_to_name(ret));
         return;
     }
 
@@ -12,13 +12,24 @@ extern "C" {    // allow use with C++ compilers
 
 #include "commondefs.h"
 
+typedef struct {
+    device_modes_t mode;
+    uint16_t generation;    // incremented on every change of mode
+} opmode_snapshot_t;
+
+typedef void (*opmode_change_cb_t)(device_modes_t old_mode, device_modes_t new_mode, void* arg);
+
 void set_opmode(device_modes_t mode);
 device_modes_t get_opmode(void);
+void get_opmode_snapshot(opmode_snapshot_t* snapshot);
+esp_err_t opmode_subscribe(opmode_change_cb_t cb, void* arg);
 esp_err_t read_opmode(void);
+esp_err_t resume_opmode(uint32_t* op_mode_changes);
 
 void init_button(void);
 void init_led_blinking(void);
 void set_blink_period(int index);
+int get_status_led(void);
 
 #if defined(__cplusplus)
 }   // end of extern "C"
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include "esp_attr.h"
 #include <string.h>
 
@@ -13,6 +14,12 @@
 #include "proc.h"
 #include "process.h"
 #include "anvs.h"
+#include "evloop.h"
+#include "boottl.h"
+#include "rtcstate.h"
+#if defined(CONFIG_SM_TRACE_BINARY)
+#include "smtrace.h"
+#endif  // defined(CONFIG_SM_TRACE_BINARY)
 
 static const char TAG[] = "PS";
 
@@ -33,247 +40,273 @@ static void P1a2(sm_machine_t* machine);
 static void P1a3(sm_machine_t* machine);
 static void P1a4(sm_machine_t* machine);
 static void P1a5(sm_machine_t* machine);
-static void P1a6(sm_machine_t* machine);
-static void P1a7(sm_machine_t* machine);
-static void P1a8(sm_machine_t* machine);
-static void P1a9(sm_machine_t* machine);
-static void P1a10(sm_machine_t* machine);
-
-static void P1a16(sm_machine_t* machine);
-static void P1a17(sm_machine_t* machine);
-static void P1a18(sm_machine_t* machine);
-static void P1a19(sm_machine_t* machine);
-static void P1a20(sm_machine_t* machine);
+static void P1_mode_action(sm_machine_t* machine);
+static void P1_start_blink_changer(sm_machine_t* machine);
+
+extern sm_machine_t sm_P1;
 
 static void P1a0(sm_machine_t* machine)
 {
+    boottl_mark(BOOTTL_FIRST_TRANSITION);
     ESP_LOGI(TAG,"P1a0 executed");
 
     P1_context_t* ctx = (P1_context_t* )(machine->ctx);
 
-    read_opmode();
+    // sm_P1 owns the RTC shadow; the instances of a group only read the mode
+    resume_opmode((machine == &sm_P1) ? &ctx->op_mode_changes : NULL);
     device_modes_t ops = get_opmode();
 
     switch (ops) {
         case OP_MODE_STANDBY:
-            sm_post_event(evP1Trigger1);
+            evloop_post_to(machine->id, evP1Trigger1);
             break;
         case OP_MODE_AUTO:
-            sm_post_event(evP1Trigger2);
+            evloop_post_to(machine->id, evP1Trigger2);
             break;
         case OP_MODE_AUTO_NIGHT:
-            sm_post_event(evP1Trigger3);
+            evloop_post_to(machine->id, evP1Trigger3);
             break;
         case OP_MODE_MANUAL:
-            sm_post_event(evP1Trigger4);
+            evloop_post_to(machine->id, evP1Trigger4);
             break;
         case OP_MODE_TEST:
-            sm_post_event(evP1Trigger5);
+            evloop_post_to(machine->id, evP1Trigger5);
             break;
         default:
             break;
     }
 
-    esp_timer_start_periodic(ctx->t_blink_changer, CONFIG_LED_BLINK_PERIOD_CHANGER_INTERVAL * 1000); // Convert ms to us
+    P1_start_blink_changer(machine);
+}
+
+// static void P1_start_blink_changer(sm_machine_t* machine)
+// Input:
+//  machine: P1 or an instance of a P1 group
+// Output: none
+// Description: This function starts the blink changer timer of the machine, which posts the tick to this
+// machine only. The first expiries of the instances of a group are spread over the period, one wheel tick
+// apart, so the ticks of a group do not come as one burst into the queue of the loop.
+static void P1_start_blink_changer(sm_machine_t* machine)
+{
+    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
+    uint32_t offset = 0;
+
+    if (machine != &sm_P1) {
+        offset = ((uint32_t)(uint16_t)(machine->id - P1_INSTANCE_FIRST_ID) * CONFIG_TWHEEL_TICK_MS) %
+            CONFIG_LED_BLINK_PERIOD_CHANGER_INTERVAL;
+    }
+    twheel_start_periodic_at(&ctx->t_blink_changer, CONFIG_LED_BLINK_PERIOD_CHANGER_INTERVAL + offset,
+                             CONFIG_LED_BLINK_PERIOD_CHANGER_INTERVAL);
 }
 
 // going to sP1_STANDBY
 static void P1a1(sm_machine_t* machine)
 {
     ESP_LOGI(TAG,"P1a1 executed");
-    set_blink_period(0);  // Set blink period to 10Hz
+    if (machine == &sm_P1) {
+        set_blink_period(0);  // Set blink period to 10Hz
+    }
 }
 
 // going to sP1_AUTO
 static void P1a2(sm_machine_t* machine)
 {
     ESP_LOGI(TAG,"P1a2 executed");
-    set_blink_period(1);  // Set blink period to 2Hz
+    if (machine == &sm_P1) {
+        set_blink_period(1);  // Set blink period to 2Hz
+    }
 }
 
 // going to sP1_AUTO_NIGHT
 static void P1a3(sm_machine_t* machine)
 {
     ESP_LOGI(TAG,"P1a3 executed");
-    set_blink_period(2);  // Set blink period to 1Hz
+    if (machine == &sm_P1) {
+        set_blink_period(2);  // Set blink period to 1Hz
+    }
 }
 
 // going to sP1_MANUAL
 static void P1a4(sm_machine_t* machine)
 {
     ESP_LOGI(TAG,"P1a4 executed");
-    set_blink_period(3);  // Set blink period to 0.5Hz
+    if (machine == &sm_P1) {
+        set_blink_period(3);  // Set blink period to 0.5Hz
+    }
 }
 
 // going to sP1_TEST
 static void P1a5(sm_machine_t* machine)
 {
     ESP_LOGI(TAG,"P1a5 executed");
-    set_blink_period(4);  // Set blink period to 0.4Hz
-}
-
-static void P1a6(sm_machine_t* machine)
-{
-    ESP_LOGI(TAG,"P1a6 executed");
-    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
-
-    set_blink_period(0);  // Set blink period to 10Hz
-    set_opmode(OP_MODE_STANDBY);
-    ctx->op_mode_changes++;
-    anvs_app_op_mode_set(OP_MODE_STANDBY);
-}
-
-static void P1a7(sm_machine_t* machine)
-{
-    ESP_LOGI(TAG,"P1a7 executed");
-    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
-
-    set_blink_period(1);  // Set blink period to 2Hz
-    set_opmode(OP_MODE_AUTO);
-    ctx->op_mode_changes++;
-    anvs_app_op_mode_set(OP_MODE_AUTO);
-
-}
-
-static void P1a8(sm_machine_t* machine)
-{
-    ESP_LOGI(TAG,"P1a8 executed");
-    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
-
-    set_blink_period(2);  // Set blink period to 1Hz
-    set_opmode(OP_MODE_AUTO_NIGHT);
-    ctx->op_mode_changes++;
-    anvs_app_op_mode_set(OP_MODE_AUTO_NIGHT);
-}
-
-static void P1a9(sm_machine_t* machine)
-{
-    ESP_LOGI(TAG,"P1a9 executed");
-    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
-
-    set_blink_period(3);  // Set blink period to 0.5Hz
-    set_opmode(OP_MODE_MANUAL);
-    ctx->op_mode_changes++;
-    anvs_app_op_mode_set(OP_MODE_MANUAL);
-}
-
-static void P1a10(sm_machine_t* machine)
-{
-    ESP_LOGI(TAG,"P1a10 executed");
-    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
-
-    set_blink_period(4);  // Set blink period to 0.4Hz
-    set_opmode(OP_MODE_TEST);
-    ctx->op_mode_changes++;
-    anvs_app_op_mode_set(OP_MODE_TEST);
-}
-
-static void P1a16(sm_machine_t* machine)
-{
-    ESP_LOGI(TAG,"P1a16 executed");
-    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
-
-    set_blink_period(0);  // Set blink period to 10Hz
-    set_opmode(OP_MODE_STANDBY);
-    ctx->op_mode_changes++;
-}
-
-static void P1a17(sm_machine_t* machine)
-{
-    ESP_LOGI(TAG,"P1a17 executed");
-    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
-
-    set_blink_period(1);  // Set blink period to 2Hz
-    set_opmode(OP_MODE_AUTO);
-    ctx->op_mode_changes++;
-}
-
-static void P1a18(sm_machine_t* machine)
-{
-    ESP_LOGI(TAG,"P1a18 executed");
-    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
-
-    set_blink_period(2);  // Set blink period to 1Hz
-    set_opmode(OP_MODE_AUTO_NIGHT);
-    ctx->op_mode_changes++;
-}
-
-static void P1a19(sm_machine_t* machine)
-{
-    ESP_LOGI(TAG,"P1a19 executed");
-    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
-
-    set_blink_period(3);  // Set blink period to 0.5Hz
-    set_opmode(OP_MODE_MANUAL);
-    ctx->op_mode_changes++;
-}
-
-static void P1a20(sm_machine_t* machine)
-{
-    ESP_LOGI(TAG,"P1a20 executed");
-    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
-
-    set_blink_period(4);  // Set blink period to 0.4Hz
-    set_opmode(OP_MODE_TEST);
-    ctx->op_mode_changes++;
+    if (machine == &sm_P1) {
+        set_blink_period(4);  // Set blink period to 0.4Hz
+    }
 }
 
-static const sm_transition_t sP1_START_transitions[] = {
-    { evP1Start, (sm_state_idx_t)sP1_RESOLVE, P1a0, iP1a0, NULL, SM_GPOL_POSITIVE },
-};
-
-static const sm_transition_t sP1_RESOLVE_transitions[] = {
-    { evP1Trigger1, (sm_state_idx_t)sP1_STANDBY, P1a1, iP1a1, NULL, SM_GPOL_POSITIVE },
-    { evP1Trigger2, (sm_state_idx_t)sP1_AUTO, P1a2, iP1a2, NULL, SM_GPOL_POSITIVE },
-    { evP1Trigger3, (sm_state_idx_t)sP1_AUTO_NIGHT, P1a3, iP1a3, NULL, SM_GPOL_POSITIVE },
-    { evP1Trigger4, (sm_state_idx_t)sP1_MANUAL, P1a4, iP1a4, NULL, SM_GPOL_POSITIVE },
-    { evP1Trigger5, (sm_state_idx_t)sP1_MANUAL, P1a5, iP1a5, NULL, SM_GPOL_POSITIVE },
-};
-
-static const sm_transition_t sP1_STANDBY_transitions[] = {
-    { evButtonSingleClick, (sm_state_idx_t)sP1_AUTO, P1a7, iP1a7, NULL, SM_GPOL_POSITIVE },
-    { ev_t_blink_changer_tick, (sm_state_idx_t)sP1_TEST, P1a20, iP1a20, NULL, SM_GPOL_POSITIVE },
-};
-
-static const sm_transition_t sP1_AUTO_transitions[] = {
-    { evButtonSingleClick, (sm_state_idx_t)sP1_AUTO_NIGHT, P1a8, iP1a8, NULL, SM_GPOL_POSITIVE },
-    { ev_t_blink_changer_tick, (sm_state_idx_t)sP1_STANDBY, P1a16, iP1a16, NULL, SM_GPOL_POSITIVE },
+// Mode change actions. P1a6..P1a10, on a click, and P1a16..P1a20, on a blink changer tick, differ only
+// in their parameters: they are one executor, P1_mode_action(), and one row of P1_mode_actions each,
+// indexed by the action index of the transition.
+typedef struct {
+    uint8_t blink;          // index of set_blink_period()
+    uint8_t opmode;         // device_modes_t set by the action
+    bool persist;           // the mode is also written to NVS
+} P1_mode_action_t;
+
+// With the journal backend of anvs a mode change costs one record of flash, so the changes of the timer
+// are persisted too.
+#if defined(CONFIG_ANVS_BACKEND_JOURNAL)
+#define P1_PERSIST_TICK     (true)
+#else
+#define P1_PERSIST_TICK     (false)
+#endif  // defined(CONFIG_ANVS_BACKEND_JOURNAL)
+
+// Snapshot of sm_P1, written to appstore with one blob operation on every persisted mode change. At boot
+// P1_start() puts the machine directly into the saved state instead of resolving it by evP1Start, P1a0 and
+// a trigger event. The timer is not saved: it is started again by the restore. A snapshot of another
+// schema or size is ignored and the machine is started by evP1Start.
+#define P1_SNAPSHOT_KEY     "p1snap"
+#define P1_SNAPSHOT_SCHEMA  (1)
+
+typedef struct {
+    uint16_t schema;                // P1_SNAPSHOT_SCHEMA
+    uint16_t size;                  // sizeof(P1_snapshot_t)
+    uint8_t state;                  // sP1_states_t
+    uint8_t opmode;                 // device_modes_t
+    uint16_t reserved;
+    uint32_t op_mode_changes;       // P1_context_t
+} P1_snapshot_t;
+
+_Static_assert(sizeof(P1_snapshot_t) <= ANVS_BLOB_MAX_SIZE, "the snapshot is written behind by anvs");
+
+// State and blink period of each operative mode, the ones set by P1a1..P1a5.
+static const struct {
+    uint8_t state;
+    uint8_t blink;
+} P1_mode_states[OP_MODE_COUNT] = {
+    [OP_MODE_STANDBY]    = { .state = sP1_STANDBY, .blink = 0 },
+    [OP_MODE_AUTO]       = { .state = sP1_AUTO, .blink = 1 },
+    [OP_MODE_AUTO_NIGHT] = { .state = sP1_AUTO_NIGHT, .blink = 2 },
+    [OP_MODE_MANUAL]     = { .state = sP1_MANUAL, .blink = 3 },
+    [OP_MODE_TEST]       = { .state = sP1_TEST, .blink = 4 },
 };
 
-static const sm_transition_t sP1_AUTO_NIGHT_transitions[] = {
-    { evButtonSingleClick, (sm_state_idx_t)sP1_MANUAL, P1a9, iP1a9, NULL, SM_GPOL_POSITIVE },
-    { ev_t_blink_changer_tick, (sm_state_idx_t)sP1_AUTO, P1a17, iP1a17, NULL, SM_GPOL_POSITIVE },
+static const P1_mode_action_t P1_mode_actions[] = {
+    [iP1a6]  = { .blink = 0, .opmode = OP_MODE_STANDBY, .persist = true },      // 10Hz
+    [iP1a7]  = { .blink = 1, .opmode = OP_MODE_AUTO, .persist = true },         // 2Hz
+    [iP1a8]  = { .blink = 2, .opmode = OP_MODE_AUTO_NIGHT, .persist = true },   // 1Hz
+    [iP1a9]  = { .blink = 3, .opmode = OP_MODE_MANUAL, .persist = true },       // 0.5Hz
+    [iP1a10] = { .blink = 4, .opmode = OP_MODE_TEST, .persist = true },         // 0.4Hz
+    [iP1a16] = { .blink = 0, .opmode = OP_MODE_STANDBY, .persist = P1_PERSIST_TICK },
+    [iP1a17] = { .blink = 1, .opmode = OP_MODE_AUTO, .persist = P1_PERSIST_TICK },
+    [iP1a18] = { .blink = 2, .opmode = OP_MODE_AUTO_NIGHT, .persist = P1_PERSIST_TICK },
+    [iP1a19] = { .blink = 3, .opmode = OP_MODE_MANUAL, .persist = P1_PERSIST_TICK },
+    [iP1a20] = { .blink = 4, .opmode = OP_MODE_TEST, .persist = P1_PERSIST_TICK },
 };
 
-static const sm_transition_t sP1_MANUAL_transitions[] = {
-    { evButtonSingleClick, (sm_state_idx_t)sP1_TEST, P1a10, iP1a10, NULL, SM_GPOL_POSITIVE },
-    { ev_t_blink_changer_tick, (sm_state_idx_t)sP1_AUTO_NIGHT, P1a18, iP1a18, NULL, SM_GPOL_POSITIVE },
-};
-
-static const sm_transition_t sP1_TEST_transitions[] = {
-    { evButtonSingleClick, (sm_state_idx_t)sP1_STANDBY, P1a6, iP1a6, NULL, SM_GPOL_POSITIVE },
-    { ev_t_blink_changer_tick, (sm_state_idx_t)sP1_MANUAL, P1a19, iP1a19, NULL, SM_GPOL_POSITIVE },
-};
+// Transitions of the states of sm_P1. Each list is expanded by the generators below into the sm_transition_t
+// table of the state and into the row of the state in the dense dispatch index P1_index.
+// T(state, event, s2, action, action index, guard, guard polarity)
+
+#define sP1_START_TRANSITIONS(T, s) \
+    T(s, evP1Start, sP1_RESOLVE, P1a0, iP1a0, NULL, SM_GPOL_POSITIVE)
+
+// sP1_RESOLVE enters the state of P1_mode_states for the saved mode, as the restore of a snapshot does, so
+// a machine starts in the same state whichever path it takes; OP_MODE_TEST resolves to sP1_TEST.
+#define sP1_RESOLVE_TRANSITIONS(T, s) \
+    T(s, evP1Trigger1, sP1_STANDBY, P1a1, iP1a1, NULL, SM_GPOL_POSITIVE) \
+    T(s, evP1Trigger2, sP1_AUTO, P1a2, iP1a2, NULL, SM_GPOL_POSITIVE) \
+    T(s, evP1Trigger3, sP1_AUTO_NIGHT, P1a3, iP1a3, NULL, SM_GPOL_POSITIVE) \
+    T(s, evP1Trigger4, sP1_MANUAL, P1a4, iP1a4, NULL, SM_GPOL_POSITIVE) \
+    T(s, evP1Trigger5, sP1_TEST, P1a5, iP1a5, NULL, SM_GPOL_POSITIVE)
+
+#define sP1_STANDBY_TRANSITIONS(T, s) \
+    T(s, evButtonSingleClick, sP1_AUTO, P1_mode_action, iP1a7, NULL, SM_GPOL_POSITIVE) \
+    T(s, ev_t_blink_changer_tick, sP1_TEST, P1_mode_action, iP1a20, NULL, SM_GPOL_POSITIVE)
+
+#define sP1_AUTO_TRANSITIONS(T, s) \
+    T(s, evButtonSingleClick, sP1_AUTO_NIGHT, P1_mode_action, iP1a8, NULL, SM_GPOL_POSITIVE) \
+    T(s, ev_t_blink_changer_tick, sP1_STANDBY, P1_mode_action, iP1a16, NULL, SM_GPOL_POSITIVE)
+
+#define sP1_AUTO_NIGHT_TRANSITIONS(T, s) \
+    T(s, evButtonSingleClick, sP1_MANUAL, P1_mode_action, iP1a9, NULL, SM_GPOL_POSITIVE) \
+    T(s, ev_t_blink_changer_tick, sP1_AUTO, P1_mode_action, iP1a17, NULL, SM_GPOL_POSITIVE)
+
+#define sP1_MANUAL_TRANSITIONS(T, s) \
+    T(s, evButtonSingleClick, sP1_TEST, P1_mode_action, iP1a10, NULL, SM_GPOL_POSITIVE) \
+    T(s, ev_t_blink_changer_tick, sP1_AUTO_NIGHT, P1_mode_action, iP1a18, NULL, SM_GPOL_POSITIVE)
+
+#define sP1_TEST_TRANSITIONS(T, s) \
+    T(s, evButtonSingleClick, sP1_STANDBY, P1_mode_action, iP1a6, NULL, SM_GPOL_POSITIVE) \
+    T(s, ev_t_blink_changer_tick, sP1_MANUAL, P1_mode_action, iP1a19, NULL, SM_GPOL_POSITIVE)
+
+// Generators
+#define P1_TRANSITION(s, ev, s2, act, idx, guard, gpol)   { ev, (sm_state_idx_t)s2, act, idx, guard, gpol },
+#define P1_POSITION(s, ev, s2, act, idx, guard, gpol)     s##_at_##ev,
+#define P1_INDEX(s, ev, s2, act, idx, guard, gpol)        [ev] = &s##_transitions[s##_at_##ev],
+
+// sm_transition_t tables: sP1_START_transitions, sP1_RESOLVE_transitions, ...
+#define X(name) static const sm_transition_t name##_transitions[] = { name##_TRANSITIONS(P1_TRANSITION, name) };
+P1_STATES
+#undef X
+
+// positions of the transitions in their tables: sP1_STANDBY_at_evButtonSingleClick, ...
+#define X(name) enum { name##_TRANSITIONS(P1_POSITION, name) };
+P1_STATES
+#undef X
 
 // sm_P1 state machine definition
 static const sm_state_t P1_States[sP1_STATE_COUNT] = {
-    { sP1_START_transitions, ARRAY_SIZE(sP1_START_transitions), NULL, NULL },
-    { sP1_RESOLVE_transitions, ARRAY_SIZE(sP1_RESOLVE_transitions), NULL, NULL},
-    { sP1_STANDBY_transitions, ARRAY_SIZE(sP1_STANDBY_transitions), NULL, NULL},
-    { sP1_AUTO_transitions, ARRAY_SIZE(sP1_AUTO_transitions), NULL, NULL},
-    { sP1_AUTO_NIGHT_transitions, ARRAY_SIZE(sP1_AUTO_NIGHT_transitions), NULL, NULL},
-    { sP1_MANUAL_transitions, ARRAY_SIZE(sP1_MANUAL_transitions), NULL, NULL},
-    { sP1_TEST_transitions, ARRAY_SIZE(sP1_TEST_transitions), NULL, NULL},
+    #define X(name) { name##_transitions, ARRAY_SIZE(name##_transitions), NULL, NULL },
+    P1_STATES
+    #undef X
 };
 
-static void t_blink_changer_cb(void* arg)
+// Dense [state][event] dispatch index of sm_P1, in flash.
+static evloop_index_row_t P1_index[sP1_STATE_COUNT] = {
+    #define X(name) [name] = { name##_TRANSITIONS(P1_INDEX, name) },
+    P1_STATES
+    #undef X
+};
+
+// static void P1_mode_action(sm_machine_t* machine)
+// Input:
+//  machine: P1 or an instance of a P1 group
+// Output: none
+// Description: Executor of the mode change actions. It runs the row of P1_mode_actions given by the action
+// index of the transition being executed: sets the blink period and the operative mode, counts the change,
+// updates the RTC shadow and, if persist is set, writes the mode and the snapshot to NVS. With the
+// write-behind cache both go to flash with one commit. The LED, the operative mode and NVS belong to sm_P1:
+// an instance of a group only counts the change, its mode being its state.
+static void P1_mode_action(sm_machine_t* machine)
 {
-    sm_machine_t* machine = (sm_machine_t*)arg; // let this callback know which machine is calling
+    uint32_t id = evloop_action_index(P1_index, machine);
+    const P1_mode_action_t* a = &P1_mode_actions[id];
+    P1_context_t* ctx = (P1_context_t*)(machine->ctx);
 
-    sm_post_event(ev_t_blink_changer_tick);
+    if (machine != &sm_P1) {
+        ctx->op_mode_changes++;
+        return;
+    }
+    ESP_LOGI(TAG,"P1a%" PRIu32 " executed",id);
+    set_blink_period(a->blink);
+    set_opmode((device_modes_t)a->opmode);
+    ctx->op_mode_changes++;
+    rtcstate_save((device_modes_t)a->opmode, ctx->op_mode_changes);
+    if (a->persist) {
+        anvs_app_op_mode_set((device_modes_t)a->opmode);
+        P1_snapshot_t snap = {
+            .schema = P1_SNAPSHOT_SCHEMA,
+            .size = sizeof(P1_snapshot_t),
+            .state = P1_mode_states[a->opmode].state,
+            .opmode = a->opmode,
+            .op_mode_changes = ctx->op_mode_changes,
+        };
+        anvs_blob_set(P1_SNAPSHOT_KEY, &snap, sizeof(snap));
+    }
 }
 
-static P1_context_t P1_ctx = { .op_mode_changes = 0, .t_blink_changer = NULL };
+static P1_context_t P1_ctx = { .op_mode_changes = 0, .t_blink_changer = TWHEEL_TIMER_INITIALIZER_TO(ev_t_blink_changer_tick, P1_ID) };
 sm_machine_t sm_P1 = { .ctx = &P1_ctx,
                        .s1 = sP1_START,
                        .id = P1_ID,
@@ -288,57 +321,291 @@ static void sm_trace_machine_1 (sm_machine_t* machine, const sm_transition_t* tr
 static void sm_lost_event_1(sm_machine_t* machine);
 #endif  // defined(SM_TRACER)
 
+static evloop_machine_t P1_machine = {
+    .machine = &sm_P1,
+    .index = P1_index,
+    .loop = P1_LOOP,
+#if defined(CONFIG_SM_TRACER)
+    .trace_machine = sm_trace_machine_1,
+    .trace_context = sm_trace_context,
+#if defined(CONFIG_SM_TRACER_LOSTEVENT)
+    .lost_event = sm_lost_event_1,
+#endif  // defined(CONFIG_SM_TRACER_LOSTEVENT)
+#endif  // defined(CONFIG_SM_TRACER)
+    .active = false,
+};
+
 esp_err_t register_state_machines(void)
 {
     esp_err_t ret = ESP_OK;
 
-    ret = sm_register_state_machine(&sm_P1);
+    ret = evloop_register(&P1_machine);
 
 
     return ret == ESP_OK ? ESP_OK : ESP_FAIL;
 }
 
+// static esp_err_t P1_read_snapshot(P1_snapshot_t* snap)
+// Input:
+//  snap: pointer to a variable where the snapshot to be written
+// Output: ESP_OK, ESP_ERR_NOT_FOUND if there is no valid snapshot
+// Description: This function returns the state sm_P1 has to be restored into. The RTC shadow is used if it
+// was valid at boot, so a warm restart reads no flash; otherwise the snapshot blob is read from appstore
+// and the shadow is seeded from it. A blob of another schema or size, or with a state out of range, is
+// rejected.
+static esp_err_t P1_read_snapshot(P1_snapshot_t* snap)
+{
+    device_modes_t mode;
+    uint32_t changes;
+
+    if (rtcstate_restore(&mode, &changes) == ESP_OK) {
+        *snap = (P1_snapshot_t) {
+            .schema = P1_SNAPSHOT_SCHEMA,
+            .size = sizeof(P1_snapshot_t),
+            .state = P1_mode_states[mode].state,
+            .opmode = mode,
+            .op_mode_changes = changes,
+        };
+        return ESP_OK;
+    }
+
+    size_t size = sizeof(*snap);
+    esp_err_t ret = anvs_blob_get(P1_SNAPSHOT_KEY, snap, &size);
+    if (ret != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if ((size != sizeof(P1_snapshot_t)) || (snap->schema != P1_SNAPSHOT_SCHEMA) ||
+        (snap->size != sizeof(P1_snapshot_t)) || (snap->opmode >= OP_MODE_COUNT) ||
+        (snap->state != P1_mode_states[snap->opmode].state)) {
+        ESP_LOGW(TAG,"P1 snapshot rejected (schema %u, size %u)",(unsigned)snap->schema,(unsigned)size);
+        return ESP_ERR_NOT_FOUND;
+    }
+    rtcstate_save((device_modes_t)snap->opmode, snap->op_mode_changes);
+    return ESP_OK;
+}
+
+// static void P1_enter(uint8_t state, uint8_t opmode)
+// Input:
+//  state: steady state of sm_P1
+//  opmode: operative mode of state
+// Output: none
+// Description: This function activates sm_P1 in state with the effects of its entry: operative mode, blink
+// period and blink changer timer. No event is posted.
+static void P1_enter(uint8_t state, uint8_t opmode)
+{
+    set_opmode((device_modes_t)opmode);
+    set_blink_period(P1_mode_states[opmode].blink);
+    P1_start_blink_changer(&sm_P1);
+    evloop_start(&P1_machine, state);
+}
+
+// void P1_start(void)
+// Input: none
+// Output: none
+// Description: This function starts sm_P1. If a snapshot is found, the machine is put directly into the
+// saved state with the effects of its entry: operative mode, blink period and blink changer timer; no
+// event is posted. Otherwise it is started in sP1_START with evP1Start, which resolves the state from NVS.
 void P1_start(void)
 {
-    if (sm_is_activated(&sm_P1) != 0) {
+    if (P1_machine.active) {
         return;
     }
 
     ESP_LOGI(TAG,"Starting P1");
 
-    P1_context_t* ctx = (P1_context_t*)(sm_P1.ctx);
-
     sm_initialize(&sm_P1, sP1_START, P1_ID, P1_States, ARRAY_SIZE(P1_States),&P1_ctx);
-    sm_set_tracers(&sm_P1,sm_trace_machine_1, sm_trace_context, sm_lost_event_1);
-    sm_trace_on(&sm_P1);
-    sm_trace_lost_event_on(&sm_P1);
-
-    if (ctx->t_blink_changer == NULL) {
-        esp_timer_create_args_t tca = {
-            .callback = t_blink_changer_cb,
-            .arg = &sm_P1,      // pointer to the machine and the context
-            .dispatch_method = ESP_TIMER_TASK,
-            .name = "t_blink_changer"
-        };
-        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_timer_create(&tca,&ctx->t_blink_changer));
+
+    P1_snapshot_t snap;
+    if (P1_read_snapshot(&snap) == ESP_OK) {
+        ESP_LOGI(TAG,"P1 restored into state %u, operative mode %u",(unsigned)snap.state,(unsigned)snap.opmode);
+        P1_ctx.op_mode_changes = snap.op_mode_changes;
+        P1_enter(snap.state, snap.opmode);
+        boottl_mark(BOOTTL_FIRST_TRANSITION);
+        return;
     }
 
-    sm_start_with_event(&sm_P1,sP1_START,evP1Start);
+    evloop_start_with_event(&P1_machine,sP1_START,evP1Start);
+}
+
+// esp_err_t P1_start_in(sP1_states_t state)
+// Input:
+//  state: steady state of sm_P1, sP1_STANDBY to sP1_TEST
+// Output: ESP_OK, ESP_ERR_INVALID_ARG if state is not steady, ESP_ERR_INVALID_STATE if sm_P1 is running
+// Description: This function starts sm_P1 directly in state, as the restore of a snapshot does, without
+// reading the RTC shadow or appstore. The player of the recordings starts from the recorded state with it.
+esp_err_t P1_start_in(sP1_states_t state)
+{
+    if (P1_machine.active) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (uint8_t mode = 0; mode < OP_MODE_COUNT; mode++) {
+        if (P1_mode_states[mode].state == state) {
+            sm_initialize(&sm_P1, sP1_START, P1_ID, P1_States, ARRAY_SIZE(P1_States),&P1_ctx);
+            P1_enter(state, mode);
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_INVALID_ARG;
+}
+
+// void P1_group_config(evloop_group_config_t* cfg)
+// Input:
+//  cfg: pointer to a variable where the configuration to be written
+// Output: none
+// Description: This function describes P1 as a machine type for instance groups: the same state tables,
+// dense index and tracers as sm_P1, a P1_context_t per instance.
+void P1_group_config(evloop_group_config_t* cfg)
+{
+    *cfg = (evloop_group_config_t) {
+        .states = P1_States,
+        .sizes = ARRAY_SIZE(P1_States),
+        .index = P1_index,
+        .ctx_size = sizeof(P1_context_t),
+        .first_id = P1_INSTANCE_FIRST_ID,
+        .loop = P1_LOOP,
+#if defined(CONFIG_SM_TRACER)
+        .trace_machine = sm_trace_machine_1,
+        .trace_context = sm_trace_context,
+#if defined(CONFIG_SM_TRACER_LOSTEVENT)
+        .lost_event = sm_lost_event_1,
+#endif  // defined(CONFIG_SM_TRACER_LOSTEVENT)
+#endif  // defined(CONFIG_SM_TRACER)
+    };
+}
+
+// esp_err_t P1_create_group(size_t count, evloop_group_t** group)
+// Input:
+//  count: number of instances
+//  group: pointer to a variable where the group to be written
+// Output: ESP error code of evloop_group_create()
+// Description: This function allocates count instances of P1 with their contexts in one arena. The blink
+// changer timer of an instance posts to that instance. The instances are stopped; register the group with
+// evloop_register_group() and start them with P1_start_group().
+esp_err_t P1_create_group(size_t count, evloop_group_t** group)
+{
+    evloop_group_config_t cfg;
+
+    P1_group_config(&cfg);
+    esp_err_t ret = evloop_group_create(&cfg, count, group);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    for (size_t i = 0; i < count; i++) {
+        P1_context_t* ctx = (P1_context_t*)evloop_group_ctx(*group, i);
+        ctx->t_blink_changer.event = ev_t_blink_changer_tick;
+        ctx->t_blink_changer.target = evloop_group_machine(*group, i)->id;
+    }
+    return ESP_OK;
+}
+
+// esp_err_t P1_start_group(evloop_group_t* group)
+// Input:
+//  group: group created by P1_create_group()
+// Output: ESP error code of evloop_group_start()
+// Description: This function starts all instances directly in the state of the current operative mode,
+// as P1_start() restores sm_P1 from a snapshot, and starts their blink changer timers. No event is posted:
+// resolving the state through evP1Start and a trigger would take two posts per instance.
+esp_err_t P1_start_group(evloop_group_t* group)
+{
+    esp_err_t ret = evloop_group_start(group, 0, group->count, P1_mode_states[get_opmode()].state);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    for (size_t i = 0; i < group->count; i++) {
+        P1_start_blink_changer(evloop_group_machine(group, i));
+    }
+    return ESP_OK;
+}
+
+// void P1_stop_group(evloop_group_t* group)
+// Input:
+//  group: group started by P1_start_group()
+// Output: none
+// Description: This function stops the blink changer timers and the instances of the group.
+void P1_stop_group(evloop_group_t* group)
+{
+    for (size_t i = 0; i < group->count; i++) {
+        P1_context_t* ctx = (P1_context_t*)evloop_group_ctx(group, i);
+        twheel_stop(&ctx->t_blink_changer);
+    }
+    evloop_group_stop(group, 0, group->count);
 }
 
 void P1_stop(void)
 {
     // stop any resources running related to P1
-    sm_deactivate(&sm_P1);
+    twheel_stop(&P1_ctx.t_blink_changer);
+    evloop_stop(&P1_machine);
+}
+
+#if defined(CONFIG_EVLOOP_DISPATCH_BENCHMARK)
+
+// void P1_benchmark_dispatch(void)
+// Input: none
+// Output: none
+// Description: This function compares the lookup in P1_index with the linear scan of the transition tables
+// which the state_machine component does. All (state, event) pairs are looked up
+// CONFIG_EVLOOP_DISPATCH_BENCHMARK_ROUNDS times by both methods. The time per lookup and the memory
+// used by the tables and by the index are logged.
+void P1_benchmark_dispatch(void)
+{
+    static const struct {
+        const sm_transition_t* transitions;
+        size_t size;
+    } rows[sP1_STATE_COUNT] = {
+        #define X(name) { name##_transitions, ARRAY_SIZE(name##_transitions) },
+        P1_STATES
+        #undef X
+    };
+    const uint32_t lookups = CONFIG_EVLOOP_DISPATCH_BENCHMARK_ROUNDS * sP1_STATE_COUNT * sm_EVENTS_NUMBER;
+    volatile uintptr_t sink = 0;
+
+    int64_t t0 = esp_timer_get_time();
+    for (uint32_t r = 0; r < CONFIG_EVLOOP_DISPATCH_BENCHMARK_ROUNDS; r++) {
+        for (size_t st = 0; st < sP1_STATE_COUNT; st++) {
+            for (size_t ev = 0; ev < sm_EVENTS_NUMBER; ev++) {
+                const sm_transition_t* found = NULL;
+                for (size_t i = 0; i < rows[st].size; i++) {
+                    if (rows[st].transitions[i].event == ev) {
+                        found = &rows[st].transitions[i];
+                        break;
+                    }
+                }
+                sink ^= (uintptr_t)found;
+            }
+        }
+    }
+    int64_t t1 = esp_timer_get_time();
+    for (uint32_t r = 0; r < CONFIG_EVLOOP_DISPATCH_BENCHMARK_ROUNDS; r++) {
+        for (size_t st = 0; st < sP1_STATE_COUNT; st++) {
+            for (size_t ev = 0; ev < sm_EVENTS_NUMBER; ev++) {
+                sink ^= (uintptr_t)P1_index[st][ev];
+            }
+        }
+    }
+    int64_t t2 = esp_timer_get_time();
+
+    size_t table_bytes = sizeof(P1_States)
+        #define X(name) + sizeof(name##_transitions)
+        P1_STATES
+        #undef X
+        ;
+
+    ESP_LOGI(TAG,"P1 dispatch benchmark: %" PRIu32 " lookups, %d states x %d events",lookups,sP1_STATE_COUNT,sm_EVENTS_NUMBER);
+    ESP_LOGI(TAG,"  linear scan: %" PRIu32 " ns/lookup",(uint32_t)((t1 - t0) * 1000 / lookups));
+    ESP_LOGI(TAG,"  dense index: %" PRIu32 " ns/lookup",(uint32_t)((t2 - t1) * 1000 / lookups));
+    ESP_LOGI(TAG,"  memory: transition tables %u bytes, dense index %u bytes",(unsigned)table_bytes,(unsigned)sizeof(P1_index));
 }
 
+#endif  // defined(CONFIG_EVLOOP_DISPATCH_BENCHMARK)
+
 // tracers
 
 #if defined(CONFIG_SM_TRACER)
 
 // Generate the event_names array automatically
 const char* const event_names[] = {
-    #define X(name) #name,
+    #define X(name, ...) #name,
     EVENT_LIST
     #undef X
 };
@@ -375,10 +642,17 @@ const char* const sP1_state_names[] = {
 // SM_TraceMachine may distiguish permitted from not permitted transition by looking
 // flag SM_TREN. If SM_TREN is 1 (true), transition is permitted.
 
+// With CONFIG_SM_TRACE_BINARY the transition is written as a binary record in the smtrace ring buffer
+// and the names are restored on the host by tools/smtrace_decode.py.
+
 static void SM_TraceMachine_ (sm_machine_t* machine, const sm_transition_t* tr, const char* const * state_names)
 {
+#if defined(CONFIG_SM_TRACE_BINARY)
+    smtrace_transition(machine->id,machine->s1,tr->s2,tr->event,tr->actidx,(machine->flags & SM_TREN) != 0);
+#else
     ESP_LOGI(TAG,"ID=%04d, S1=%s, S2=%s, Event=%s, Action=P%da%d %spermitted",
         machine->id,state_names[machine->s1],state_names[tr->s2],event_names[tr->event],machine->id,tr->actidx,(machine->flags & SM_TREN) == 0 ? "not " : "");
+#endif  // defined(CONFIG_SM_TRACE_BINARY)
 }
 
 static void sm_trace_machine_1 (sm_machine_t* machine, const sm_transition_t* tr)
@@ -406,24 +680,33 @@ static void sm_trace_machine_1 (sm_machine_t* machine, const sm_transition_t* tr
 // SM_TraceContext may distinguish permitted from not permitted transition by looking
 // flag SM_TREN. If SM_TREN is 1 (true), transition is permitted.
 
+// The binary trace does not record the context; the number of operative mode changes can be counted
+// from the transition records.
+
 void sm_trace_context(sm_machine_t* machine, bool when)
 {
+#if !defined(CONFIG_SM_TRACE_BINARY)
     P1_context_t* ctx = (P1_context_t*)(machine->ctx);
     if (when == 1) {
-        ESP_LOGI(TAG,"Number of operative mode changes = %lu",ctx->op_mode_changes);
+        ESP_LOGI(TAG,"Number of operative mode changes = %" PRIu32,ctx->op_mode_changes);
     }
+#endif  // !defined(CONFIG_SM_TRACE_BINARY)
 }
 
 static void sm_lost_event_(sm_machine_t* machine, const char* const * state_names)
 {
     sm_event_type_t ev = machine->event;
 
+#if defined(CONFIG_SM_TRACE_BINARY)
+    smtrace_lost_event(machine->id,machine->s1,ev);
+#else
     if (ev < sm_EVENTS_NUMBER) {
         ESP_LOGI(TAG,"ID=%04d: Lost ev: %s, state: %s",machine->id,event_names[ev],state_names[machine->s1]);
     }
     else {
         ESP_LOGW(TAG,"ID=%04d: Unknown lost event with ID %d, state: %s",machine->id,ev,state_names[machine->s1]);
     }
+#endif  // defined(CONFIG_SM_TRACE_BINARY)
 }
 
 static void sm_lost_event_1(sm_machine_t* machine)
@@ -7,16 +7,19 @@ extern "C" {    // allow use with C++ compilers
 #endif
 
 #include "sdkconfig.h"
-#include "esp_timer.h"
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 
 #include "state_machine.h"
+#include "twheel.h"
+#include "evloop.h"
 
 // sm_P1 Main process ================================================
 
 #define P1_ID   (1)
+#define P1_INSTANCE_FIRST_ID    (0x100)     // sm_machine_t.id of the first instance of a P1 group
+#define P1_LOOP                 (CONFIG_EVLOOP_LOOPS - 1)   // event loop of P1: core 1 when there are two
 #define P1_STATES \
     X(sP1_START) X(sP1_RESOLVE) \
     X(sP1_STANDBY) X(sP1_AUTO) X(sP1_AUTO_NIGHT) X(sP1_MANUAL) X(sP1_TEST)
@@ -30,14 +33,23 @@ typedef enum sP1_states {
 
 typedef struct {
     uint32_t op_mode_changes;
-    esp_timer_handle_t t_blink_changer;  // Timer handle for periodic tasks
+    twheel_timer_t t_blink_changer;     // posts ev_t_blink_changer_tick to its machine
 } P1_context_t;
 
 void P1_start(void);
+esp_err_t P1_start_in(sP1_states_t state);
 void P1_stop(void);
+void P1_group_config(evloop_group_config_t* cfg);
+esp_err_t P1_create_group(size_t count, evloop_group_t** group);
+esp_err_t P1_start_group(evloop_group_t* group);
+void P1_stop_group(evloop_group_t* group);
 
 esp_err_t register_state_machines(void);
 
+#if defined(CONFIG_EVLOOP_DISPATCH_BENCHMARK)
+void P1_benchmark_dispatch(void);
+#endif  // defined(CONFIG_EVLOOP_DISPATCH_BENCHMARK)
+
 #if defined(__cplusplus)
 }   // end of extern "C"
 #endif
@@ -0,0 +1,166 @@
+// rtcstate.c
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+#include "commondefs.h"
+#include "rtcstate.h"
+
+static const char TAG[] = "RTCS";
+
+#define RTCSTATE_MAGIC  (0x50315253u)   // "SR1P"
+#define RTCSTATE_STATS_MAGIC    (0x54535253u)   // "SRST"
+
+typedef struct {
+    uint32_t magic;
+    uint16_t opmode;                // device_modes_t
+    uint16_t reserved;
+    uint32_t op_mode_changes;       // P1_context_t
+    uint32_t crc;                   // of the fields above
+} rtcstate_record_t;
+
+// The counters are apart from the record, so a rejected record does not clear them.
+typedef struct {
+    uint32_t magic;
+    rtcstate_stats_t stats;
+    uint32_t crc;                   // of the fields above
+} rtcstate_stats_record_t;
+
+// Not initialized by the startup code: they keep their content over every reset but a power-on.
+static RTC_NOINIT_ATTR rtcstate_record_t rtc_record;
+static RTC_NOINIT_ATTR rtcstate_stats_record_t rtc_stats;
+
+typedef enum {
+    RTCSTATE_UNCHECKED = 0,
+    RTCSTATE_WARM,          // the record was valid at boot
+    RTCSTATE_COLD,          // the record was not valid at boot
+} rtcstate_boot_t;
+
+static rtcstate_boot_t rtcstate_boot = RTCSTATE_UNCHECKED;
+static portMUX_TYPE rtcstate_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t rtcstate_crc(const rtcstate_record_t* record)
+{
+    return esp_rom_crc32_le(0, (const uint8_t*)record, offsetof(rtcstate_record_t, crc));
+}
+
+static uint32_t rtcstate_stats_crc(const rtcstate_stats_record_t* record)
+{
+    return esp_rom_crc32_le(0, (const uint8_t*)record, offsetof(rtcstate_stats_record_t, crc));
+}
+
+// static void rtcstate_check(void)
+// Input: none
+// Output: none
+// Description: This function validates the record on the first call after boot and counts the boot path.
+// An invalid record is cleared. The counters are validated on their own and start again from zero only
+// when they are invalid too, i.e. after a power-on. It must be called with rtcstate_mux taken.
+static void rtcstate_check(void)
+{
+    if (rtcstate_boot != RTCSTATE_UNCHECKED) {
+        return;
+    }
+    if ((rtc_stats.magic != RTCSTATE_STATS_MAGIC) || (rtcstate_stats_crc(&rtc_stats) != rtc_stats.crc)) {
+        rtc_stats = (rtcstate_stats_record_t) { .magic = RTCSTATE_STATS_MAGIC };
+    }
+    bool magic = (rtc_record.magic == RTCSTATE_MAGIC);
+    if (magic && (rtc_record.opmode < OP_MODE_COUNT) && (rtcstate_crc(&rtc_record) == rtc_record.crc)) {
+        rtcstate_boot = RTCSTATE_WARM;
+        rtc_stats.stats.rtc_restores++;
+    }
+    else {
+        rtcstate_boot = RTCSTATE_COLD;
+        rtc_record = (rtcstate_record_t) { 0 };
+        rtc_record.crc = rtcstate_crc(&rtc_record);
+        rtc_stats.stats.nvs_restores++;
+        if (magic) {
+            rtc_stats.stats.crc_failures++;
+        }
+    }
+    rtc_stats.crc = rtcstate_stats_crc(&rtc_stats);
+}
+
+// esp_err_t rtcstate_restore(device_modes_t* mode, uint32_t* op_mode_changes)
+// Input:
+//  mode: pointer to a variable where the saved operative mode to be written
+//  op_mode_changes: pointer to a variable where the saved counter to be written, or NULL
+// Output: ESP_OK, ESP_ERR_NOT_FOUND if there was no valid record at boot
+// Description: This function returns the state saved in RTC memory. The result is the same during the
+// whole boot: after a cold boot the function fails even when rtcstate_save() has been called meanwhile.
+// The variables are written only on success.
+esp_err_t rtcstate_restore(device_modes_t* mode, uint32_t* op_mode_changes)
+{
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+
+    portENTER_CRITICAL(&rtcstate_mux);
+    rtcstate_check();
+    if (rtcstate_boot == RTCSTATE_WARM) {
+        *mode = (device_modes_t)rtc_record.opmode;
+        if (op_mode_changes != NULL) {
+            *op_mode_changes = rtc_record.op_mode_changes;
+        }
+        ret = ESP_OK;
+    }
+    portEXIT_CRITICAL(&rtcstate_mux);
+
+    if (ret == ESP_OK) {
+        ESP_LOGI(TAG, "Resuming operative mode %u from RTC memory", (unsigned)*mode);
+    }
+    return ret;
+}
+
+// void rtcstate_save(device_modes_t mode, uint32_t op_mode_changes)
+// Input:
+//  mode: operative mode
+//  op_mode_changes: counter of P1_context_t
+// Output: none
+// Description: This function updates the record. The CRC is written last, so a reset during the update
+// leaves a record which is rejected at the next boot.
+void rtcstate_save(device_modes_t mode, uint32_t op_mode_changes)
+{
+    portENTER_CRITICAL(&rtcstate_mux);
+    rtcstate_check();
+    rtc_record.magic = RTCSTATE_MAGIC;
+    rtc_record.opmode = (uint16_t)mode;
+    rtc_record.op_mode_changes = op_mode_changes;
+    rtc_record.crc = rtcstate_crc(&rtc_record);
+    rtc_stats.stats.saves++;
+    rtc_stats.crc = rtcstate_stats_crc(&rtc_stats);
+    portEXIT_CRITICAL(&rtcstate_mux);
+}
+
+// bool rtcstate_is_warm(void)
+// Input: none
+// Output: true if a valid record was found at boot
+// Description: This function tells whether the state of P1 can be resumed without NVS.
+bool rtcstate_is_warm(void)
+{
+    portENTER_CRITICAL(&rtcstate_mux);
+    rtcstate_check();
+    bool warm = (rtcstate_boot == RTCSTATE_WARM);
+    portEXIT_CRITICAL(&rtcstate_mux);
+    return warm;
+}
+
+// void rtcstate_get_stats(rtcstate_stats_t* stats)
+// Input:
+//  stats: pointer to a variable where the counters to be written
+// Output: none
+// Description: This function returns the boot path counters since the last power-on.
+void rtcstate_get_stats(rtcstate_stats_t* stats)
+{
+    portENTER_CRITICAL(&rtcstate_mux);
+    rtcstate_check();
+    *stats = rtc_stats.stats;
+    portEXIT_CRITICAL(&rtcstate_mux);
+}
+
+// end of rtcstate.c
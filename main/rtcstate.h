@@ -0,0 +1,41 @@
+// rtcstate.h
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+#include "commondefs.h"
+
+// RTC memory shadow of the state of P1. The operative mode and the counters of P1_context_t are kept in
+// RTC_NOINIT memory, which survives software, watchdog and panic resets and deep sleep, but not a power-on.
+// The record is protected by a magic and a CRC. It is validated once per boot: a valid record is used
+// instead of NVS, so a warm restart resumes the last state without reading flash. After a power-on, or if
+// the record is corrupted, the mode is read from NVS and the record is written again.
+
+// Counters of the boot paths. They are kept in RTC memory apart from the record, with their own magic and
+// CRC, so a rejected record does not clear them: they count the boots since the last power-on.
+typedef struct {
+    uint32_t rtc_restores;      // boots resumed from the RTC record
+    uint32_t nvs_restores;      // boots that found no valid record and read NVS
+    uint32_t crc_failures;      // records rejected by the CRC, a subset of nvs_restores
+    uint32_t saves;             // record updates
+} rtcstate_stats_t;
+
+esp_err_t rtcstate_restore(device_modes_t* mode, uint32_t* op_mode_changes);
+void rtcstate_save(device_modes_t mode, uint32_t op_mode_changes);
+bool rtcstate_is_warm(void);
+void rtcstate_get_stats(rtcstate_stats_t* stats);
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of rtcstate.h
@@ -0,0 +1,259 @@
+// smrec.c
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "commondefs.h"
+#include "smrec.h"
+
+static const char TAG[] = "SMREC";
+
+#define SMREC_RING_SIZE     (CONFIG_SM_RECORD_BUFFER_RECORDS)
+#define SMREC_RING_MASK     (SMREC_RING_SIZE - 1)
+
+_Static_assert((SMREC_RING_SIZE & SMREC_RING_MASK) == 0, "CONFIG_SM_RECORD_BUFFER_RECORDS must be a power of 2");
+
+// Records printed in one log line by smrec_dump()
+#define SMREC_RECORDS_PER_LINE  (8)
+
+// The ring of smtrace.c: bounded multi-producer ring (D. Vyukov), one consumer at a time. Posts are
+// recorded in ISR context too, so smrec_put() never takes a lock.
+typedef struct {
+    _Atomic uint32_t seq;
+    smrec_record_t record;
+} smrec_cell_t;
+
+static smrec_cell_t ring[SMREC_RING_SIZE];
+static _Atomic uint32_t head = 0;
+static uint32_t tail = 0;
+static portMUX_TYPE read_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static _Atomic uint32_t recorded = 0;
+static _Atomic uint32_t dropped = 0;
+
+static smrec_header_t rec_header;
+static bool header_pending = false;
+
+_Atomic bool smrec_active = false;
+
+#if defined(CONFIG_SM_RECORD_DRAIN_TASK)
+#define SMREC_DRAIN_STACK_SIZE  (3072)
+
+static void smrec_drain_task(void* pvParameter);
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+static StackType_t smrec_drain_stack[SMREC_DRAIN_STACK_SIZE];
+static StaticTask_t smrec_drain_tcb;
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+#endif  // defined(CONFIG_SM_RECORD_DRAIN_TASK)
+
+// void smrec_init(void)
+// Input: none
+// Output: none
+// Description: This function prepares the ring buffer and, with CONFIG_SM_RECORD_DRAIN_TASK, starts the task
+// which prints the records in background. The recorder stays stopped until smrec_start().
+void smrec_init(void)
+{
+    for (uint32_t i = 0; i < SMREC_RING_SIZE; i++) {
+        atomic_store_explicit(&ring[i].seq, i, memory_order_relaxed);
+    }
+    atomic_store_explicit(&head, 0, memory_order_release);
+    tail = 0;
+
+#if defined(CONFIG_SM_RECORD_DRAIN_TASK)
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+    xTaskCreateStaticPinnedToCore(smrec_drain_task, "SM_Record", SMREC_DRAIN_STACK_SIZE, NULL, 1,
+                                  smrec_drain_stack, &smrec_drain_tcb, tskNO_AFFINITY);
+#else
+    xTaskCreatePinnedToCore(smrec_drain_task, "SM_Record", SMREC_DRAIN_STACK_SIZE, NULL, 1, NULL, tskNO_AFFINITY);
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+#endif  // defined(CONFIG_SM_RECORD_DRAIN_TASK)
+}
+
+// void smrec_start(void)
+// Input: none
+// Output: none
+// Description: This function starts a recording. The records of a previous recording still in the ring
+// are discarded, and the header of the new one is printed by the next smrec_dump().
+void smrec_start(void)
+{
+    smrec_record_t discard;
+
+    atomic_store_explicit(&smrec_active, false, memory_order_relaxed);
+    while (smrec_read(&discard, 1) > 0) {
+    }
+
+    portENTER_CRITICAL(&read_mux);
+    rec_header = (smrec_header_t) {
+        .magic = SMREC_MAGIC,
+        .version = SMREC_VERSION,
+        .record_size = sizeof(smrec_record_t),
+        .events = sm_EVENTS_NUMBER,
+        .start = (uint32_t)esp_timer_get_time(),
+    };
+    header_pending = true;
+    portEXIT_CRITICAL(&read_mux);
+
+    atomic_store_explicit(&recorded, 0, memory_order_relaxed);
+    atomic_store_explicit(&dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&smrec_active, true, memory_order_release);
+}
+
+void smrec_stop(void)
+{
+    atomic_store_explicit(&smrec_active, false, memory_order_release);
+}
+
+// void smrec_put(uint32_t timestamp, uint16_t id, uint8_t kind, sm_event_type_t event, uint8_t s1, uint8_t s2,
+//                uint8_t actidx, uint8_t flags)
+// Input: fields of the record
+// Output: none
+// Description: This function writes one record in the ring. It is placed in IRAM, because posts are
+// recorded in ISR context, and does not block; when the ring is full the record is dropped and counted.
+// The caller tests smrec_active first, see smrec_transition().
+IRAM_ATTR void smrec_put(uint32_t timestamp, uint16_t id, uint8_t kind, sm_event_type_t event, uint8_t s1, uint8_t s2, uint8_t actidx, uint8_t flags)
+{
+    uint32_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+    smrec_cell_t* cell;
+
+    while (true) {
+        cell = &ring[pos & SMREC_RING_MASK];
+        int32_t dif = (int32_t)(atomic_load_explicit(&cell->seq, memory_order_acquire) - pos);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else {
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+
+    cell->record.timestamp = timestamp;
+    cell->record.id = id;
+    cell->record.kind = kind;
+    cell->record.event = (uint8_t)event;
+    cell->record.s1 = s1;
+    cell->record.s2 = s2;
+    cell->record.actidx = actidx;
+    cell->record.flags = flags;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    atomic_fetch_add_explicit(&recorded, 1, memory_order_relaxed);
+}
+
+// void smrec_get_header(smrec_header_t* header)
+// Input:
+//  header: pointer to a variable where the header of the current recording to be written
+// Output: none
+// Description: This function returns the header of the last recording started, for a writer of .smrec
+// files which reads the records with smrec_read().
+void smrec_get_header(smrec_header_t* header)
+{
+    portENTER_CRITICAL(&read_mux);
+    *header = rec_header;
+    portEXIT_CRITICAL(&read_mux);
+}
+
+// size_t smrec_read(smrec_record_t* records, size_t max)
+// Input:
+//  records: array where the records to be copied
+//  max: size of records
+// Output: number of records copied
+// Description: This function takes up to max oldest records out of the ring.
+size_t smrec_read(smrec_record_t* records, size_t max)
+{
+    size_t count = 0;
+
+    portENTER_CRITICAL(&read_mux);
+    while (count < max) {
+        smrec_cell_t* cell = &ring[tail & SMREC_RING_MASK];
+        if (atomic_load_explicit(&cell->seq, memory_order_acquire) != tail + 1) {
+            break;
+        }
+        records[count++] = cell->record;
+        atomic_store_explicit(&cell->seq, tail + SMREC_RING_SIZE, memory_order_release);
+        tail++;
+    }
+    portEXIT_CRITICAL(&read_mux);
+    return count;
+}
+
+// void smrec_dump(void)
+// Input: none
+// Output: none
+// Description: This function empties the ring and prints the records as hex, SMREC_RECORDS_PER_LINE
+// records per line, prefixed by "SMR:". The first call after smrec_start() prints the header first, in a
+// line prefixed by "SMRH:". The output is turned into a .smrec file by tools/smrec_extract.py.
+void smrec_dump(void)
+{
+    smrec_record_t records[SMREC_RECORDS_PER_LINE];
+    char line[SMREC_RECORDS_PER_LINE * sizeof(smrec_record_t) * 2 + 1];
+    smrec_header_t h;
+    bool pending;
+    size_t count;
+
+    portENTER_CRITICAL(&read_mux);
+    h = rec_header;
+    pending = header_pending;
+    header_pending = false;
+    portEXIT_CRITICAL(&read_mux);
+
+    if (pending) {
+        const uint8_t* bytes = (const uint8_t*)&h;
+        for (size_t i = 0; i < sizeof(h); i++) {
+            sprintf(&line[i * 2], "%02x", bytes[i]);
+        }
+        ESP_LOGI(TAG, "SMRH:%s", line);
+    }
+    while ((count = smrec_read(records, ARRAY_SIZE(records))) > 0) {
+        const uint8_t* bytes = (const uint8_t*)records;
+        for (size_t i = 0; i < count * sizeof(smrec_record_t); i++) {
+            sprintf(&line[i * 2], "%02x", bytes[i]);
+        }
+        ESP_LOGI(TAG, "SMR:%s", line);
+    }
+}
+
+// void smrec_get_stats(smrec_stats_t* stats)
+// Input:
+//  stats: pointer to a variable where the counters to be written
+// Output: none
+// Description: This function returns the number of records written and dropped since smrec_start().
+// A recording with dropped records cannot be replayed faithfully.
+void smrec_get_stats(smrec_stats_t* stats)
+{
+    stats->recorded = atomic_load_explicit(&recorded, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+#if defined(CONFIG_SM_RECORD_DRAIN_TASK)
+
+// static void smrec_drain_task(void* pvParameter)
+// Input: none
+// Output: none
+// Description: This task prints the records collected in the ring every CONFIG_SM_RECORD_DRAIN_PERIOD_MS.
+static void smrec_drain_task(void* pvParameter)
+{
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_SM_RECORD_DRAIN_PERIOD_MS));
+        smrec_dump();
+    }
+}
+
+#endif  // defined(CONFIG_SM_RECORD_DRAIN_TASK)
+
+// end of smrec.c
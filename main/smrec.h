@@ -0,0 +1,100 @@
+// smrec.h
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <esp_err.h>
+#include "esp_timer.h"
+
+#include "events.h"
+
+// Event recorder. The posts at the boundary of the event loop, evloop_post*(), and the transitions they
+// cause are written as fixed size records in a lock-free RAM ring buffer. The records are printed as hex
+// by smrec_dump() or by the drain task; tools/smrec_extract.py writes them to a .smrec file, which the
+// player of host_replay/ feeds back into the state machines of process.c on the linux target.
+//
+// A .smrec file is one smrec_header_t followed by smrec_record_t up to the end of the file, little endian.
+// The events of this application carry no payload, so a post is the event and its receiver only. A post
+// is recorded after it is queued, with the time before, so its record may follow the records of the
+// transitions it caused. Posts which were dropped or coalesced are marked, because the player has to
+// skip them; an event evicted later from a full queue (EV_OVF_REPLACE_OLDEST) is not, so a recording
+// with evictions, see evloop_get_stats(), may not replay identically.
+
+#define SMREC_MAGIC         (0x31524d53u)   // "SMR1"
+#define SMREC_VERSION       (1)
+
+// smrec_record_t.kind
+#define SMREC_POST          (0)
+#define SMREC_TRANSITION    (1)
+
+// smrec_record_t.flags
+#define SMREC_F_INTERNAL    (0x01)  // post: made in an event loop task, i.e. by an action
+#define SMREC_F_ISR         (0x02)  // post: made in ISR context
+#define SMREC_F_BATCH       (0x04)  // post: event of an evloop_post_events() burst
+#define SMREC_F_PERMITTED   (0x08)  // transition: permitted by its guard
+#define SMREC_F_DISCARDED   (0x10)  // post: not queued, dropped or coalesced
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;         // SMREC_MAGIC
+    uint16_t version;       // SMREC_VERSION
+    uint8_t record_size;    // sizeof(smrec_record_t)
+    uint8_t events;         // sm_EVENTS_NUMBER of the recording application
+    uint32_t start;         // low 32 bits of esp_timer_get_time() at smrec_start(), us
+} smrec_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp;     // low 32 bits of esp_timer_get_time(), us
+    uint16_t id;            // post: target, EVLOOP_TARGET_ALL for all subscribers; transition: machine id
+    uint8_t kind;           // SMREC_POST or SMREC_TRANSITION
+    uint8_t event;
+    uint8_t s1;             // transition only
+    uint8_t s2;             // transition only
+    uint8_t actidx;         // transition only
+    uint8_t flags;          // SMREC_F_*
+} smrec_record_t;
+
+_Static_assert(sizeof(smrec_header_t) == 12, "smrec_header_t must be 12 bytes, see tools/smrec_extract.py");
+_Static_assert(sizeof(smrec_record_t) == 12, "smrec_record_t must be 12 bytes, see tools/smrec_extract.py");
+
+typedef struct {
+    uint32_t recorded;      // records written in the ring
+    uint32_t dropped;       // records lost because the ring was full
+} smrec_stats_t;
+
+// true between smrec_start() and smrec_stop()
+extern _Atomic bool smrec_active;
+
+void smrec_init(void);
+void smrec_start(void);
+void smrec_stop(void);
+void smrec_put(uint32_t timestamp, uint16_t id, uint8_t kind, sm_event_type_t event, uint8_t s1, uint8_t s2, uint8_t actidx, uint8_t flags);
+void smrec_get_header(smrec_header_t* header);
+size_t smrec_read(smrec_record_t* records, size_t max);
+void smrec_dump(void);
+void smrec_get_stats(smrec_stats_t* stats);
+
+// static inline void smrec_transition(uint16_t machine_id, uint8_t s1, uint8_t s2, sm_event_type_t event, uint8_t actidx, bool permitted)
+// Description: Record of a transition. When the recorder is stopped, the cost is one load. The posts are
+// recorded by the event loop, see evloop_post_to().
+static inline void smrec_transition(uint16_t machine_id, uint8_t s1, uint8_t s2, sm_event_type_t event, uint8_t actidx, bool permitted)
+{
+    if (atomic_load_explicit(&smrec_active, memory_order_relaxed)) {
+        smrec_put((uint32_t)esp_timer_get_time(), machine_id, SMREC_TRANSITION, event, s1, s2, actidx,
+                  permitted ? SMREC_F_PERMITTED : 0);
+    }
+}
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of smrec.h
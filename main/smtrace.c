@@ -0,0 +1,208 @@
+// smtrace.c
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "commondefs.h"
+#include "smtrace.h"
+
+static const char TAG[] = "SMTRACE";
+
+#define SMTRACE_RING_SIZE   (CONFIG_SM_TRACE_BUFFER_RECORDS)
+#define SMTRACE_RING_MASK   (SMTRACE_RING_SIZE - 1)
+
+_Static_assert((SMTRACE_RING_SIZE & SMTRACE_RING_MASK) == 0, "CONFIG_SM_TRACE_BUFFER_RECORDS must be a power of 2");
+
+// Records printed in one log line by smtrace_dump()
+#define SMTRACE_RECORDS_PER_LINE    (8)
+
+// Bounded multi-producer ring (D. Vyukov). Each cell carries a sequence number: a producer may fill
+// the cell when seq == position, the consumer may take it when seq == position + 1. Producers claim
+// positions with a CAS on head, so tracers running on both cores never take a lock. There is one consumer
+// at a time (smtrace_read() is serialized by read_mux).
+typedef struct {
+    _Atomic uint32_t seq;
+    smtrace_record_t record;
+} smtrace_cell_t;
+
+static smtrace_cell_t ring[SMTRACE_RING_SIZE];
+static _Atomic uint32_t head = 0;
+static uint32_t tail = 0;
+static portMUX_TYPE read_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static _Atomic uint32_t recorded = 0;
+static _Atomic uint32_t dropped = 0;
+
+_Atomic uint32_t smtrace_machine_mask = UINT32_MAX;
+_Atomic uint64_t smtrace_event_mask = UINT64_MAX;
+_Atomic uint32_t smtrace_state_mask = UINT32_MAX;
+
+#if defined(CONFIG_SM_TRACE_DRAIN_TASK)
+#define SMTRACE_DRAIN_STACK_SIZE  (3072)
+
+static void smtrace_drain_task(void* pvParameter);
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+static StackType_t smtrace_drain_stack[SMTRACE_DRAIN_STACK_SIZE];
+static StaticTask_t smtrace_drain_tcb;
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+#endif  // defined(CONFIG_SM_TRACE_DRAIN_TASK)
+
+// void smtrace_init(void)
+// Input: none
+// Output: none
+// Description: This function prepares the ring buffer and, with CONFIG_SM_TRACE_DRAIN_TASK, starts the task
+// which prints the records in background. It must be called before the state machines are started.
+void smtrace_init(void)
+{
+    for (uint32_t i = 0; i < SMTRACE_RING_SIZE; i++) {
+        atomic_store_explicit(&ring[i].seq, i, memory_order_relaxed);
+    }
+    atomic_store_explicit(&head, 0, memory_order_release);
+    tail = 0;
+
+#if defined(CONFIG_SM_TRACE_DRAIN_TASK)
+#if defined(CONFIG_APP_STATIC_ALLOCATION)
+    xTaskCreateStaticPinnedToCore(smtrace_drain_task, "SM_Trace", SMTRACE_DRAIN_STACK_SIZE, NULL, 1,
+                                  smtrace_drain_stack, &smtrace_drain_tcb, tskNO_AFFINITY);
+#else
+    xTaskCreatePinnedToCore(smtrace_drain_task, "SM_Trace", SMTRACE_DRAIN_STACK_SIZE, NULL, 1, NULL, tskNO_AFFINITY);
+#endif  // defined(CONFIG_APP_STATIC_ALLOCATION)
+#endif  // defined(CONFIG_SM_TRACE_DRAIN_TASK)
+}
+
+// void smtrace_set_filter(uint32_t machine_mask, uint64_t event_mask, uint32_t state_mask)
+// Input:
+//  machine_mask: bit n enables machine with id n
+//  event_mask: bit n enables event n
+//  state_mask: bit n enables records with s1 == n
+// Output: none
+// Description: This function sets the runtime filter. Setting machine_mask to 0 turns the trace off.
+void smtrace_set_filter(uint32_t machine_mask, uint64_t event_mask, uint32_t state_mask)
+{
+    atomic_store_explicit(&smtrace_event_mask, event_mask, memory_order_relaxed);
+    atomic_store_explicit(&smtrace_state_mask, state_mask, memory_order_relaxed);
+    atomic_store_explicit(&smtrace_machine_mask, machine_mask, memory_order_relaxed);
+}
+
+// void smtrace_put(uint16_t machine_id, uint8_t s1, uint8_t s2, uint8_t event, uint8_t actidx, uint8_t flags)
+// Input: fields of the record
+// Output: none
+// Description: This function writes one record in the ring. It does not block; when the ring is full the
+// record is dropped and counted. Use smtrace_transition() and smtrace_lost_event(), which apply the filter first.
+void smtrace_put(uint16_t machine_id, uint8_t s1, uint8_t s2, uint8_t event, uint8_t actidx, uint8_t flags)
+{
+    uint32_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+    smtrace_cell_t* cell;
+
+    while (true) {
+        cell = &ring[pos & SMTRACE_RING_MASK];
+        int32_t dif = (int32_t)(atomic_load_explicit(&cell->seq, memory_order_acquire) - pos);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+        else if (dif < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else {
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+
+    cell->record.timestamp = (uint32_t)esp_timer_get_time();
+    cell->record.machine_id = machine_id;
+    cell->record.s1 = s1;
+    cell->record.s2 = s2;
+    cell->record.event = event;
+    cell->record.actidx = actidx;
+    cell->record.flags = flags;
+    cell->record.reserved = 0;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    atomic_fetch_add_explicit(&recorded, 1, memory_order_relaxed);
+}
+
+// size_t smtrace_read(smtrace_record_t* records, size_t max)
+// Input:
+//  records: array where the records to be copied
+//  max: size of records
+// Output: number of records copied
+// Description: This function takes up to max oldest records out of the ring.
+size_t smtrace_read(smtrace_record_t* records, size_t max)
+{
+    size_t count = 0;
+
+    portENTER_CRITICAL(&read_mux);
+    while (count < max) {
+        smtrace_cell_t* cell = &ring[tail & SMTRACE_RING_MASK];
+        if (atomic_load_explicit(&cell->seq, memory_order_acquire) != tail + 1) {
+            break;
+        }
+        records[count++] = cell->record;
+        atomic_store_explicit(&cell->seq, tail + SMTRACE_RING_SIZE, memory_order_release);
+        tail++;
+    }
+    portEXIT_CRITICAL(&read_mux);
+    return count;
+}
+
+// void smtrace_dump(void)
+// Input: none
+// Output: none
+// Description: This function empties the ring and prints the records as hex, SMTRACE_RECORDS_PER_LINE
+// records per line, prefixed by "SMT:". The output is decoded by tools/smtrace_decode.py.
+void smtrace_dump(void)
+{
+    smtrace_record_t records[SMTRACE_RECORDS_PER_LINE];
+    char line[SMTRACE_RECORDS_PER_LINE * sizeof(smtrace_record_t) * 2 + 1];
+    size_t count;
+
+    while ((count = smtrace_read(records, ARRAY_SIZE(records))) > 0) {
+        const uint8_t* bytes = (const uint8_t*)records;
+        for (size_t i = 0; i < count * sizeof(smtrace_record_t); i++) {
+            sprintf(&line[i * 2], "%02x", bytes[i]);
+        }
+        ESP_LOGI(TAG, "SMT:%s", line);
+    }
+}
+
+// void smtrace_get_stats(smtrace_stats_t* stats)
+// Input:
+//  stats: pointer to a variable where the counters to be written
+// Output: none
+// Description: This function returns the number of records written and dropped.
+void smtrace_get_stats(smtrace_stats_t* stats)
+{
+    stats->recorded = atomic_load_explicit(&recorded, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+#if defined(CONFIG_SM_TRACE_DRAIN_TASK)
+
+// static void smtrace_drain_task(void* pvParameter)
+// Input: none
+// Output: none
+// Description: This task prints the records collected in the ring every CONFIG_SM_TRACE_DRAIN_PERIOD_MS.
+// It runs with low priority, so the UART time is not spent in the state machine tasks.
+static void smtrace_drain_task(void* pvParameter)
+{
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_SM_TRACE_DRAIN_PERIOD_MS));
+        smtrace_dump();
+    }
+}
+
+#endif  // defined(CONFIG_SM_TRACE_DRAIN_TASK)
+
+// end of smtrace.c
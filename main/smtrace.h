@@ -0,0 +1,95 @@
+// smtrace.h
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <esp_err.h>
+
+#include "events.h"
+
+// Binary transition trace. Every transition is written as a fixed size record in a lock-free RAM ring
+// buffer. The records are printed as hex by smtrace_dump() or by the drain task and are decoded back to
+// names on the host by tools/smtrace_decode.py.
+
+#define SMTRACE_F_PERMITTED (0x01)  // transition was permitted (SM_TREN)
+#define SMTRACE_F_LOST      (0x02)  // no transition for the event in s1
+
+#define SMTRACE_ACTIDX_NONE (0xFF)
+
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp;     // low 32 bits of esp_timer_get_time(), us
+    uint16_t machine_id;
+    uint8_t s1;
+    uint8_t s2;
+    uint8_t event;
+    uint8_t actidx;
+    uint8_t flags;          // SMTRACE_F_*
+    uint8_t reserved;
+} smtrace_record_t;
+
+_Static_assert(sizeof(smtrace_record_t) == 12, "smtrace_record_t must be 12 bytes, see tools/smtrace_decode.py");
+
+typedef struct {
+    uint32_t recorded;      // records written in the ring
+    uint32_t dropped;       // records lost because the ring was full
+} smtrace_stats_t;
+
+// Filter masks. A record is written only if the bits of its machine id, event and s1 are set.
+// Machine ids and states above 31 and events above 63 always pass.
+extern _Atomic uint32_t smtrace_machine_mask;
+extern _Atomic uint64_t smtrace_event_mask;
+extern _Atomic uint32_t smtrace_state_mask;
+
+void smtrace_init(void);
+void smtrace_set_filter(uint32_t machine_mask, uint64_t event_mask, uint32_t state_mask);
+void smtrace_put(uint16_t machine_id, uint8_t s1, uint8_t s2, uint8_t event, uint8_t actidx, uint8_t flags);
+size_t smtrace_read(smtrace_record_t* records, size_t max);
+void smtrace_dump(void);
+void smtrace_get_stats(smtrace_stats_t* stats);
+
+static inline bool smtrace_bit32(uint32_t mask, uint32_t bit)
+{
+    return (bit >= 32) || ((mask >> bit) & 1u);
+}
+
+// static inline bool smtrace_wants(uint16_t machine_id, sm_event_type_t event, uint8_t s1)
+// Description: Filter test made before a record is built. When tracing of a machine is off,
+// the cost is one load and one bit test.
+static inline bool smtrace_wants(uint16_t machine_id, sm_event_type_t event, uint8_t s1)
+{
+    if (!smtrace_bit32(atomic_load_explicit(&smtrace_machine_mask, memory_order_relaxed), machine_id)) {
+        return false;
+    }
+    uint64_t event_mask = atomic_load_explicit(&smtrace_event_mask, memory_order_relaxed);
+    return ((uint32_t)event >= 64 || ((event_mask >> event) & 1u)) &&
+           smtrace_bit32(atomic_load_explicit(&smtrace_state_mask, memory_order_relaxed), s1);
+}
+
+static inline void smtrace_transition(uint16_t machine_id, uint8_t s1, uint8_t s2, sm_event_type_t event, uint8_t actidx, bool permitted)
+{
+    if (smtrace_wants(machine_id, event, s1)) {
+        smtrace_put(machine_id, s1, s2, (uint8_t)event, actidx, permitted ? SMTRACE_F_PERMITTED : 0);
+    }
+}
+
+static inline void smtrace_lost_event(uint16_t machine_id, uint8_t s1, sm_event_type_t event)
+{
+    if (smtrace_wants(machine_id, event, s1)) {
+        smtrace_put(machine_id, s1, s1, (uint8_t)event, SMTRACE_ACTIDX_NONE, SMTRACE_F_LOST);
+    }
+}
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of smtrace.h
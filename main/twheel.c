@@ -0,0 +1,444 @@
+// twheel.c
+
+#include "sdkconfig.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "commondefs.h"
+#include "evloop.h"
+#include "twheel.h"
+
+static const char TAG[] = "TWHEEL";
+
+#define TWHEEL_TICK_US      ((int64_t)CONFIG_TWHEEL_TICK_MS * 1000)
+#define TWHEEL_SLOT_MASK    (TWHEEL_SLOTS - 1)
+#define TWHEEL_FIRE_BATCH   (8)     // events posted per pass of the callback, outside the critical section
+
+// Event of an expired timer, copied out of the critical section
+typedef struct {
+    sm_event_type_t event;
+    uint16_t target;
+} twheel_fired_t;
+
+// Slot lists and a bit map of the occupied slots of every level. wheel_now is the tick up to which the
+// wheel is processed; it lags the time while the wheel waits for its next occupied slot.
+static twheel_timer_t* slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+static uint64_t occupied[TWHEEL_LEVELS];
+static uint32_t wheel_now = 0;
+static esp_timer_handle_t wheel_timer = NULL;
+static bool armed = false;
+static uint32_t armed_tick = 0;
+static portMUX_TYPE wheel_mux = portMUX_INITIALIZER_UNLOCKED;
+
+FORCE_INLINE_ATTR uint32_t twheel_level_shift(uint32_t level)
+{
+    return level * TWHEEL_SLOT_BITS;
+}
+
+static IRAM_ATTR void twheel_link(twheel_timer_t* t)
+{
+    uint32_t delta = t->expires - wheel_now;
+    uint32_t level = 0;
+
+    while ((level < TWHEEL_LEVELS - 1) && (delta >= (1u << twheel_level_shift(level + 1)))) {
+        level++;
+    }
+    uint32_t slot = (t->expires >> twheel_level_shift(level)) & TWHEEL_SLOT_MASK;
+
+    t->level = level;
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = slots[level][slot];
+    if (t->next != NULL) {
+        t->next->prev = t;
+    }
+    slots[level][slot] = t;
+    occupied[level] |= (1ull << slot);
+    t->active = true;
+}
+
+static IRAM_ATTR void twheel_unlink(twheel_timer_t* t)
+{
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    }
+    else {
+        slots[t->level][t->slot] = t->next;
+        if (t->next == NULL) {
+            occupied[t->level] &= ~(1ull << t->slot);
+        }
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    t->next = t->prev = NULL;
+    t->active = false;
+}
+
+// static bool twheel_next(uint32_t* tick)
+// Input:
+//  tick: pointer to a variable where the tick to be written
+// Output: false if the wheel is empty
+// Description: This function finds the first tick after wheel_now at which the wheel has work: the tick of
+// the first occupied slot of level 0 or the start of the first occupied slot of a higher level, when its
+// timers are cascaded down. A slot of a higher level equal to the current one is a whole rotation away.
+static IRAM_ATTR bool twheel_next(uint32_t* tick)
+{
+    bool found = false;
+
+    for (uint32_t level = 0; level < TWHEEL_LEVELS; level++) {
+        uint64_t map = occupied[level];
+        if (map == 0) {
+            continue;
+        }
+        uint32_t shift = twheel_level_shift(level);
+        uint32_t cur = (wheel_now >> shift) & TWHEEL_SLOT_MASK;
+        uint32_t rot = (cur + 1) & TWHEEL_SLOT_MASK;
+        uint64_t ahead = (rot == 0) ? map : ((map >> rot) | (map << (TWHEEL_SLOTS - rot)));
+        uint32_t d = __builtin_ctzll(ahead) + 1;    // slots from cur, 1..TWHEEL_SLOTS
+        uint32_t t = (level == 0) ? wheel_now + d : ((wheel_now >> shift) + d) << shift;
+        if (!found || ((int32_t)(t - *tick) < 0)) {
+            *tick = t;
+            found = true;
+        }
+    }
+    return found;
+}
+
+static IRAM_ATTR void twheel_cascade(uint32_t level)
+{
+    uint32_t slot = (wheel_now >> twheel_level_shift(level)) & TWHEEL_SLOT_MASK;
+    twheel_timer_t* t = slots[level][slot];
+
+    slots[level][slot] = NULL;
+    occupied[level] &= ~(1ull << slot);
+    while (t != NULL) {
+        twheel_timer_t* next = t->next;
+        twheel_link(t);
+        t = next;
+    }
+}
+
+// static size_t twheel_collect(uint32_t target, twheel_fired_t* fired, size_t max)
+// Input:
+//  target: tick up to which the wheel to be processed
+//  fired: array where the events and the receivers of the expired timers to be written
+//  max: size of fired
+// Output: number of events written; max if the wheel stopped before target
+// Description: This function advances the wheel from one tick with work to the next, cascading the
+// higher levels at their slot boundaries and expiring the timers of level 0. Periodic timers are linked
+// again for their next period. Called with wheel_mux taken.
+static IRAM_ATTR size_t twheel_collect(uint32_t target, twheel_fired_t* fired, size_t max)
+{
+    size_t n = 0;
+
+    while (true) {
+        twheel_timer_t* t;
+        while ((n < max) && ((t = slots[0][wheel_now & TWHEEL_SLOT_MASK]) != NULL)) {
+            twheel_unlink(t);
+            fired[n].event = t->event;
+            fired[n++].target = t->target;
+            if (t->period != 0) {
+                t->expires += t->period;
+                twheel_link(t);
+            }
+        }
+        if (n == max) {
+            return n;
+        }
+
+        uint32_t next;
+        if (!twheel_next(&next) || ((int32_t)(next - target) > 0)) {
+            wheel_now = target;
+            return n;
+        }
+        wheel_now = next;
+        for (uint32_t level = TWHEEL_LEVELS - 1; level > 0; level--) {
+            if ((wheel_now & ((1u << twheel_level_shift(level)) - 1)) == 0) {
+                twheel_cascade(level);
+            }
+        }
+    }
+}
+
+// static void twheel_arm(void)
+// Input: none
+// Output: none
+// Description: This function arms the esp_timer for the next tick with work, unless it is armed for that
+// tick or an earlier one already. A timer stopped after arming costs one spurious callback at most.
+static IRAM_ATTR void twheel_arm(void)
+{
+    uint32_t next;
+
+    if (!twheel_next(&next) || (armed && ((int32_t)(next - armed_tick) >= 0))) {
+        return;
+    }
+    int64_t now_us = esp_timer_get_time();
+    int64_t timeout = (int64_t)(int32_t)(next - (uint32_t)(now_us / TWHEEL_TICK_US)) * TWHEEL_TICK_US - now_us % TWHEEL_TICK_US;
+    if (timeout < 0) {
+        timeout = 0;
+    }
+    if (esp_timer_restart(wheel_timer, timeout) != ESP_OK) {
+        esp_timer_start_once(wheel_timer, timeout);
+    }
+    armed = true;
+    armed_tick = next;
+}
+
+// The only esp_timer of the wheel. With CONFIG_EVLOOP_TIMER_ISR_DISPATCH it runs in the esp_timer ISR.
+static IRAM_ATTR void twheel_timer_cb(void* arg)
+{
+    twheel_fired_t fired[TWHEEL_FIRE_BATCH];
+    size_t n;
+#if defined(CONFIG_EVLOOP_TIMER_ISR_DISPATCH)
+    BaseType_t woken = pdFALSE;
+#endif  // defined(CONFIG_EVLOOP_TIMER_ISR_DISPATCH)
+
+    do {
+        portENTER_CRITICAL_SAFE(&wheel_mux);
+        armed = false;
+        n = twheel_collect((uint32_t)(esp_timer_get_time() / TWHEEL_TICK_US), fired, ARRAY_SIZE(fired));
+        if (n < ARRAY_SIZE(fired)) {
+            twheel_arm();
+        }
+        portEXIT_CRITICAL_SAFE(&wheel_mux);
+
+        for (size_t i = 0; i < n; i++) {
+#if defined(CONFIG_EVLOOP_TIMER_ISR_DISPATCH)
+            evloop_post_to_from_isr(fired[i].target, fired[i].event, &woken);
+#else
+            evloop_post_to(fired[i].target, fired[i].event);
+#endif  // defined(CONFIG_EVLOOP_TIMER_ISR_DISPATCH)
+        }
+    } while (n == ARRAY_SIZE(fired));
+
+#if defined(CONFIG_EVLOOP_TIMER_ISR_DISPATCH)
+    if (woken == pdTRUE) {
+        esp_timer_isr_dispatch_need_yield();
+    }
+#endif  // defined(CONFIG_EVLOOP_TIMER_ISR_DISPATCH)
+}
+
+// esp_err_t twheel_init(void)
+// Input: none
+// Output: ESP error code of esp_timer_create()
+// Description: This function creates the esp_timer of the wheel. It is called once, before any timer is
+// started.
+esp_err_t twheel_init(void)
+{
+    if (wheel_timer != NULL) {
+        return ESP_OK;
+    }
+    esp_timer_create_args_t tca = {
+        .callback = twheel_timer_cb,
+        .arg = NULL,
+        .dispatch_method = EVLOOP_TIMER_DISPATCH,
+        .name = "twheel",
+        .skip_unhandled_events = true,
+    };
+    wheel_now = (uint32_t)(esp_timer_get_time() / TWHEEL_TICK_US);
+    return esp_timer_create(&tca, &wheel_timer);
+}
+
+// static esp_err_t twheel_start(twheel_timer_t* timer, uint32_t ms, uint32_t period)
+// Input:
+//  timer: timer, active or not
+//  ms: time to the first expiry
+//  period: ticks, 0 for a one-shot timer
+// Output: ESP_OK, ESP_ERR_INVALID_ARG or ESP_ERR_INVALID_STATE if twheel_init() was not called
+// Description: This function (re)starts a timer. An idle wheel is first moved to the current tick, so the
+// new timer is linked relative to it; a busy wheel is moved as far as it has no work.
+static esp_err_t twheel_start(twheel_timer_t* timer, uint32_t ms, uint32_t period)
+{
+    uint32_t ticks = (ms + CONFIG_TWHEEL_TICK_MS - 1) / CONFIG_TWHEEL_TICK_MS;
+
+    if ((timer == NULL) || (ticks > TWHEEL_MAX_TICKS)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (wheel_timer == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (ticks == 0) {
+        ticks = 1;
+    }
+
+    portENTER_CRITICAL_SAFE(&wheel_mux);
+    if (timer->active) {
+        twheel_unlink(timer);
+    }
+    uint32_t now = (uint32_t)(esp_timer_get_time() / TWHEEL_TICK_US);
+    uint32_t next;
+    if (!twheel_next(&next) || ((int32_t)(next - now) > 0)) {
+        wheel_now = now;
+    }
+    else {
+        wheel_now = next - 1;
+    }
+    timer->expires = now + ticks;
+    timer->period = period;
+    twheel_link(timer);
+    twheel_arm();
+    portEXIT_CRITICAL_SAFE(&wheel_mux);
+    return ESP_OK;
+}
+
+// esp_err_t twheel_start_once(twheel_timer_t* timer, uint32_t timeout_ms)
+// Input:
+//  timer: timer, active or not
+//  timeout_ms: time to the expiry, rounded up to CONFIG_TWHEEL_TICK_MS
+// Output: see twheel_start()
+// Description: This function starts a one-shot timer. An active timer is moved to the new expiry.
+esp_err_t twheel_start_once(twheel_timer_t* timer, uint32_t timeout_ms)
+{
+    return twheel_start(timer, timeout_ms, 0);
+}
+
+// esp_err_t twheel_start_periodic(twheel_timer_t* timer, uint32_t period_ms)
+// Input:
+//  timer: timer, active or not
+//  period_ms: period, rounded up to CONFIG_TWHEEL_TICK_MS
+// Output: see twheel_start()
+// Description: This function starts a periodic timer. An active timer is restarted with the new period.
+// The expiries follow the first one by whole periods, so the period does not drift with the callback
+// latency.
+esp_err_t twheel_start_periodic(twheel_timer_t* timer, uint32_t period_ms)
+{
+    uint32_t ticks = (period_ms + CONFIG_TWHEEL_TICK_MS - 1) / CONFIG_TWHEEL_TICK_MS;
+    return twheel_start(timer, period_ms, (ticks == 0) ? 1 : ticks);
+}
+
+// esp_err_t twheel_start_periodic_at(twheel_timer_t* timer, uint32_t first_ms, uint32_t period_ms)
+// Input:
+//  timer: timer, active or not
+//  first_ms: time to the first expiry, rounded up to CONFIG_TWHEEL_TICK_MS
+//  period_ms: period, rounded up to CONFIG_TWHEEL_TICK_MS
+// Output: see twheel_start()
+// Description: This function starts a periodic timer whose first expiry is not one period away. Timers of
+// the same period started together can so be spread over the period instead of expiring in one burst.
+esp_err_t twheel_start_periodic_at(twheel_timer_t* timer, uint32_t first_ms, uint32_t period_ms)
+{
+    uint32_t ticks = (period_ms + CONFIG_TWHEEL_TICK_MS - 1) / CONFIG_TWHEEL_TICK_MS;
+    return twheel_start(timer, first_ms, (ticks == 0) ? 1 : ticks);
+}
+
+// esp_err_t twheel_stop(twheel_timer_t* timer)
+// Input:
+//  timer: timer
+// Output: ESP_OK or ESP_ERR_INVALID_STATE if the timer is not active
+// Description: This function stops a timer. The esp_timer is not touched.
+esp_err_t twheel_stop(twheel_timer_t* timer)
+{
+    esp_err_t ret = ESP_ERR_INVALID_STATE;
+
+    portENTER_CRITICAL_SAFE(&wheel_mux);
+    if (timer->active) {
+        twheel_unlink(timer);
+        ret = ESP_OK;
+    }
+    portEXIT_CRITICAL_SAFE(&wheel_mux);
+    return ret;
+}
+
+bool twheel_is_active(const twheel_timer_t* timer)
+{
+    return timer->active;
+}
+
+#if defined(CONFIG_TWHEEL_BENCHMARK)
+
+static void twheel_benchmark_cb(void* arg)
+{
+}
+
+// void twheel_benchmark(void)
+// Input: none
+// Output: none
+// Description: This function starts, restarts and stops CONFIG_TWHEEL_BENCHMARK_TIMERS timers of the wheel
+// and as many esp_timers with the same random timeouts, and logs the time per operation. The timeouts
+// are 10 to 70 s, so no timer expires during the benchmark.
+void twheel_benchmark(void)
+{
+    const uint32_t n = CONFIG_TWHEEL_BENCHMARK_TIMERS;
+    twheel_timer_t* wt = calloc(n, sizeof(twheel_timer_t));
+    esp_timer_handle_t* et = calloc(n, sizeof(esp_timer_handle_t));
+    uint32_t* timeouts = calloc(n, sizeof(uint32_t));
+    uint32_t seed = 12345;
+
+    if ((wt == NULL) || (et == NULL) || (timeouts == NULL)) {
+        ESP_LOGE(TAG, "Benchmark: out of memory");
+        goto out;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        seed = seed * 1103515245u + 12345u;
+        timeouts[i] = 10000 + (seed >> 8) % 60000;
+        wt[i].event = evNullEvent;
+        wt[i].target = EVLOOP_TARGET_ALL;
+        esp_timer_create_args_t tca = {
+            .callback = twheel_benchmark_cb,
+            .arg = NULL,
+            .dispatch_method = ESP_TIMER_TASK,
+            .name = "twheel_bench",
+        };
+        if (esp_timer_create(&tca, &et[i]) != ESP_OK) {
+            ESP_LOGE(TAG, "Benchmark: cannot create esp_timer %" PRIu32, i);
+            while (i > 0) {
+                esp_timer_delete(et[--i]);
+            }
+            goto out;
+        }
+    }
+
+    int64_t t[7];
+    t[0] = esp_timer_get_time();
+    for (uint32_t i = 0; i < n; i++) {
+        esp_timer_start_once(et[i], (uint64_t)timeouts[i] * 1000);
+    }
+    t[1] = esp_timer_get_time();
+    for (uint32_t i = 0; i < n; i++) {
+        esp_timer_restart(et[i], (uint64_t)timeouts[n - 1 - i] * 1000);
+    }
+    t[2] = esp_timer_get_time();
+    for (uint32_t i = 0; i < n; i++) {
+        esp_timer_stop(et[i]);
+    }
+    t[3] = esp_timer_get_time();
+    for (uint32_t i = 0; i < n; i++) {
+        twheel_start_once(&wt[i], timeouts[i]);
+    }
+    t[4] = esp_timer_get_time();
+    for (uint32_t i = 0; i < n; i++) {
+        twheel_start_once(&wt[i], timeouts[n - 1 - i]);
+    }
+    t[5] = esp_timer_get_time();
+    for (uint32_t i = 0; i < n; i++) {
+        twheel_stop(&wt[i]);
+    }
+    t[6] = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Benchmark, %" PRIu32 " timers, ns per operation:", n);
+    ESP_LOGI(TAG, "esp_timer: start %" PRIu32 ", restart %" PRIu32 ", stop %" PRIu32,
+        (uint32_t)((t[1] - t[0]) * 1000 / n), (uint32_t)((t[2] - t[1]) * 1000 / n), (uint32_t)((t[3] - t[2]) * 1000 / n));
+    ESP_LOGI(TAG, "twheel: start %" PRIu32 ", restart %" PRIu32 ", stop %" PRIu32,
+        (uint32_t)((t[4] - t[3]) * 1000 / n), (uint32_t)((t[5] - t[4]) * 1000 / n), (uint32_t)((t[6] - t[5]) * 1000 / n));
+    ESP_LOGI(TAG, "twheel: %u bytes per timer, %u bytes of slots", (unsigned)sizeof(twheel_timer_t), (unsigned)sizeof(slots));
+
+    for (uint32_t i = 0; i < n; i++) {
+        esp_timer_delete(et[i]);
+    }
+out:
+    free(wt);
+    free(et);
+    free(timeouts);
+}
+
+#endif  // defined(CONFIG_TWHEEL_BENCHMARK)
+
+// end of twheel.c
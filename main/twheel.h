@@ -0,0 +1,62 @@
+// twheel.h
+
+#pragma once
+
+#if defined(__cplusplus)
+extern "C" {    // allow use with C++ compilers
+#endif
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+#include "events.h"
+#include "evloop.h"
+
+// Timer wheel. All application timers share one esp_timer: they are kept in a hierarchical wheel of
+// TWHEEL_LEVELS levels of TWHEEL_SLOTS slots, level L slots being TWHEEL_SLOTS^L ticks of
+// CONFIG_TWHEEL_TICK_MS wide. Start, restart and stop unlink and link a timer in a slot list, O(1).
+// The esp_timer is armed once for the earliest occupied slot, so an idle wheel takes no interrupts.
+// An expired timer posts its event to the event loop, to all subscribers or to one machine.
+
+#define TWHEEL_SLOT_BITS    (6)
+#define TWHEEL_SLOTS        (1u << TWHEEL_SLOT_BITS)
+#define TWHEEL_LEVELS       (4)
+// Longest timeout. Timers beyond TWHEEL_SLOTS^TWHEEL_LEVELS ticks stay in the last level and are cascaded
+// once per rotation of it until they come in range.
+#define TWHEEL_MAX_TICKS    (0x3FFFFFFFu)
+
+// Timer. The storage belongs to the user and must stay valid while the timer is active. A zeroed timer is
+// not active; set event and target before starting it.
+typedef struct twheel_timer {
+    struct twheel_timer* next;      // slot list
+    struct twheel_timer* prev;
+    uint32_t expires;               // tick
+    uint32_t period;                // ticks, 0 for a one-shot timer
+    sm_event_type_t event;          // posted on expiry
+    uint16_t target;                // receiver, see evloop_post_to(); EVLOOP_TARGET_ALL for all subscribers
+    uint8_t level;
+    uint8_t slot;
+    bool active;
+} twheel_timer_t;
+
+#define TWHEEL_TIMER_INITIALIZER_TO(ev, tgt)    { .next = NULL, .prev = NULL, .expires = 0, .period = 0, .event = (ev), .target = (tgt), .active = false }
+#define TWHEEL_TIMER_INITIALIZER(ev)            TWHEEL_TIMER_INITIALIZER_TO(ev, EVLOOP_TARGET_ALL)
+
+esp_err_t twheel_init(void);
+esp_err_t twheel_start_once(twheel_timer_t* timer, uint32_t timeout_ms);
+esp_err_t twheel_start_periodic(twheel_timer_t* timer, uint32_t period_ms);
+esp_err_t twheel_start_periodic_at(twheel_timer_t* timer, uint32_t first_ms, uint32_t period_ms);
+esp_err_t twheel_stop(twheel_timer_t* timer);
+bool twheel_is_active(const twheel_timer_t* timer);
+#if defined(CONFIG_TWHEEL_BENCHMARK)
+void twheel_benchmark(void);
+#endif  // defined(CONFIG_TWHEEL_BENCHMARK)
+
+#if defined(__cplusplus)
+}   // end of extern "C"
+#endif
+
+// end of twheel.h
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+# smrec_extract.py
+#
+# Writes the event recording printed by smrec_dump() (a line containing "SMRH:<hex>" with the header, then
+# lines containing "SMR:<hex>" with the records) to a .smrec file, which host_replay/ plays back. A log with
+# several recordings, e.g. over resets, holds one header per recording; the last one is written by default.
+#
+# Usage: python tools/smrec_extract.py [-o OUTPUT] [-n INDEX] [LOGFILE]
+#   LOGFILE defaults to stdin, so the tool can be used as: idf.py monitor | python tools/smrec_extract.py
+
+import argparse
+import re
+import struct
+import sys
+
+HEADER = struct.Struct("<IHBBI")        # must match smrec_header_t in main/smrec.h
+RECORD = struct.Struct("<IHBBBBBB")     # must match smrec_record_t in main/smrec.h
+MAGIC = 0x31524D53
+VERSION = 1
+KIND_POST = 0
+KIND_TRANSITION = 1
+
+
+def extract(stream):
+    """Return the recordings of a log as a list of (header bytes, record bytes)."""
+    recordings = []
+    for line in stream:
+        m = re.search(r"SMRH:([0-9a-fA-F]+)", line)
+        if m is not None:
+            header = bytes.fromhex(m.group(1))
+            if len(header) != HEADER.size:
+                print("skipping a header of %d bytes" % len(header), file=sys.stderr)
+                continue
+            recordings.append((header, bytearray()))
+            continue
+        m = re.search(r"SMR:([0-9a-fA-F]+)", line)
+        if m is None or not recordings:
+            continue
+        data = bytes.fromhex(m.group(1))
+        recordings[-1][1].extend(data[:len(data) - len(data) % RECORD.size])
+    return recordings
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Extract an smrec event recording from a monitor log")
+    parser.add_argument("logfile", nargs="?", help="monitor log (default: stdin)")
+    parser.add_argument("-o", "--output", default="recording.smrec", help="output file (default: recording.smrec)")
+    parser.add_argument("-n", "--index", default=-1, type=int,
+                        help="recording to write, 0 for the first one (default: -1, the last one)")
+    args = parser.parse_args()
+
+    if args.logfile:
+        with open(args.logfile, errors="replace") as stream:
+            recordings = extract(stream)
+    else:
+        recordings = extract(sys.stdin)
+    if not recordings:
+        sys.exit("no recording found")
+
+    header, records = recordings[args.index]
+    magic, version, record_size, events, _ = HEADER.unpack(header)
+    if magic != MAGIC or version != VERSION or record_size != RECORD.size:
+        sys.exit("unsupported recording: magic 0x%08x, version %d, record size %d" % (magic, version, record_size))
+
+    posts = transitions = 0
+    for offset in range(0, len(records), RECORD.size):
+        kind = RECORD.unpack_from(records, offset)[2]
+        posts += kind == KIND_POST
+        transitions += kind == KIND_TRANSITION
+
+    with open(args.output, "wb") as f:
+        f.write(header)
+        f.write(records)
+    print("%s: %d events, %d posts, %d transitions (recording %d of %d)" % (
+        args.output, events, posts, transitions, args.index % len(recordings) + 1, len(recordings)),
+        file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+# smtrace_decode.py
+#
+# Decodes the binary transition trace printed by smtrace_dump() (lines containing "SMT:<hex>") back to
+# event and state names. The names are taken from the X-macros of the application:
+#   EVENT_LIST in main/include/events.h
+#   P<n>_STATES and P<n>_ID in main/process.h
+#
+# Usage: python tools/smtrace_decode.py [-p PROJECT_DIR] [LOGFILE]
+#   LOGFILE defaults to stdin, so the tool can be used as: idf.py monitor | python tools/smtrace_decode.py
+
+import argparse
+import re
+import struct
+import sys
+from pathlib import Path
+
+RECORD = struct.Struct("<IHBBBBBB")     # must match smtrace_record_t in main/smtrace.h
+F_PERMITTED = 0x01
+F_LOST = 0x02
+ACTIDX_NONE = 0xFF
+
+X_ITEM = re.compile(r"X\((\w+)\s*[,)]")     # X(name) or X(name, attributes)
+
+
+def macro_body(text, name):
+    """Return the body of a multi-line #define."""
+    m = re.search(r"#define\s+" + name + r"\s*((?:.*\\\n)*.*)", text)
+    if m is None:
+        return None
+    return m.group(1)
+
+
+def load_names(project):
+    events_h = (project / "main" / "include" / "events.h").read_text()
+    process_h = (project / "main" / "process.h").read_text()
+
+    events = X_ITEM.findall(macro_body(events_h, "EVENT_LIST") or "")
+
+    states = {}
+    for m in re.finditer(r"#define\s+P(\d+)_ID\s+\(?\s*(\d+)\s*\)?", process_h):
+        body = macro_body(process_h, "P" + m.group(1) + "_STATES")
+        if body is not None:
+            states[int(m.group(2))] = X_ITEM.findall(body)
+    return events, states
+
+
+def name(names, index):
+    return names[index] if index < len(names) else "#%d" % index
+
+
+def decode(stream, events, states):
+    last = None
+    wraps = 0
+    for line in stream:
+        m = re.search(r"SMT:([0-9a-fA-F]+)", line)
+        if m is None:
+            continue
+        data = bytes.fromhex(m.group(1))
+        for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+            ts, mid, s1, s2, ev, act, flags, _ = RECORD.unpack_from(data, offset)
+            # timestamp is the low 32 bits of esp_timer_get_time()
+            if last is not None and ts < last:
+                wraps += 1
+            last = ts
+            t = (wraps << 32) + ts
+            snames = states.get(mid, [])
+            if flags & F_LOST:
+                print("%12.6f ID=%04d: Lost ev: %s, state: %s" % (t / 1e6, mid, name(events, ev), name(snames, s1)))
+            else:
+                print("%12.6f ID=%04d, S1=%s, S2=%s, Event=%s, Action=P%da%d %spermitted" % (
+                    t / 1e6, mid, name(snames, s1), name(snames, s2), name(events, ev), mid,
+                    act, "" if flags & F_PERMITTED else "not "))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode smtrace binary transition records")
+    parser.add_argument("logfile", nargs="?", help="monitor log (default: stdin)")
+    parser.add_argument("-p", "--project", default=Path(__file__).resolve().parent.parent, type=Path,
+                        help="project directory (default: parent of tools/)")
+    args = parser.parse_args()
+
+    events, states = load_names(args.project)
+    if args.logfile:
+        with open(args.logfile, errors="replace") as stream:
+            decode(stream, events, states)
+    else:
+        decode(sys.stdin, events, states)
+
+
+if __name__ == "__main__":
+    main()